@@ -1,6 +1,7 @@
 // vic
 
 #define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700   /* wcwidth(), and the wide-character curses API */
 #include <signal.h>
 #include <limits.h>
 #include <ncurses.h>
@@ -15,6 +16,23 @@
 #include <strings.h>
 #include <sys/stat.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <wchar.h>
+#include <pthread.h>
+#include <regex.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #define MAX_BUFFERS   50
 #define INITIAL_LINE_CAP 1024
@@ -22,6 +40,18 @@
 
 #define CMDHIST_MAX   25
 
+/* The extended-colour calls of ncurses 6.1 take int colours, which is what
+ * direct-colour terminals (COLORS = 2^24, colour number = 0xRRGGBB) need.
+ * Only the wide library (ncursesw) exports them. */
+#if defined(NCURSES_VERSION_MAJOR) && NCURSES_WIDECHAR && \
+    (NCURSES_VERSION_MAJOR > 6 || (NCURSES_VERSION_MAJOR == 6 && NCURSES_VERSION_MINOR >= 1))
+#define HAVE_EXTENDED_COLOR 1
+#endif
+
+/* Bracketed-paste markers ESC[200~ / ESC[201~, bound with define_key. */
+#define KEY_PASTE_BEGIN (KEY_MAX + 1)
+#define KEY_PASTE_END   (KEY_MAX + 2)
+
 /* safe_strdup: wraps strdup() and aborts on OOM.
  * For a terminal editor, out-of-memory is unrecoverable; a clean abort with a
  * message is better than a NULL-deref crash somewhere later.
@@ -36,6 +66,678 @@ static char *safe_strdup(const char *s) {
     return r;
 }
 
+/* Ask the terminal to wrap pastes in ESC[200~ ... ESC[201~ (on) or not.
+ * Turned off around shell-outs so other programs get plain input.  Uses
+ * write(2) so the crash handler can call it too. */
+static void term_bracketed_paste(int on) {
+#ifdef NCURSES_EXT_FUNCS
+    const char *seq = on ? "\033[?2004h" : "\033[?2004l";
+    ssize_t r = write(STDOUT_FILENO, seq, strlen(seq));
+    (void)r;
+#else
+    (void)on;
+#endif
+}
+
+// -----------------------------
+// Byte scanning
+// scan_until() finds the first byte of a set of classes 16 at a time
+// (SSE2 on x86-64, NEON on arm64; 8 at a time with 64-bit arithmetic
+// elsewhere), so the usual all-printable, escape-free log line skips the
+// per-character paths.  Callers pass the length: nothing past it is read.
+// -----------------------------
+enum {
+    SCAN_HIGH = 1 << 0,   /* 0x80..0xFF: UTF-8 */
+    SCAN_CTRL = 1 << 1,   /* below 0x20 or 0x7F, TAB, ESC and BS included */
+    SCAN_ESC  = 1 << 2,
+    SCAN_BS   = 1 << 3,
+    SCAN_TAB  = 1 << 4,
+};
+
+static inline int scan_hit(unsigned char c, unsigned cls) {
+    return ((cls & SCAN_HIGH) && c >= 0x80)
+        || ((cls & SCAN_CTRL) && (c < 0x20 || c == 0x7F))
+        || ((cls & SCAN_ESC) && c == 0x1B)
+        || ((cls & SCAN_BS) && c == '\b')
+        || ((cls & SCAN_TAB) && c == '\t');
+}
+
+/* The one-byte-at-a-time version; also finishes the last partial block. */
+static size_t scan_until_scalar(const char *s, size_t n, unsigned cls) {
+    size_t i = 0;
+    while (i < n && !scan_hit((unsigned char)s[i], cls)) i++;
+    return i;
+}
+
+/* Offset of the first of s[0..n) in any class of `cls`, or n. */
+static size_t scan_until(const char *s, size_t n, unsigned cls) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i lo = _mm_set1_epi8(0x20), del = _mm_set1_epi8(0x7F), neg = _mm_set1_epi8(-1);
+    const __m128i esc = _mm_set1_epi8(0x1B), bs = _mm_set1_epi8('\b'), tab = _mm_set1_epi8('\t');
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i bad = _mm_setzero_si128();
+        if (cls & SCAN_CTRL)
+            bad = _mm_or_si128(_mm_and_si128(_mm_cmplt_epi8(v, lo), _mm_cmpgt_epi8(v, neg)),
+                               _mm_cmpeq_epi8(v, del));
+        if (cls & SCAN_ESC) bad = _mm_or_si128(bad, _mm_cmpeq_epi8(v, esc));
+        if (cls & SCAN_BS)  bad = _mm_or_si128(bad, _mm_cmpeq_epi8(v, bs));
+        if (cls & SCAN_TAB) bad = _mm_or_si128(bad, _mm_cmpeq_epi8(v, tab));
+        int m = _mm_movemask_epi8(bad);
+        if (cls & SCAN_HIGH) m |= _mm_movemask_epi8(v);
+        if (m) return i + (size_t)__builtin_ctz((unsigned)m);
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    const uint8x16_t lo = vdupq_n_u8(0x20), del = vdupq_n_u8(0x7F), hi = vdupq_n_u8(0x80);
+    const uint8x16_t esc = vdupq_n_u8(0x1B), bs = vdupq_n_u8('\b'), tab = vdupq_n_u8('\t');
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t*)(s + i));
+        uint8x16_t bad = vdupq_n_u8(0);
+        if (cls & SCAN_HIGH) bad = vorrq_u8(bad, vcgeq_u8(v, hi));
+        if (cls & SCAN_CTRL) bad = vorrq_u8(bad, vorrq_u8(vcltq_u8(v, lo), vceqq_u8(v, del)));
+        if (cls & SCAN_ESC)  bad = vorrq_u8(bad, vceqq_u8(v, esc));
+        if (cls & SCAN_BS)   bad = vorrq_u8(bad, vceqq_u8(v, bs));
+        if (cls & SCAN_TAB)  bad = vorrq_u8(bad, vceqq_u8(v, tab));
+        if (vmaxvq_u8(bad)) return i + scan_until_scalar(s + i, 16, cls);
+    }
+#else
+    /* Per-byte "below k" / "equal" tests on eight bytes at once; the
+     * lowest flagged byte is always a real hit */
+    const uint64_t ones = 0x0101010101010101ull, highs = 0x8080808080808080ull;
+#define SCAN_LESS(x, k) (((x) - ones * (k)) & ~(x) & highs)
+#define SCAN_EQ(x, c)   SCAN_LESS((x) ^ (ones * (c)), 1)
+    for (; i + 8 <= n; i += 8) {
+        uint64_t x;
+        memcpy(&x, s + i, 8);
+        uint64_t bad = 0;
+        if (cls & SCAN_HIGH) bad |= x & highs;
+        if (cls & SCAN_CTRL) bad |= (SCAN_LESS(x & ~highs, 0x20) & ~x) | SCAN_EQ(x, 0x7F);
+        if (cls & SCAN_ESC)  bad |= SCAN_EQ(x, 0x1B);
+        if (cls & SCAN_BS)   bad |= SCAN_EQ(x, '\b');
+        if (cls & SCAN_TAB)  bad |= SCAN_EQ(x, '\t');
+        if (bad) {
+            /* borrows can flag bytes above a hit; the scalar pass is exact */
+            size_t k = scan_until_scalar(s + i, 8, cls);
+            if (k < 8) return i + k;
+        }
+    }
+#undef SCAN_LESS
+#undef SCAN_EQ
+#endif
+    return i + scan_until_scalar(s + i, n - i, cls);
+}
+
+// -----------------------------
+// Display width
+// UTF-8 decoding and terminal cell widths, measured per grapheme cluster:
+// a base character plus the combining marks, variation selectors, emoji
+// modifiers and ZWJ continuations drawn in its cells.  Widths are libc's
+// wcwidth(), which is also what ncursesw places characters by, memoised
+// per BMP code point.  Printable ASCII never leaves the fast path.
+// -----------------------------
+#define TAB_WIDTH 4
+#define GC_MAX_BYTES 32   /* longer clusters are cut, the same way everywhere */
+
+/* Decode the UTF-8 sequence at s (s[0] != 0) into *cp and return its
+ * length.  A malformed, overlong or truncated sequence is one byte of
+ * U+FFFD; nothing past a NUL is read. */
+static int utf8_decode(const char *s, uint32_t *cp) {
+    const unsigned char *u = (const unsigned char*)s;
+    uint32_t c = u[0], min;
+    int n;
+    if (c < 0x80) { *cp = c; return 1; }
+    if ((c & 0xE0) == 0xC0)      { n = 2; c &= 0x1F; min = 0x80; }
+    else if ((c & 0xF0) == 0xE0) { n = 3; c &= 0x0F; min = 0x800; }
+    else if ((c & 0xF8) == 0xF0) { n = 4; c &= 0x07; min = 0x10000; }
+    else { *cp = 0xFFFD; return 1; }
+    for (int k = 1; k < n; k++) {
+        if ((u[k] & 0xC0) != 0x80) { *cp = 0xFFFD; return 1; }
+        c = c << 6 | (u[k] & 0x3F);
+    }
+    if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) { *cp = 0xFFFD; return 1; }
+    *cp = c;
+    return n;
+}
+
+/* Write cp as UTF-8 to out (4 bytes of room); returns the length. */
+static int utf8_encode(uint32_t cp, char *out) {
+    if (cp < 0x80) { out[0] = (char)cp; return 1; }
+    if (cp < 0x800) {
+        out[0] = (char)(0xC0 | cp >> 6);
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = (char)(0xE0 | cp >> 12);
+        out[1] = (char)(0x80 | (cp >> 6 & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | cp >> 18);
+    out[1] = (char)(0x80 | (cp >> 12 & 0x3F));
+    out[2] = (char)(0x80 | (cp >> 6 & 0x3F));
+    out[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+static unsigned char g_wtab[0x10000 / 2];  /* 4 bits per BMP code point: 0 unknown, else width + 2 */
+
+/* wcwidth(cp) clamped to -1..2: -1 for unprintables (drawn as U+FFFD),
+ * 0 for combining and format characters, 2 for wide ones. */
+static int cp_width(uint32_t cp) {
+    if (cp < 0x10000) {
+        int sh = (cp & 1) * 4;
+        int v = g_wtab[cp >> 1] >> sh & 15;
+        if (v) return v - 2;
+    }
+    int w = wcwidth((wchar_t)cp);
+    if (w < -1) w = -1;
+    if (w > 2) w = 2;
+    if (cp < 0x10000) g_wtab[cp >> 1] |= (unsigned char)((w + 2) << (cp & 1) * 4);
+    return w;
+}
+
+static inline int cp_is_ri(uint32_t cp) { return cp >= 0x1F1E6 && cp <= 0x1F1FF; }
+
+/* Length in bytes of the grapheme cluster at s (s[0] != 0, not a tab),
+ * and its width in *w: the base character's, at least 1, or 2 for an
+ * ASCII control, which is shown as ^X.  ASCII never extends a cluster,
+ * so every ASCII byte starts one. */
+static int gc_len(const char *s, int *w) {
+    unsigned char c = (unsigned char)s[0];
+    if (c < 0x80) {
+        *w = (c < 0x20 || c == 0x7f) ? 2 : 1;
+        if (*w == 2 || !((unsigned char)s[1] & 0x80)) return 1;
+    }
+    uint32_t cp;
+    int n = utf8_decode(s, &cp);
+    if (c >= 0x80) {
+        int bw = cp_width(cp);
+        *w = bw < 1 ? 1 : bw;
+    }
+    int ri = cp_is_ri(cp);
+    uint32_t prev = cp;
+    while (s[n]) {
+        uint32_t nx;
+        int k = utf8_decode(s + n, &nx);
+        if (nx < 0x80 || n + k > GC_MAX_BYTES) break;
+        int ext = cp_width(nx) == 0
+               || (nx >= 0x1F3FB && nx <= 0x1F3FF)   /* emoji skin tone */
+               || prev == 0x200D                      /* after a zero-width joiner */
+               || (ri == 1 && cp_is_ri(nx));          /* second half of a flag */
+        if (!ext) break;
+        if (cp_is_ri(nx)) ri++;
+        prev = nx;
+        n += k;
+    }
+    return n;
+}
+
+/* Step over the tab or grapheme cluster at line[*i] (non-NUL), which
+ * starts at cell column *cells; tab stops count from column 0. */
+static inline void cell_step(const char *line, int *i, int *cells) {
+    unsigned char c = (unsigned char)line[*i];
+    if (c >= 0x20 && c < 0x7f && !((unsigned char)line[*i + 1] & 0x80)) {
+        (*i)++;
+        (*cells)++;
+        return;
+    }
+    if (c == '\t') {
+        *cells += TAB_WIDTH - *cells % TAB_WIDTH;
+        (*i)++;
+        return;
+    }
+    int w;
+    *i += gc_len(line + *i, &w);
+    *cells += w;
+}
+
+/* Leading bytes of s (n available), at most `max`, that are printable
+ * ASCII and so one cell each; a byte followed by UTF-8 is left out, since
+ * a combining mark may join it.  Every position inside the run starts a
+ * cluster.  Reads no further than max + 1 bytes. */
+static inline int ascii_run(const char *s, size_t n, int max) {
+    if (max <= 0) return 0;
+    if (n > (size_t)max + 1) n = (size_t)max + 1;
+    size_t r = scan_until(s, n, SCAN_HIGH | SCAN_CTRL);
+    if (r > 0 && r < n && ((unsigned char)s[r] & 0x80)) r--;
+    return r > (size_t)max ? max : (int)r;
+}
+
+/* Cells before byte `stop` of line (len bytes), walking from byte i at
+ * cell column `cells`, which must start a cluster.  A stop inside a
+ * cluster counts up to the cluster's start. */
+static int cells_to_byte(const char *line, size_t len, int i, int cells, int stop) {
+    while ((size_t)i < len && i < stop) {
+        int r = ascii_run(line + i, len - (size_t)i, stop - i);
+        if (r > 0) {
+            i += r;
+            cells += r;
+            continue;
+        }
+        int ni = i, nc = cells;
+        cell_step(line, &ni, &nc);
+        if (ni > stop) break;
+        i = ni;
+        cells = nc;
+    }
+    return cells;
+}
+
+/* Start of the grapheme cluster of s that holds byte col (col itself at
+ * the end of the line).  Walks forward from the nearest ASCII byte. */
+static int gc_start(const char *s, int col) {
+    if (col <= 0) return 0;
+    int a = col;
+    while (a > 0 && ((unsigned char)s[a] & 0x80)) a--;
+    while (s[a]) {
+        int w;
+        int next = a + (s[a] == '\t' ? 1 : gc_len(s + a, &w));
+        if (next > col) break;
+        a = next;
+    }
+    return a;
+}
+
+// -----------------------------
+// VT renderer (--vt)
+// Drawing still targets stdscr, but screen_refresh() reads the frame back
+// (mvwin_wch) into a cell buffer, diffs it against what the terminal already shows and
+// sends only cursor jumps, SGR changes, erase-to-EOL and the changed cells,
+// in one write().  Sequences come from terminfo.  ncurses paints the first
+// frame, frames after a resize and the first one after endwin() itself,
+// which also restores the alternate screen and keypad mode.
+// -----------------------------
+#define VT_ATTRS (A_BOLD | A_REVERSE | A_UNDERLINE | A_ITALIC)
+
+/* One screen cell as getcchar() reports it.  A wide character's second
+ * cell reads back the same as its first. */
+typedef struct {
+    attr_t  attr;             /* A_* bits without the colour */
+    int     pair;
+    wchar_t ch[CCHARW_MAX];   /* zero-padded, compared with memcmp */
+} VtCell;
+
+static const VtCell vt_blank = { 0, 0, { L' ' } };
+
+static struct {
+    int on;
+    int rows, cols;
+    VtCell *front;           /* what the terminal shows; NULL = unknown */
+    VtCell *back;
+    char *out;
+    size_t len, cap;
+    int cy, cx;              /* terminal cursor; -1 = unknown */
+    attr_t attr;
+    int fg, bg, acs;
+    attr_t cur_attr;         /* attributes and pair the terminal is drawing with */
+    int cur_pair;
+    int scroll_top, scroll_bot, scroll_n;   /* pending hint; n = 0: none */
+    int pair_fg[256], pair_bg[256];
+    unsigned char pair_known[256];
+    const char *cup, *el, *sgr0, *op, *setaf, *setab;
+    const char *bold, *rev, *smul, *sitm, *smacs, *rmacs;
+    const char *csr, *ind, *ri, *indn, *rin;
+    int xenl;
+} g_vt;
+
+static const char *vt_cap(const char *name) {
+    char *s = tigetstr(name);
+    return (s == NULL || s == (char*)-1) ? NULL : s;
+}
+
+/* Call after curses is up.  Stays off if the terminal lacks cup or sgr0. */
+static void vt_init(void) {
+    g_vt.cup   = vt_cap("cup");
+    g_vt.el    = vt_cap("el");
+    g_vt.sgr0  = vt_cap("sgr0");
+    g_vt.op    = vt_cap("op");
+    g_vt.setaf = vt_cap("setaf");
+    g_vt.setab = vt_cap("setab");
+    g_vt.bold  = vt_cap("bold");
+    g_vt.rev   = vt_cap("rev");
+    g_vt.smul  = vt_cap("smul");
+    g_vt.sitm  = vt_cap("sitm");
+    g_vt.smacs = vt_cap("smacs");
+    g_vt.rmacs = vt_cap("rmacs");
+    g_vt.csr   = vt_cap("csr");
+    g_vt.ind   = vt_cap("ind");
+    g_vt.ri    = vt_cap("ri");
+    g_vt.indn  = vt_cap("indn");
+    g_vt.rin   = vt_cap("rin");
+    g_vt.xenl  = tigetflag("xenl") > 0;
+    g_vt.on = g_vt.cup && g_vt.sgr0;
+}
+
+static void vt_free(void) {
+    free(g_vt.front); free(g_vt.back); free(g_vt.out);
+    g_vt.front = g_vt.back = NULL;
+    g_vt.out = NULL;
+    g_vt.len = g_vt.cap = 0;
+}
+
+static void vt_put(const char *s) {
+    if (!s) return;
+    size_t n = strlen(s);
+    if (g_vt.len + n > g_vt.cap) {
+        size_t nc = g_vt.cap ? g_vt.cap : 16384;
+        while (nc < g_vt.len + n) nc *= 2;
+        char *no = (char*)realloc(g_vt.out, nc);
+        if (!no) return;
+        g_vt.out = no;
+        g_vt.cap = nc;
+    }
+    memcpy(g_vt.out + g_vt.len, s, n);
+    g_vt.len += n;
+}
+
+static void vt_putc(const VtCell *c);
+
+static inline int vt_cell_eq(const VtCell *a, const VtCell *b) {
+    return memcmp(a, b, sizeof(*a)) == 0;
+}
+
+/* 2 for the first cell of a wide character, else 1. */
+static inline int vt_cell_width(const VtCell *c) {
+    return (c->ch[0] >= 0x1100 && cp_width((uint32_t)c->ch[0]) == 2) ? 2 : 1;
+}
+
+static int vt_row_wide(const VtCell *row, int cols) {
+    for (int x = 0; x < cols; x++)
+        if (vt_cell_width(&row[x]) == 2) return 1;
+    return 0;
+}
+
+/* The last column at or before x where both rows start a character. */
+static int vt_row_sync(const VtCell *a, const VtCell *b, int x) {
+    int best = 0, ia = 0, ib = 0;
+    while (ia <= x && ib <= x) {
+        if (ia == ib) {
+            best = ia;
+            ia += vt_cell_width(&a[ia]);
+            ib += vt_cell_width(&b[ib]);
+        } else if (ia < ib) {
+            ia += vt_cell_width(&a[ia]);
+        } else {
+            ib += vt_cell_width(&b[ib]);
+        }
+    }
+    return best;
+}
+
+/* Rewriting cells [from, to) moves the cursor without changing state. */
+static int vt_same_attr(const VtCell *row, int from, int to) {
+    for (int k = from; k < to; k++)
+        if (row[k].attr != g_vt.cur_attr || row[k].pair != g_vt.cur_pair || row[k].ch[0] >= 0x80)
+            return 0;
+    return 1;
+}
+
+/* Cheapest of: nothing, CR LF to the next row start, rewriting a short run
+ * of unchanged cells drawn in the current attributes, or an absolute cup. */
+static void vt_move(int y, int x) {
+    if (y == g_vt.cy && x == g_vt.cx) return;
+    if (x == 0 && g_vt.cy >= 0 && y == g_vt.cy + 1) {
+        vt_put("\r\n");
+    } else if (y == g_vt.cy && g_vt.cx >= 0 && x > g_vt.cx && x - g_vt.cx <= 4 &&
+               vt_same_attr(g_vt.back + (size_t)y * g_vt.cols, g_vt.cx, x)) {
+        const VtCell *bk = g_vt.back + (size_t)y * g_vt.cols;
+        for (int k = g_vt.cx; k < x; k++) vt_putc(&bk[k]);
+    } else {
+        vt_put(tiparm(g_vt.cup, y, x));
+    }
+    g_vt.cy = y;
+    g_vt.cx = x;
+}
+
+static void vt_sgr_reset(void) {
+    if (g_vt.acs) vt_put(g_vt.rmacs);
+    vt_put(g_vt.sgr0);
+    g_vt.cur_attr = 0;
+    g_vt.cur_pair = 0;
+    g_vt.attr = 0;
+    g_vt.fg = g_vt.bg = -1;
+    g_vt.acs = 0;
+}
+
+static void vt_set_attr(const VtCell *a) {
+    attr_t want = a->attr & VT_ATTRS;
+    if (want != g_vt.attr) {
+        if (g_vt.attr & ~want) vt_sgr_reset();
+        attr_t add = want & ~g_vt.attr;
+        if (add & A_BOLD)      vt_put(g_vt.bold);
+        if (add & A_REVERSE)   vt_put(g_vt.rev);
+        if (add & A_UNDERLINE) vt_put(g_vt.smul);
+        if (add & A_ITALIC)    vt_put(g_vt.sitm);
+        g_vt.attr = want;
+    }
+
+    int fg = -1, bg = -1;
+    int pair = a->pair;
+    if (pair > 0 && pair < 256) {
+        if (!g_vt.pair_known[pair]) {
+#ifdef HAVE_EXTENDED_COLOR
+            int f = -1, b = -1;
+            extended_pair_content(pair, &f, &b);
+#else
+            short f = -1, b = -1;
+            pair_content((short)pair, &f, &b);
+#endif
+            g_vt.pair_fg[pair] = f;
+            g_vt.pair_bg[pair] = b;
+            g_vt.pair_known[pair] = 1;
+        }
+        fg = g_vt.pair_fg[pair];
+        bg = g_vt.pair_bg[pair];
+    }
+    if (fg != g_vt.fg || bg != g_vt.bg) {
+        if ((fg < 0 && g_vt.fg >= 0) || (bg < 0 && g_vt.bg >= 0)) {
+            if (g_vt.op) {
+                vt_put(g_vt.op);
+                g_vt.fg = g_vt.bg = -1;
+            } else {
+                vt_sgr_reset();
+                vt_set_attr(a);
+                return;
+            }
+        }
+        if (fg >= 0 && fg != g_vt.fg && g_vt.setaf) vt_put(tiparm(g_vt.setaf, fg));
+        if (bg >= 0 && bg != g_vt.bg && g_vt.setab) vt_put(tiparm(g_vt.setab, bg));
+        g_vt.fg = fg;
+        g_vt.bg = bg;
+    }
+
+    int acs = (a->attr & A_ALTCHARSET) != 0;
+    if (acs != g_vt.acs) {
+        vt_put(acs ? g_vt.smacs : g_vt.rmacs);
+        g_vt.acs = acs;
+    }
+    g_vt.cur_attr = a->attr;
+    g_vt.cur_pair = a->pair;
+}
+
+static void vt_putc(const VtCell *c) {
+    if (c->ch[0] > 0 && c->ch[0] < 0x80 && !c->ch[1] && g_vt.len < g_vt.cap) {
+        g_vt.out[g_vt.len++] = (char)c->ch[0];
+        return;
+    }
+    char t[4 * CCHARW_MAX + 1];
+    int n = 0;
+    if (!c->ch[0]) t[n++] = ' ';
+    for (int k = 0; k < CCHARW_MAX && c->ch[k]; k++) n += utf8_encode((uint32_t)c->ch[k], t + n);
+    t[n] = '\0';
+    vt_put(t);
+}
+
+static void vt_capture(VtCell *dst) {
+    int y0, x0;
+    getyx(stdscr, y0, x0);
+    for (int y = 0; y < g_vt.rows; y++) {
+        for (int x = 0; x < g_vt.cols; x++) {
+            VtCell *c = &dst[(size_t)y * g_vt.cols + x];
+            cchar_t cc;
+            wchar_t wch[CCHARW_MAX + 1];
+            attr_t attr = 0;
+            short pair = 0;
+            memset(c, 0, sizeof(*c));
+            if (mvwin_wch(stdscr, y, x, &cc) == ERR ||
+                getcchar(&cc, wch, &attr, &pair, NULL) == ERR) {
+                *c = vt_blank;
+                continue;
+            }
+            for (int k = 0; k < CCHARW_MAX && wch[k]; k++) c->ch[k] = wch[k];
+            c->attr = attr & ~A_COLOR;
+            c->pair = pair;
+        }
+    }
+    wmove(stdscr, y0, x0);
+}
+
+/* Rows [top, bot] of stdscr were scrolled by n (up; negative: down) since
+ * the last frame.  Under ncurses, idlok() finds such moves by itself. */
+static void screen_scroll_hint(int top, int bot, int n) {
+    if (!g_vt.on) return;
+    if (g_vt.scroll_n && (g_vt.scroll_top != top || g_vt.scroll_bot != bot)) {
+        g_vt.scroll_n = 0;  /* mixed regions: just repaint */
+        return;
+    }
+    g_vt.scroll_top = top;
+    g_vt.scroll_bot = bot;
+    g_vt.scroll_n += n;
+    if (g_vt.scroll_n >= bot - top + 1 || -g_vt.scroll_n >= bot - top + 1) g_vt.scroll_n = 0;
+}
+
+/* Scroll the terminal's region like the hint says and shift the front
+ * buffer to match, so the diff only sees the rows that came into view. */
+static void vt_scroll(void) {
+    int top = g_vt.scroll_top, bot = g_vt.scroll_bot, n = g_vt.scroll_n;
+    g_vt.scroll_n = 0;
+    if (!n || !g_vt.csr || bot >= g_vt.rows) return;
+    if (n > 0 ? !(g_vt.indn || g_vt.ind) : !(g_vt.rin || g_vt.ri)) return;
+
+    vt_set_attr(&vt_blank);  /* scrolled-in rows take the current background */
+    vt_put(tiparm(g_vt.csr, top, bot));
+    int k = n > 0 ? n : -n;
+    if (n > 0) {
+        vt_put(tiparm(g_vt.cup, bot, 0));
+        if (g_vt.indn && k > 1) vt_put(tiparm(g_vt.indn, k));
+        else for (int i = 0; i < k; i++) vt_put(g_vt.ind);
+    } else {
+        vt_put(tiparm(g_vt.cup, top, 0));
+        if (g_vt.rin && k > 1) vt_put(tiparm(g_vt.rin, k));
+        else for (int i = 0; i < k; i++) vt_put(g_vt.ri);
+    }
+    vt_put(tiparm(g_vt.csr, 0, g_vt.rows - 1));
+    g_vt.cy = g_vt.cx = -1;  /* csr homes the cursor */
+
+    size_t w = (size_t)g_vt.cols;
+    VtCell *f = g_vt.front;
+    int span = bot - top + 1;
+    if (n > 0) memmove(f + top * w, f + (top + k) * w, (size_t)(span - k) * w * sizeof(VtCell));
+    else       memmove(f + (top + k) * w, f + top * w, (size_t)(span - k) * w * sizeof(VtCell));
+    int clr = n > 0 ? bot - k + 1 : top;
+    for (size_t i = (size_t)clr * w; i < (size_t)(clr + k) * w; i++) f[i] = vt_blank;
+}
+
+/* (Re)size the cell buffers and let ncurses paint this frame in full. */
+static void vt_full_repaint(void) {
+    if (g_vt.rows != LINES || g_vt.cols != COLS || !g_vt.front) {
+        vt_free();
+        g_vt.rows = LINES;
+        g_vt.cols = COLS;
+        size_t n = (size_t)g_vt.rows * (size_t)g_vt.cols;
+        g_vt.front = (VtCell*)malloc(n * sizeof(VtCell));
+        g_vt.back  = (VtCell*)malloc(n * sizeof(VtCell));
+    }
+    g_vt.scroll_n = 0;
+    clearok(curscr, TRUE);
+    refresh();
+    if (!g_vt.front || !g_vt.back) { vt_free(); g_vt.on = 0; return; }
+    vt_capture(g_vt.front);
+    g_vt.cy = g_vt.cx = -1;
+    g_vt.attr = (attr_t)-1;  /* unknown: reset before the next change */
+}
+
+static void vt_flush(void) {
+    if (!g_vt.front || isendwin() || g_vt.rows != LINES || g_vt.cols != COLS) {
+        vt_full_repaint();
+        return;
+    }
+    memset(g_vt.pair_known, 0, sizeof(g_vt.pair_known));
+    vt_capture(g_vt.back);
+    g_vt.len = 0;
+    if (g_vt.attr == (attr_t)-1) vt_sgr_reset();
+    if (g_vt.scroll_n) vt_scroll();
+
+    for (int y = 0; y < g_vt.rows; y++) {
+        VtCell *bk = g_vt.back + (size_t)y * g_vt.cols;
+        VtCell *fr = g_vt.front + (size_t)y * g_vt.cols;
+        int x = 0;
+        while (x < g_vt.cols && vt_cell_eq(&bk[x], &fr[x])) x++;
+        if (x == g_vt.cols) continue;
+
+        int end = g_vt.cols;                  /* blank tail start */
+        while (end > x && vt_cell_eq(&bk[end - 1], &vt_blank)) end--;
+
+        /* Writing over half of a wide character blanks all of it, so rows
+         * holding any are rewritten from a column where both versions
+         * start a character. */
+        int wide = vt_row_wide(bk, g_vt.cols) || vt_row_wide(fr, g_vt.cols);
+        if (wide) x = vt_row_sync(bk, fr, x);
+
+        while (x < g_vt.cols) {
+            if (x >= end && g_vt.el) {
+                int dirty = 0;
+                for (int k = x; k < g_vt.cols; k++) if (!vt_cell_eq(&fr[k], &vt_blank)) { dirty = 1; break; }
+                if (dirty) {
+                    vt_move(y, x);
+                    vt_set_attr(&vt_blank);
+                    vt_put(g_vt.el);
+                }
+                break;
+            }
+            int w = wide ? vt_cell_width(&bk[x]) : 1;
+            if (x + w > g_vt.cols) w = 1;
+            if ((!wide && vt_cell_eq(&bk[x], &fr[x])) ||
+                (y == g_vt.rows - 1 && x + w == g_vt.cols && !g_vt.xenl)) {
+                x += w;
+                continue;
+            }
+            vt_move(y, x);
+            vt_set_attr(&bk[x]);
+            vt_putc(&bk[x]);
+            x += w;
+            /* past the last column the position depends on auto-margins */
+            g_vt.cx = (x < g_vt.cols) ? x : -1;
+            if (g_vt.cx < 0) g_vt.cy = -1;
+        }
+    }
+
+    if (g_vt.len > 0 && g_vt.attr) vt_sgr_reset();
+    if (g_vt.acs) { vt_put(g_vt.rmacs); g_vt.acs = 0; g_vt.cur_attr &= ~A_ALTCHARSET; }
+    int cy, cx;
+    getyx(stdscr, cy, cx);
+    vt_move(cy, cx);
+
+    size_t off = 0;
+    while (off < g_vt.len) {
+        ssize_t w = write(STDOUT_FILENO, g_vt.out + off, g_vt.len - off);
+        if (w < 0) { if (errno == EINTR) continue; break; }
+        off += (size_t)w;
+    }
+
+    VtCell *t = g_vt.front; g_vt.front = g_vt.back; g_vt.back = t;
+    /* Clears stdscr's change flags so getch() never repaints behind our back */
+    wnoutrefresh(stdscr);
+}
+
+/* Every frame goes out through here. */
+static void screen_refresh(void) {
+    if (g_vt.on) vt_flush();
+    else refresh();
+}
+
 typedef enum {
     LANG_NONE = 0,
     LANG_C, LANG_CPP, LANG_PYTHON, LANG_JAVA, LANG_JS, LANG_TS,
@@ -44,31 +746,101 @@ typedef enum {
     LANG_XML, LANG_YAML, LANG_XF
 } Language;
 
+
+/* A search hit inside a plain line, as byte offsets. */
 typedef struct {
-    int count;
-    char **segments;
-} WrappedLine;
+    int start;
+    int len;
+} MatchSpan;
+
+/* A style change inside a plain line: bytes from `off` up to the next run
+ * are drawn with these SGR attributes.  Colours are 256-colour indices or
+ * ANSI_RGB | 0xRRGGBB, -1 = terminal default.  Bytes before the first run
+ * use the default. */
+typedef struct {
+    int   off;
+    int   fg, bg;
+    unsigned char flags;   /* ANSI_BOLD | ANSI_UL | ANSI_ITAL */
+} AnsiRun;
+
+#define ANSI_RGB 0x1000000
+
+#define ANSI_BOLD 1
+#define ANSI_UL   2
+#define ANSI_ITAL 4
+
+/* Per-line bookkeeping kept parallel to Buffer.lines (same index, same cap).
+ * `version` is a process-wide unique stamp, reassigned whenever the line's
+ * text changes, so anything derived from a line can be cached against it. */
+typedef struct {
+    unsigned version;
+
+    unsigned   match_version;  /* spans below are valid for this version... */
+    unsigned   match_gen;      /* ...and this ViewerState.search_gen */
+    int        match_count;
+    int        match_cap;
+    int        rows;           /* wrapped rows at Buffer.row_width */
+    int        cells;          /* display width, valid for cells_version */
+    unsigned   cells_version;
+    unsigned   lex_version;    /* version lex_start/lex_end were lexed at */
+    unsigned char lex_start;   /* lexer state entering the line... */
+    unsigned char lex_end;     /* ...and leaving it (LEX_*) */
+    MatchSpan *matches;
+
+    int        ansi_count;     /* SGR runs parsed at load; dropped on edit */
+    AnsiRun   *ansi;
+} LineMeta;
+
+/* One in-line edit of an undo patch: on apply, bytes [col, col+del_len) of
+ * `line` are replaced by ins_len bytes at pool+ins_off, and the removed
+ * bytes become the new insert text, so applying twice is a no-op. */
+typedef struct {
+    int line;
+    int col;
+    int del_len;
+    int ins_off;
+    int ins_len;
+} UndoEdit;
+
+/* Undo/redo entry: either a whole-buffer snapshot (snap != NULL) or a
+ * compact patch of column ranges that leaves the line count unchanged. */
+typedef struct {
+    char     *snap;
+    UndoEdit *edits;
+    int       nedits;
+    char     *pool;
+} UndoRec;
+
+typedef struct LineTable LineTable;
 
 typedef struct {
     char **lines;        // plain (ANSI stripped) used for editing/search/syntax highlight
+    LineMeta *meta;      // parallel to lines[], capacity line_cap
     int line_count;
     int line_cap;
 
-    char **raw_lines;    // original text as loaded (may contain ANSI) used ONLY for rendering
-    int raw_cap;
-    int raw_has_ansi;    // any ESC seen at load time
+    int has_ansi;        // render through meta[].ansi (stdin/highlight input); cleared on first edit
 
     char filepath[1024];
     Language lang;
     int scroll_offset;
+    int hscroll;         // first visible cell column when not wrapping
     int is_active;
+    unsigned id;         // stable across slot reuse; async results look buffers up by it
     int dirty;
-    char **undo;
+    UndoRec *undo;
     int undo_len;
     int undo_cap;
-    char **redo;
+    UndoRec *redo;
     int redo_len;
     int redo_cap;
+
+    int *row_tree;       // Fenwick tree over meta[].rows, 1-based (see rows_index_ensure)
+    int  row_tree_valid; // cleared when lines are inserted or removed
+    int  row_width;      // wrap width meta[].rows was measured at; 0 = never
+    int  lex_valid;      // meta[0..lex_valid).lex_end known good (see lex_state_at)
+
+    LineTable *snap_tab; // lines shared with snapshots, copied on write; NULL until the first
 } Buffer;
 typedef enum {
     MODE_NORMAL = 0,
@@ -98,6 +870,7 @@ typedef struct {
     int search_match_count;
     int current_match;
     int search_highlight;
+    unsigned search_gen;     /* bumped whenever search_term/search_highlight change */
 
     int show_line_numbers;
     int wrap_enabled;
@@ -114,7 +887,7 @@ typedef struct {
     int cmdhist_pos;
 
     char status_msg[256];
-    int status_ticks;
+    int status_live;          /* shown until the status timer clears it */
 
     Operator op_pending;
     int op_start_line;
@@ -143,6 +916,7 @@ static void rtrim(char *s);
 static void show_def_popup(ViewerState *st);
 static void handle_insert_key(ViewerState *st, int ch);
 static void cmd_show_help(ViewerState *st);
+static void cmd_bsearch(ViewerState *st, const char *pat);
 static Language detect_language(const char *filepath);
 
 // -----------------------------
@@ -166,6 +940,9 @@ static int  g_temp_count = 0;
 static volatile sig_atomic_t g_exit_signal = 0;
 static char *buffer_serialize(const Buffer *b);
 static void  buffer_deserialize(Buffer *b, const char *text);
+static void ensure_cursor_bounds(ViewerState *st);
+static void damage_invalidate_all(void);
+static void rows_line_changed(Buffer *b, int i);
 
 static const char *highlight_lang(Language l)
 {
@@ -195,44 +972,173 @@ static const char *highlight_lang(Language l)
 }
 
 // -----------------------------
-// ANSI color-pair management (for draw_ansi_line)
+// ANSI color-pair management (for ansi_line_cells)
 // -----------------------------
 typedef struct {
-    short fg, bg;
-    short pair_id;
+    int      fg, bg;
+    short    pair_id;
+    int      next;      /* next entry in the hash chain, 1-based; 0 ends it */
+    unsigned used;      /* g_ansi_frame of the last lookup */
 } AnsiPairEnt;
 
-#define ANSI_PAIR_MAX 512
+/* Pairs below ANSI_PAIR_BASE belong to the fixed UI colours.  Render
+ * cells are chtypes, whose colour field holds only 8 bits (PAIR_NUMBER),
+ * so no pair id may reach 256 however many the terminal offers. */
+#define ANSI_PAIR_BASE 20
+#define ANSI_PAIR_MAX  (256 - ANSI_PAIR_BASE)
+#define ANSI_PAIR_HASH 512
 static AnsiPairEnt g_ansi_pairs[ANSI_PAIR_MAX];
-static int g_ansi_pair_count = 0;
+static int      g_ansi_pair_head[ANSI_PAIR_HASH];  /* 1-based entry, 0 = empty */
+static int      g_ansi_pair_count = 0;
+static unsigned g_ansi_frame = 0;
+/* Bumped whenever a pair is redefined: chtypes cached before that may now
+ * show the wrong colours (see render_line, draw_buffer). */
+static unsigned g_ansi_pair_epoch = 0;
 
 static void ansi_pairs_reset(void) {
     g_ansi_pair_count = 0;
+    memset(g_ansi_pair_head, 0, sizeof(g_ansi_pair_head));
+    g_ansi_pair_epoch++;
+}
+
+static int ansi_direct_color(void) {
+#ifdef HAVE_EXTENDED_COLOR
+    return COLORS >= 0x1000000;
+#else
+    return 0;
+#endif
+}
+
+/* xterm's default RGB for a 256-colour index. */
+static int ansi_palette_rgb(int c) {
+    static const int base16[16] = {
+        0x000000, 0xcd0000, 0x00cd00, 0xcdcd00, 0x0000ee, 0xcd00cd, 0x00cdcd, 0xe5e5e5,
+        0x7f7f7f, 0xff0000, 0x00ff00, 0xffff00, 0x5c5cff, 0xff00ff, 0x00ffff, 0xffffff
+    };
+    static const int cube[6] = { 0, 95, 135, 175, 215, 255 };
+    if (c < 16) return base16[c];
+    if (c < 232) {
+        c -= 16;
+        return cube[c / 36] << 16 | cube[c / 6 % 6] << 8 | cube[c % 6];
+    }
+    int v = 8 + (c - 232) * 10;
+    return v << 16 | v << 8 | v;
+}
+
+/* Nearest palette colour for every RGB666 value, built on first use for
+ * the terminal's palette size (g_rgb_map_n): the cube plus grey ramp of
+ * 256-colour terminals, otherwise the first 16 or 8 colours. */
+static unsigned char g_rgb_map[1 << 18];
+static int g_rgb_map_n = 0;
+
+static int rgb_dist2(int a, int b) {
+    int dr = (a >> 16 & 255) - (b >> 16 & 255);
+    int dg = (a >> 8 & 255) - (b >> 8 & 255);
+    int db = (a & 255) - (b & 255);
+    return dr * dr + dg * dg + db * db;
+}
+
+static void ansi_rgb_map_init(int n) {
+    for (int k = 0; k < (1 << 18); k++) {
+        int r = k >> 12 & 63, g = k >> 6 & 63, b = k & 63;
+        int rgb = ((r << 2 | r >> 4) << 16) | ((g << 2 | g >> 4) << 8) | (b << 2 | b >> 4);
+        int best = 0;
+
+        if (n == 256) {
+            int ci[3];
+            for (int ch = 0; ch < 3; ch++) {
+                int v = rgb >> (16 - 8 * ch) & 255;
+                ci[ch] = v < 48 ? 0 : v < 115 ? 1 : (v - 35) / 40;
+            }
+            int cube = 16 + ci[0] * 36 + ci[1] * 6 + ci[2];
+            int avg = ((rgb >> 16 & 255) + (rgb >> 8 & 255) + (rgb & 255)) / 3;
+            int gray = avg < 8 ? 232 : avg > 238 ? 255 : 232 + (avg - 3) / 10;
+            best = rgb_dist2(rgb, ansi_palette_rgb(gray)) < rgb_dist2(rgb, ansi_palette_rgb(cube))
+                 ? gray : cube;
+        } else {
+            for (int c = 1; c < n; c++)
+                if (rgb_dist2(rgb, ansi_palette_rgb(c)) < rgb_dist2(rgb, ansi_palette_rgb(best))) best = c;
+        }
+        g_rgb_map[k] = (unsigned char)best;
+    }
+    g_rgb_map_n = n;
 }
 
-static int ansi_map_256_to_curses(int c) {
+/* An AnsiRun colour as a curses colour number for this terminal. */
+static int ansi_map_color(int c) {
     if (c < 0) return -1;
-    if (COLORS >= 256) return c;
-    if (c < 8) return c;
-    if (c >= 8 && c < 16) return (c - 8);
-    return (c % 8);
+    int rgb = (c & ANSI_RGB) ? (c & 0xffffff) : -1;
+
+    if (ansi_direct_color()) {
+        /* xterm-direct treats 0..7 as the ANSI colours, anything else as RGB */
+        if (rgb < 0) {
+            if (c < 8) return c;
+            rgb = ansi_palette_rgb(c);
+        }
+        return rgb < 8 ? 8 : rgb;
+    }
+
+    int n = COLORS >= 256 ? 256 : COLORS >= 16 ? 16 : 8;
+    if (rgb < 0) {
+        if (c < n) return c;
+        if (c < 16) return c - 8;
+        rgb = ansi_palette_rgb(c);
+    }
+    if (g_rgb_map_n != n) ansi_rgb_map_init(n);
+    return g_rgb_map[(rgb >> 6 & 0x3f000) | (rgb >> 4 & 0xfc0) | (rgb >> 2 & 0x3f)];
+}
+
+static unsigned ansi_pair_hash(int fg, int bg) {
+    return ((unsigned)fg * 2654435761u ^ (unsigned)bg * 40503u) >> 23 & (ANSI_PAIR_HASH - 1);
 }
 
-static short ansi_get_pair(short fg, short bg) {
+/* The colour pair for (fg, bg), defining one on first use.  When the
+ * terminal runs out of pairs the least recently used one is redefined,
+ * unless every pair was already used this frame (then 0, default colours). */
+static short ansi_get_pair(int fg, int bg) {
     if (fg < 0) fg = -1;
     if (bg < 0) bg = -1;
-    for (int i = 0; i < g_ansi_pair_count; i++) {
-        if (g_ansi_pairs[i].fg == fg && g_ansi_pairs[i].bg == bg)
-            return g_ansi_pairs[i].pair_id;
-    }
-    /* allocate new pair; start at 20 to avoid stomping on our fixed pairs 1..9 */
-    short next = (short)(g_ansi_pair_count + 20);
-    if (next >= COLOR_PAIRS) return 0;
-    init_pair(next, fg, bg);
-    if (g_ansi_pair_count < ANSI_PAIR_MAX) {
-        g_ansi_pairs[g_ansi_pair_count++] = (AnsiPairEnt){ .fg = fg, .bg = bg, .pair_id = next };
+    unsigned h = ansi_pair_hash(fg, bg);
+    for (int i = g_ansi_pair_head[h]; i; i = g_ansi_pairs[i - 1].next) {
+        AnsiPairEnt *e = &g_ansi_pairs[i - 1];
+        if (e->fg == fg && e->bg == bg) {
+            e->used = g_ansi_frame;
+            return e->pair_id;
+        }
     }
-    return next;
+
+    int limit = (COLOR_PAIRS < 256 ? COLOR_PAIRS : 256) - ANSI_PAIR_BASE;
+    if (limit <= 0) return 0;
+
+    AnsiPairEnt *e;
+    if (g_ansi_pair_count < limit) {
+        e = &g_ansi_pairs[g_ansi_pair_count];
+        e->pair_id = (short)(ANSI_PAIR_BASE + g_ansi_pair_count);
+        g_ansi_pair_count++;
+    } else {
+        e = &g_ansi_pairs[0];
+        for (int i = 1; i < g_ansi_pair_count; i++)
+            if (g_ansi_pairs[i].used < e->used) e = &g_ansi_pairs[i];
+        if (e->used == g_ansi_frame) return 0;
+
+        int slot = (int)(e - g_ansi_pairs) + 1;
+        int *link = &g_ansi_pair_head[ansi_pair_hash(e->fg, e->bg)];
+        while (*link != slot) link = &g_ansi_pairs[*link - 1].next;
+        *link = e->next;
+        g_ansi_pair_epoch++;
+    }
+
+#ifdef HAVE_EXTENDED_COLOR
+    init_extended_pair(e->pair_id, fg, bg);
+#else
+    init_pair(e->pair_id, (short)fg, (short)bg);
+#endif
+    e->fg = fg;
+    e->bg = bg;
+    e->used = g_ansi_frame;
+    e->next = g_ansi_pair_head[h];
+    g_ansi_pair_head[h] = (int)(e - g_ansi_pairs) + 1;
+    return e->pair_id;
 }
 
 typedef struct {
@@ -248,96 +1154,99 @@ static void ansi_state_reset(AnsiState *st) {
     st->bold = st->ul = st->ital = 0;
 }
 
-static void ansi_state_apply(const AnsiState *st, attr_t preserve) {
-    short fg = (short)ansi_map_256_to_curses(st->fg);
-    short bg = (short)ansi_map_256_to_curses(st->bg);
-    short pair = ansi_get_pair(fg, bg);
-
-    /* Preserve selection reverse (and anything else you want later). */
-    attrset((preserve & A_REVERSE) | COLOR_PAIR(pair));
-
-    if (st->bold) attron(A_BOLD);
-    if (st->ul)   attron(A_UNDERLINE);
+/* The ncurses attributes for text drawn in run `r`. */
+static attr_t ansi_run_attr(const AnsiRun *r) {
+    attr_t a = COLOR_PAIR(ansi_get_pair(ansi_map_color(r->fg), ansi_map_color(r->bg)));
+    if (r->flags & ANSI_BOLD) a |= A_BOLD;
+    if (r->flags & ANSI_UL)   a |= A_UNDERLINE;
 #ifdef A_ITALIC
-    if (st->ital) attron(A_ITALIC);
+    if (r->flags & ANSI_ITAL) a |= A_ITALIC;
 #endif
+    return a;
 }
 static int ansi_clamp8(int x) { return (x < 0) ? 0 : (x > 7 ? 7 : x); }
 
-/* Draw a single line string that may contain ANSI escape sequences.
- * Uses ncurses mvaddch so it integrates with the rest of the TUI. */
-static void draw_ansi_line(const char *s, int y, int x, int max_x) {
-    if (!s) return;
-
-    /* Capture whatever the caller set (Visual mode sets A_REVERSE). */
-    attr_t preserve = 0;
-    short  curpair = 0;
-    attr_get(&preserve, &curpair, NULL);
-
-    AnsiState st;
-    ansi_state_reset(&st);
-    ansi_state_apply(&st, preserve);
-
-    for (int i = 0; s[i] && x < max_x; ) {
-        unsigned char c = (unsigned char)s[i];
+static void ansi_state_apply_params(AnsiState *st, const int *params, int pn) {
+    if (!st) return;
 
-        if (c == 0x1B && s[i+1] == '[') {
-            i += 2;
-            int params[16], pn = 0, val = 0, have = 0;
-
-            while (s[i] && pn < 16) {
-                if (isdigit((unsigned char)s[i])) {
-                    val = val * 10 + (s[i] - '0');
-                    have = 1;
-                    i++;
-                } else if (s[i] == ';') {
-                    params[pn++] = have ? val : 0;
-                    val = 0; have = 0;
-                    i++;
-                } else if (s[i] == 'm') {
-                    params[pn++] = have ? val : 0;
-                    i++;
-                    break;
-                } else {
-                    while (s[i] && s[i] != 'm') i++;
-                    if (s[i] == 'm') i++;
-                    pn = 0;
-                    break;
-                }
-            }
+    if (pn == 0) {
+        ansi_state_reset(st);
+        return;
+    }
 
-            if (pn == 0) { ansi_state_reset(&st); ansi_state_apply(&st, preserve); continue; }
-
-            for (int k = 0; k < pn; k++) {
-                int p = params[k];
-                if      (p == 0)  ansi_state_reset(&st);
-                else if (p == 1)  st.bold = 1;
-                else if (p == 3)  st.ital = 1;
-                else if (p == 4)  st.ul   = 1;
-                else if (p == 22) st.bold = 0;
-                else if (p == 23) st.ital = 0;
-                else if (p == 24) st.ul   = 0;
-                else if (p >= 30 && p <= 37) st.fg = ansi_clamp8(p - 30);
-                else if (p == 39) st.fg = -1;
-                else if (p >= 40 && p <= 47) st.bg = ansi_clamp8(p - 40);
-                else if (p == 49) st.bg = -1;
-                else if (p >= 90 && p <= 97)  st.fg = ansi_clamp8(p - 90) + 8;
-                else if (p >= 100 && p <= 107) st.bg = ansi_clamp8(p - 100) + 8;
-                else if (p == 38 && k + 2 < pn && params[k+1] == 5) { st.fg = params[k+2]; k += 2; }
-                else if (p == 48 && k + 2 < pn && params[k+1] == 5) { st.bg = params[k+2]; k += 2; }
-            }
+    for (int k = 0; k < pn; k++) {
+        int p = params[k];
 
-            ansi_state_apply(&st, preserve);
-            continue;
+        if      (p == 0)  ansi_state_reset(st);
+        else if (p == 1)  st->bold = 1;
+        else if (p == 3)  st->ital = 1;
+        else if (p == 4)  st->ul   = 1;
+        else if (p == 22) st->bold = 0;
+        else if (p == 23) st->ital = 0;
+        else if (p == 24) st->ul   = 0;
+        else if (p >= 30 && p <= 37) st->fg = ansi_clamp8(p - 30);
+        else if (p == 39) st->fg = -1;
+        else if (p >= 40 && p <= 47) st->bg = ansi_clamp8(p - 40);
+        else if (p == 49) st->bg = -1;
+        else if (p >= 90 && p <= 97)  st->fg = ansi_clamp8(p - 90) + 8;
+        else if (p >= 100 && p <= 107) st->bg = ansi_clamp8(p - 100) + 8;
+        else if ((p == 38 || p == 48) && k + 2 < pn && params[k + 1] == 5) {
+            int c = params[k + 2] & 255;
+            if (p == 38) st->fg = c; else st->bg = c;
+            k += 2;
+        }
+        else if ((p == 38 || p == 48) && k + 4 < pn && params[k + 1] == 2) {
+            int c = ANSI_RGB | (params[k + 2] & 255) << 16 | (params[k + 3] & 255) << 8 | (params[k + 4] & 255);
+            if (p == 38) st->fg = c; else st->bg = c;
+            k += 4;
         }
-
-        mvaddch(y, x++, c);
-        i++;
     }
+}
 
-    /* Restore normal, but keep reverse if caller had it on. */
-    attrset((preserve & A_REVERSE) | COLOR_PAIR(COLOR_NORMAL));
+/* Walks a sorted MatchSpan list alongside a left-to-right paint loop. */
+typedef struct {
+    const MatchSpan *spans;
+    int n;
+    int k;
+} MatchCursor;
+
+static void match_cursor_init(MatchCursor *mc, const MatchSpan *spans, int n) {
+    mc->spans = spans;
+    mc->n = spans ? n : 0;
+    mc->k = 0;
+}
+
+/* Is plain byte `off` inside a span?  Offsets must be non-decreasing. */
+static int match_cursor_at(MatchCursor *mc, int off) {
+    while (mc->k < mc->n && mc->spans[mc->k].start + mc->spans[mc->k].len <= off) mc->k++;
+    return mc->k < mc->n && mc->spans[mc->k].start <= off;
+}
+
+/* Attributed cells for bytes [from, len) of a plain line styled by `runs`
+ * (see AnsiRun), out[0] being byte `from`.  Search spans override the
+ * ANSI colours. */
+static void ansi_line_cells(const char *s, int from, int len, const AnsiRun *runs, int nruns,
+                            const MatchSpan *spans, int nspans, chtype *out) {
+    static const AnsiRun plain_run = { 0, -1, -1, 0 };
+    attr_t attr = ansi_run_attr(&plain_run);
+
+    MatchCursor mc;
+    match_cursor_init(&mc, spans, nspans);
+    int k = 0;
+
+    for (int i = from; i < len; i++) {
+        if (k < nruns && runs[k].off <= i) {
+            while (k + 1 < nruns && runs[k + 1].off <= i) k++;
+            attr = ansi_run_attr(&runs[k++]);
+        }
+        unsigned char c = (unsigned char)s[i];
+        if (match_cursor_at(&mc, i))
+            out[i - from] = c | COLOR_PAIR(COLOR_SEARCH_HL) | A_BOLD;
+        else
+            out[i - from] = c | attr;
+    }
 }
+
 static int is_dir_path(const char *path) {
     if (!path || !*path) return 0;
     struct stat st;
@@ -449,9 +1358,7 @@ static int run_rg_for_def(const char *cwd, const char *pattern,
     return count;
 }
 
-static int draw_def_popup(ViewerState *st,
-                          const char *word,
-                          DefResult *results, int count) {
+static void popup_geometry(int rows, int *out_y, int *out_x, int *out_h, int *out_w) {
     int max_y = getmaxy(stdscr);
     int max_x = getmaxx(stdscr);
 
@@ -459,7 +1366,7 @@ static int draw_def_popup(ViewerState *st,
     if (popup_w < 60) popup_w = 60;
     if (popup_w > max_x - 4) popup_w = max_x - 4;
 
-    int popup_h = count + 4;
+    int popup_h = rows + 4;
     if (popup_h > max_y - 4) popup_h = max_y - 4;
     if (popup_h < 5) popup_h = 5;
 
@@ -468,38 +1375,87 @@ static int draw_def_popup(ViewerState *st,
     if (start_y < 0) start_y = 0;
     if (start_x < 0) start_x = 0;
 
+    *out_y = start_y; *out_x = start_x;
+    *out_h = popup_h; *out_w = popup_w;
+}
+
+/* Border + title of a popup, shared by the @ and :bsearch lists. */
+static void draw_popup_frame(int start_y, int start_x, int popup_h, int popup_w, const char *title) {
+    damage_invalidate_all();  /* rows underneath must be repainted on close */
+    attron(COLOR_PAIR(COLOR_STATUS) | A_BOLD);
+    mvaddch(start_y, start_x, ACS_ULCORNER);
+    int title_len = (int)strlen(title);
+    if (title_len > popup_w - 2) title_len = popup_w - 2;
+    int fill = popup_w - 2 - title_len;
+    if (fill < 0) fill = 0;
+    mvprintw(start_y, start_x + 1, "%.*s", title_len, title);
+    for (int i = 0; i < fill; i++)
+        mvaddch(start_y, start_x + 1 + title_len + i, ACS_HLINE);
+    mvaddch(start_y, start_x + popup_w - 1, ACS_URCORNER);
+
+    for (int row = 0; row < popup_h - 2; row++) {
+        mvaddch(start_y + 1 + row, start_x, ACS_VLINE);
+        mvaddch(start_y + 1 + row, start_x + popup_w - 1, ACS_VLINE);
+    }
+
+    mvaddch(start_y + popup_h - 1, start_x, ACS_LLCORNER);
+    for (int i = 1; i < popup_w - 1; i++)
+        mvaddch(start_y + popup_h - 1, start_x + i, ACS_HLINE);
+    mvaddch(start_y + popup_h - 1, start_x + popup_w - 1, ACS_LRCORNER);
+    attroff(COLOR_PAIR(COLOR_STATUS) | A_BOLD);
+}
+
+/* One list row inside a popup: blank the interior, then " > text" or "   text". */
+static void draw_popup_row(int y, int start_x, int inner_w, const char *text, int selected) {
+    attron(COLOR_PAIR(COLOR_NORMAL));
+    for (int c = 0; c < inner_w; c++)
+        mvaddch(y, start_x + 1 + c, ' ');
+    if (!text) { attroff(COLOR_PAIR(COLOR_NORMAL)); return; }
+
+    int avail = inner_w - 4;
+    if (avail < 1) avail = 1;
+
+    if (selected) {
+        attron(COLOR_PAIR(COLOR_COPY_SELECT) | A_REVERSE | A_BOLD);
+        mvprintw(y, start_x + 1, " > ");
+    } else {
+        attron(COLOR_PAIR(COLOR_NORMAL));
+        mvprintw(y, start_x + 1, "   ");
+    }
+    mvprintw(y, start_x + 4, "%.*s", avail, text);
+    attroff(A_REVERSE | A_BOLD);
+    attroff(COLOR_PAIR(COLOR_NORMAL));
+}
+
+static void draw_popup_hint(int y, int start_x, int inner_w, const char *hint) {
+    attron(COLOR_PAIR(COLOR_NORMAL));
+    for (int c = 0; c < inner_w; c++)
+        mvaddch(y, start_x + 1 + c, ' ');
+    attroff(COLOR_PAIR(COLOR_NORMAL));
+    attron(COLOR_PAIR(COLOR_COMMENT));
+    mvprintw(y, start_x + 2, "%.*s", inner_w - 2, hint);
+    attroff(COLOR_PAIR(COLOR_COMMENT));
+}
+
+static int draw_def_popup(ViewerState *st,
+                          const char *word,
+                          DefResult *results, int count) {
+    int start_y, start_x, popup_h, popup_w;
+    popup_geometry(count, &start_y, &start_x, &popup_h, &popup_w);
+
     int selected = 0;
     int running  = 1;
 
     while (running) {
-        /* top border */
-        attron(COLOR_PAIR(COLOR_STATUS) | A_BOLD);
-        mvaddch(start_y, start_x, ACS_ULCORNER);
         char title[256];
         snprintf(title, sizeof(title), " Definition: %s ", word);
-        int title_len = (int)strlen(title);
-        int fill = popup_w - 2 - title_len;
-        if (fill < 0) fill = 0;
-        mvprintw(start_y, start_x + 1, "%s", title);
-        for (int i = 0; i < fill; i++)
-            mvaddch(start_y, start_x + 1 + title_len + i, ACS_HLINE);
-        mvaddch(start_y, start_x + popup_w - 1, ACS_URCORNER);
-        attroff(COLOR_PAIR(COLOR_STATUS) | A_BOLD);
+        draw_popup_frame(start_y, start_x, popup_h, popup_w, title);
 
         int inner_w = popup_w - 2;
 
         for (int row = 0; row < popup_h - 2; row++) {
             int y = start_y + 1 + row;
 
-            attron(COLOR_PAIR(COLOR_STATUS) | A_BOLD);
-            mvaddch(y, start_x, ACS_VLINE);
-            mvaddch(y, start_x + popup_w - 1, ACS_VLINE);
-            attroff(COLOR_PAIR(COLOR_STATUS) | A_BOLD);
-
-            attron(COLOR_PAIR(COLOR_NORMAL));
-            for (int c = 0; c < inner_w; c++)
-                mvaddch(y, start_x + 1 + c, ' ');
-
             if (row < count) {
                 const char *fp = results[row].filepath;
                 const char *slash2 = fp;
@@ -510,38 +1466,16 @@ static int draw_def_popup(ViewerState *st,
                 char row_text[512];
                 snprintf(row_text, sizeof(row_text), "%s:%d  %s",
                          slash2, results[row].lineno, results[row].text);
-                int avail = inner_w - 4;
-                if (avail < 1) avail = 1;
-
-                if (row == selected) {
-                    attron(COLOR_PAIR(COLOR_COPY_SELECT) | A_REVERSE | A_BOLD);
-                    mvprintw(y, start_x + 1, " > ");
-                } else {
-                    attron(COLOR_PAIR(COLOR_NORMAL));
-                    mvprintw(y, start_x + 1, "   ");
-                }
-                mvprintw(y, start_x + 4, "%.*s", avail, row_text);
-                attroff(A_REVERSE | A_BOLD);
-
+                draw_popup_row(y, start_x, inner_w, row_text, row == selected);
             } else if (row == count) {
-                attron(COLOR_PAIR(COLOR_COMMENT));
-                mvprintw(y, start_x + 2, "j/k navigate  Enter jump  ESC close");
-                attroff(COLOR_PAIR(COLOR_COMMENT));
+                draw_popup_hint(y, start_x, inner_w, "j/k navigate  Enter jump  ESC close");
+            } else {
+                draw_popup_row(y, start_x, inner_w, NULL, 0);
             }
-
-            attroff(COLOR_PAIR(COLOR_NORMAL));
         }
 
-        /* bottom border */
-        attron(COLOR_PAIR(COLOR_STATUS) | A_BOLD);
-        mvaddch(start_y + popup_h - 1, start_x, ACS_LLCORNER);
-        for (int i = 1; i < popup_w - 1; i++)
-            mvaddch(start_y + popup_h - 1, start_x + i, ACS_HLINE);
-        mvaddch(start_y + popup_h - 1, start_x + popup_w - 1, ACS_LRCORNER);
-        attroff(COLOR_PAIR(COLOR_STATUS) | A_BOLD);
-
         move(start_y + 1 + selected, start_x + 2);
-        refresh();
+        screen_refresh();
 
         int ch = getch();
         switch (ch) {
@@ -569,18 +1503,21 @@ static char *pick_file(void) {
 
         def_prog_mode();
         endwin();
+        term_bracketed_paste(0);
 
         printf("\nOpen file: ");
         fflush(stdout);
 
         if (!fgets(chosen, sizeof(chosen), stdin)) {
             reset_prog_mode();
-            refresh();
+            term_bracketed_paste(1);
+            screen_refresh();
             return NULL;
         }
 
         reset_prog_mode();
-        refresh();
+        term_bracketed_paste(1);
+        screen_refresh();
 
         trim_newlines(chosen);
         if (chosen[0] == '\0') return NULL;
@@ -633,9 +1570,11 @@ tmp_template            );
 
     def_prog_mode();
     endwin();
+    term_bracketed_paste(0);
     int rc = system(cmd);
     reset_prog_mode();
-    refresh();
+    term_bracketed_paste(1);
+    screen_refresh();
 
     if (rc != 0) {
         close(fdout);
@@ -677,35 +1616,20 @@ tmp_template            );
 
 static int line_has_ansi_esc(const char *s) {
     if (!s) return 0;
-    for (; *s; s++) {
-        if ((unsigned char)*s == 0x1B) return 1;
-    }
-    return 0;
-}
-
-static int buf_ensure_raw_capacity(Buffer *b, int needed) {
-    if (needed <= b->raw_cap) return 1;
-    int new_cap = b->raw_cap ? b->raw_cap : INITIAL_LINE_CAP;
-    while (new_cap < needed) new_cap *= 2;
-    char **np = (char**)realloc(b->raw_lines, (size_t)new_cap * sizeof(char*));
-    if (!np) return 0;
-    b->raw_lines = np;
-    b->raw_cap = new_cap;
-    return 1;
+    size_t n = strlen(s);
+    return scan_until(s, n, SCAN_ESC) < n;
 }
 
-static void buffer_drop_raw(Buffer *b) {
-    if (!b) return;
-    if (b->raw_lines) {
-        for (int i = 0; i < b->line_count; i++) {
-            free(b->raw_lines[i]);
-            b->raw_lines[i] = NULL;
-        }
-        free(b->raw_lines);
+/* Switch the buffer back to built-in highlighting after an edit; the
+ * ANSI runs from load no longer match the text. */
+static void buffer_drop_ansi(Buffer *b) {
+    if (!b || !b->has_ansi) return;
+    for (int i = 0; i < b->line_count; i++) {
+        free(b->meta[i].ansi);
+        b->meta[i].ansi = NULL;
+        b->meta[i].ansi_count = 0;
     }
-    b->raw_lines = NULL;
-    b->raw_cap = 0;
-    b->raw_has_ansi = 0;
+    b->has_ansi = 0;
 }
 
 static char *pick_file_from_dir_raw(const char *dir) {
@@ -717,15 +1641,18 @@ static char *pick_file_from_dir_raw(const char *dir) {
         char chosen[2048] = {0};
         def_prog_mode();
         endwin();
+        term_bracketed_paste(0);
         printf("\nOpen file in %s: ", dir);
         fflush(stdout);
         if (!fgets(chosen, sizeof(chosen), stdin)) {
             reset_prog_mode();
-            refresh();
+            term_bracketed_paste(1);
+            screen_refresh();
             return NULL;
         }
         reset_prog_mode();
-        refresh();
+        term_bracketed_paste(1);
+        screen_refresh();
         trim_newlines(chosen);
         if (!chosen[0]) return NULL;
         return safe_strdup(chosen);
@@ -783,9 +1710,11 @@ static char *pick_file_from_dir_raw(const char *dir) {
 
     def_prog_mode();
     endwin();
+    term_bracketed_paste(0);
     int rc = system(cmd);
     reset_prog_mode();
-    refresh();
+    term_bracketed_paste(1);
+    screen_refresh();
 
     if (rc != 0) {
         close(fdout);
@@ -853,13 +1782,495 @@ static void temp_cleanup_all(void) {
     g_temp_count = 0;
 }
 
-static void on_signal_request_exit(int sig) {
-    g_exit_signal = sig;
-}
+// -----------------------------
+// Event loop
+// The main loop sleeps in poll() on the tty, a self-pipe fed by the signal
+// handlers, a wakeup fd that worker threads use to post callbacks to the UI
+// thread (eventfd on Linux, else a pipe) and a timerfd armed for the
+// earliest pending timer (elsewhere that deadline is the poll timeout).
+// -----------------------------
+typedef void (*UiFn)(ViewerState *st, void *arg);
 
-static void on_signal_crash(int sig) {
-    temp_cleanup_all();
+typedef struct UiMsg {
+    UiFn fn;
+    void *arg;
+    struct UiMsg *next;
+} UiMsg;
+
+enum { TIMER_STATUS, TIMER_COUNT };
+
+typedef struct {
+    long long due_ms;    /* CLOCK_MONOTONIC; 0 = not armed */
+    UiFn fn;
+} EvTimer;
+
+static struct {
+    int sig_rd, sig_wr;
+    int wake_rd, wake_wr;    /* the same eventfd on Linux */
+    int timer_fd;            /* -1: use the poll timeout */
+    pthread_mutex_t mu;      /* guards the posted queue */
+    UiMsg *head, *tail;
+    EvTimer timers[TIMER_COUNT];
+} g_ev = {
+    .sig_rd = -1, .sig_wr = -1, .wake_rd = -1, .wake_wr = -1, .timer_fd = -1,
+    .mu = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void fd_set_flags(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+static void ev_init(void) {
+    int p[2];
+    if (pipe(p) == 0) {
+        fd_set_flags(p[0]); fd_set_flags(p[1]);
+        g_ev.sig_rd = p[0]; g_ev.sig_wr = p[1];
+    }
+#ifdef __linux__
+    g_ev.wake_rd = g_ev.wake_wr = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    g_ev.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+#endif
+    if (g_ev.wake_rd < 0 && pipe(p) == 0) {
+        fd_set_flags(p[0]); fd_set_flags(p[1]);
+        g_ev.wake_rd = p[0]; g_ev.wake_wr = p[1];
+    }
+}
+
+/* Async-signal-safe: called from the handlers below. */
+static void ev_signal_notify(int sig) {
+    if (g_ev.sig_wr < 0) return;
+    int saved = errno;
+    unsigned char c = (unsigned char)sig;
+    ssize_t r = write(g_ev.sig_wr, &c, 1);
+    (void)r;
+    errno = saved;
+}
+
+static void ev_wake(void) {
+    if (g_ev.wake_wr < 0) return;
+#ifdef __linux__
+    if (g_ev.wake_wr == g_ev.wake_rd) {
+        uint64_t one = 1;
+        ssize_t r = write(g_ev.wake_wr, &one, sizeof(one));
+        (void)r;
+        return;
+    }
+#endif
+    char c = 1;
+    ssize_t r = write(g_ev.wake_wr, &c, 1);
+    (void)r;
+}
+
+static void ev_drain(int fd) {
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0) {}
+}
+
+/* Run fn(st, arg) on the UI thread at the next turn of the event loop.
+ * Safe from any thread.  The caller allocates m ahead of time (it is freed
+ * once fn has run), so posting itself cannot fail. */
+static void ui_post(UiMsg *m, UiFn fn, void *arg) {
+    m->fn = fn;
+    m->arg = arg;
+    m->next = NULL;
+    pthread_mutex_lock(&g_ev.mu);
+    if (g_ev.tail) g_ev.tail->next = m;
+    else g_ev.head = m;
+    g_ev.tail = m;
+    pthread_mutex_unlock(&g_ev.mu);
+    ev_wake();
+}
+
+static void ev_run_posted(ViewerState *st) {
+    pthread_mutex_lock(&g_ev.mu);
+    UiMsg *m = g_ev.head;
+    g_ev.head = g_ev.tail = NULL;
+    pthread_mutex_unlock(&g_ev.mu);
+    while (m) {
+        UiMsg *next = m->next;
+        m->fn(st, m->arg);
+        free(m);
+        m = next;
+    }
+}
+
+static long long ev_next_due(void) {
+    long long due = 0;
+    for (int i = 0; i < TIMER_COUNT; i++)
+        if (g_ev.timers[i].due_ms && (!due || g_ev.timers[i].due_ms < due)) due = g_ev.timers[i].due_ms;
+    return due;
+}
+
+static void ev_timer_sync(void) {
+#ifdef __linux__
+    if (g_ev.timer_fd < 0) return;
+    long long due = ev_next_due();
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (due) {
+        its.it_value.tv_sec = due / 1000;
+        its.it_value.tv_nsec = (long)(due % 1000) * 1000000;
+    }
+    timerfd_settime(g_ev.timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+#endif
+}
+
+/* (Re)arm timer `id` to call fn on the UI thread in delay_ms. */
+static void ev_timer_arm(int id, int delay_ms, UiFn fn) {
+    g_ev.timers[id].due_ms = now_ms() + delay_ms;
+    g_ev.timers[id].fn = fn;
+    ev_timer_sync();
+}
+
+/* Returns 1 if any timer fired. */
+static int ev_run_timers(ViewerState *st) {
+    long long now = now_ms();
+    int fired = 0;
+    for (int i = 0; i < TIMER_COUNT; i++) {
+        EvTimer *t = &g_ev.timers[i];
+        if (!t->due_ms || t->due_ms > now) continue;
+        t->due_ms = 0;
+        t->fn(st, NULL);
+        fired = 1;
+    }
+    ev_timer_sync();
+    return fired;
+}
+
+/* Curses never sees SIGWINCH (our handler owns it), so resize here. */
+static void ev_resize(void) {
+#ifdef NCURSES_EXT_FUNCS
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0 && ws.ws_col > 0)
+        resizeterm(ws.ws_row, ws.ws_col);
+#endif
+}
+
+/* Sleep until something happens.  Returns 1 when keyboard input is ready,
+ * 0 when only signals, timers or posted work were handled (the caller
+ * redraws and waits again). */
+static int ev_wait(ViewerState *st, int tty_fd) {
+    /* curses may hold keys it already read (e.g. after an ESC lookahead) */
+    timeout(0);
+    int ch = getch();
+    timeout(-1);
+    if (ch == KEY_RESIZE) return 0;  /* resizeterm() queued it; just redraw */
+    if (ch != ERR) {
+        ungetch(ch);
+        return 1;
+    }
+    if (tty_fd < 0) return 1;
+
+    for (;;) {
+        struct pollfd pfd[4];
+        int n = 0;
+        pfd[n++] = (struct pollfd){ .fd = tty_fd, .events = POLLIN };
+        if (g_ev.sig_rd >= 0)   pfd[n++] = (struct pollfd){ .fd = g_ev.sig_rd,   .events = POLLIN };
+        if (g_ev.wake_rd >= 0)  pfd[n++] = (struct pollfd){ .fd = g_ev.wake_rd,  .events = POLLIN };
+        if (g_ev.timer_fd >= 0) pfd[n++] = (struct pollfd){ .fd = g_ev.timer_fd, .events = POLLIN };
+
+        int wait = -1;
+        long long due = ev_next_due();
+        if (due && g_ev.timer_fd < 0) {
+            long long left = due - now_ms();
+            wait = left < 0 ? 0 : (int)left;
+        }
+
+        if (poll(pfd, (nfds_t)n, wait) < 0) {
+            if (errno == EINTR) continue;
+            return 1;  /* fall back to a blocking getch */
+        }
+
+        int handled = 0;
+        for (int i = 1; i < n; i++) {
+            if (!(pfd[i].revents & POLLIN)) continue;
+            if (pfd[i].fd == g_ev.sig_rd) {
+                unsigned char sig[32];
+                ssize_t k;
+                while ((k = read(g_ev.sig_rd, sig, sizeof(sig))) > 0)
+                    for (ssize_t j = 0; j < k; j++)
+                        if (sig[j] == SIGWINCH) ev_resize();
+            } else if (pfd[i].fd == g_ev.wake_rd) {
+                ev_drain(g_ev.wake_rd);
+                ev_run_posted(st);
+            } else {
+                ev_drain(g_ev.timer_fd);
+            }
+            handled = 1;
+        }
+        if (ev_run_timers(st)) handled = 1;
+
+        if (pfd[0].revents & POLLIN) return 1;
+        if (pfd[0].revents & (POLLHUP | POLLERR)) {
+            g_exit_signal = SIGHUP;
+            return 0;
+        }
+        if (handled || g_exit_signal) return 0;
+    }
+}
+
+// -----------------------------
+// Worker pool and jobs
+// One deque per worker: a worker pops its own newest job and, when empty,
+// steals the oldest job from the others.  Jobs submitted from the UI thread
+// are dealt round-robin.  A job may carry a group (buffers use their id) so
+// everything pending for a buffer can be cancelled at once, and a done
+// callback that runs on the UI thread via ui_post().  Job functions must not
+// touch ncurses or editor state; they publish into their own argument.
+// -----------------------------
+#define WORKPOOL_MAX_THREADS 8
+
+typedef void (*WorkFn)(void *arg);
+typedef void (*JobDoneFn)(ViewerState *st, void *arg, int cancelled);
+typedef unsigned long JobId;
+
+typedef struct Job {
+    JobId id;
+    unsigned group;          /* 0 = none */
+    WorkFn fn;
+    JobDoneFn done;          /* optional; runs on the UI thread */
+    UiMsg *msg;              /* reserved for done, so delivery cannot fail */
+    void *arg;
+    volatile int cancelled;
+    struct Job *prev, *next;           /* deque links */
+    struct Job *live_prev, *live_next; /* g_pool.live, until retired */
+} Job;
+
+typedef struct {
+    pthread_mutex_t mu;
+    Job *head, *tail;        /* owner pops tail; thieves take head */
+} JobDeque;
+
+typedef struct {
+    pthread_t threads[WORKPOOL_MAX_THREADS];
+    JobDeque  deques[WORKPOOL_MAX_THREADS];
+    int nthreads;            /* deques; fixed while the pool runs */
+    int nstarted;            /* threads to join */
+    pthread_mutex_t mu;      /* guards everything below */
+    pthread_cond_t  cv;
+    int pending;             /* queued, not yet taken */
+    int shutdown;
+    unsigned rr;
+    JobId next_id;
+    Job *live;               /* submitted and not yet retired, for cancel */
+} WorkPool;
+
+static WorkPool g_pool = {
+    .mu = PTHREAD_MUTEX_INITIALIZER,
+    .cv = PTHREAD_COND_INITIALIZER,
+};
+
+static _Thread_local int  t_worker = -1;
+static _Thread_local Job *t_job;
+
+static void deque_push(JobDeque *d, Job *j) {
+    pthread_mutex_lock(&d->mu);
+    j->next = NULL;
+    j->prev = d->tail;
+    if (d->tail) d->tail->next = j;
+    else d->head = j;
+    d->tail = j;
+    pthread_mutex_unlock(&d->mu);
+}
+
+static Job *deque_take(JobDeque *d, int from_tail) {
+    pthread_mutex_lock(&d->mu);
+    Job *j = from_tail ? d->tail : d->head;
+    if (j) {
+        if (j->prev) j->prev->next = j->next;
+        else d->head = j->next;
+        if (j->next) j->next->prev = j->prev;
+        else d->tail = j->prev;
+    }
+    pthread_mutex_unlock(&d->mu);
+    return j;
+}
+
+static Job *pool_take(int self) {
+    Job *j = deque_take(&g_pool.deques[self], 1);
+    for (int k = 1; !j && k < g_pool.nthreads; k++)
+        j = deque_take(&g_pool.deques[(self + k) % g_pool.nthreads], 0);
+    return j;
+}
+
+/* Caller holds g_pool.mu. */
+static void job_unlink_live(Job *j) {
+    if (j->live_prev) j->live_prev->live_next = j->live_next;
+    else g_pool.live = j->live_next;
+    if (j->live_next) j->live_next->live_prev = j->live_prev;
+}
+
+/* UI thread: hand a finished (or skipped) job to its done callback. */
+static void job_deliver(ViewerState *st, void *arg) {
+    Job *j = (Job*)arg;
+    pthread_mutex_lock(&g_pool.mu);
+    job_unlink_live(j);
+    int cancelled = j->cancelled;
+    pthread_mutex_unlock(&g_pool.mu);
+    j->done(st, j->arg, cancelled);
+    free(j);
+}
+
+static void job_finish(Job *j) {
+    if (j->done) {
+        ui_post(j->msg, job_deliver, j);
+        return;
+    }
+    pthread_mutex_lock(&g_pool.mu);
+    job_unlink_live(j);
+    pthread_mutex_unlock(&g_pool.mu);
+    free(j);
+}
+
+/* For long-running job functions: true once the running job was cancelled. */
+static int job_cancelled(void) {
+    return t_job && t_job->cancelled;
+}
+
+static void *pool_worker_main(void *argp) {
+    /* Signals are for the UI thread; workers never see them. */
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    t_worker = (int)(intptr_t)argp;
+
+    for (;;) {
+        Job *j = pool_take(t_worker);
+        if (!j) {
+            pthread_mutex_lock(&g_pool.mu);
+            while (g_pool.pending <= 0 && !g_pool.shutdown)
+                pthread_cond_wait(&g_pool.cv, &g_pool.mu);
+            int quit = g_pool.pending <= 0 && g_pool.shutdown;
+            pthread_mutex_unlock(&g_pool.mu);
+            if (quit) break;
+            continue;
+        }
+        pthread_mutex_lock(&g_pool.mu);
+        g_pool.pending--;
+        pthread_mutex_unlock(&g_pool.mu);
+
+        if (!j->cancelled) {
+            t_job = j;
+            j->fn(j->arg);
+            t_job = NULL;
+        }
+        job_finish(j);
+    }
+    return NULL;
+}
+
+static int pool_start(void) {
+    if (g_pool.nthreads > 0) return 0;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = (ncpu > 0) ? (int)ncpu : 2;
+    if (n < 2) n = 2;
+    if (n > WORKPOOL_MAX_THREADS) n = WORKPOOL_MAX_THREADS;
+
+    g_pool.shutdown = 0;
+    for (int i = 0; i < n; i++) {
+        pthread_mutex_init(&g_pool.deques[i].mu, NULL);
+        g_pool.deques[i].head = g_pool.deques[i].tail = NULL;
+    }
+    /* Workers scan deques[0..nthreads), so publish the count first.  If not
+     * every thread starts, the orphaned deques are drained by stealing. */
+    g_pool.nthreads = n;
+    g_pool.nstarted = 0;
+    for (int i = 0; i < n; i++) {
+        if (pthread_create(&g_pool.threads[i], NULL, pool_worker_main, (void*)(intptr_t)i) != 0)
+            break;
+        g_pool.nstarted++;
+    }
+    if (g_pool.nstarted == 0) {
+        g_pool.nthreads = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/* Queue fn(arg) on a worker; done(st, arg, cancelled) then runs on the UI
+ * thread, also when the job was cancelled before it started (so it can free
+ * arg).  Returns the job id, or 0 (nothing queued, neither runs) when no
+ * worker is available. */
+static JobId job_submit(unsigned group, WorkFn fn, JobDoneFn done, void *arg) {
+    if (pool_start() != 0) return 0;
+    Job *j = (Job*)calloc(1, sizeof(*j));
+    if (!j) return 0;
+    if (done && !(j->msg = (UiMsg*)malloc(sizeof(UiMsg)))) {
+        free(j);
+        return 0;
+    }
+    j->group = group;
+    j->fn = fn;
+    j->done = done;
+    j->arg = arg;
+
+    pthread_mutex_lock(&g_pool.mu);
+    j->id = ++g_pool.next_id;
+    j->live_next = g_pool.live;
+    if (g_pool.live) g_pool.live->live_prev = j;
+    g_pool.live = j;
+    int target = t_worker >= 0 ? t_worker : (int)(g_pool.rr++ % (unsigned)g_pool.nthreads);
+    pthread_mutex_unlock(&g_pool.mu);
+
+    JobId id = j->id;
+    deque_push(&g_pool.deques[target], j);
+
+    pthread_mutex_lock(&g_pool.mu);
+    g_pool.pending++;
+    pthread_cond_signal(&g_pool.cv);
+    pthread_mutex_unlock(&g_pool.mu);
+    return id;
+}
+
+/* Fire-and-forget form used by scans that wait on their own context. */
+static int pool_submit(WorkFn fn, void *arg) {
+    return job_submit(0, fn, NULL, arg) ? 0 : -1;
+}
+
+/* Cancel job `id`, or with id 0 every job in `group`.  A queued job is
+ * skipped; a running one sees job_cancelled().  Done callbacks still run. */
+static void job_cancel(JobId id, unsigned group) {
+    if (!id && !group) return;
+    pthread_mutex_lock(&g_pool.mu);
+    for (Job *j = g_pool.live; j; j = j->live_next)
+        if (id ? j->id == id : j->group == group) j->cancelled = 1;
+    pthread_mutex_unlock(&g_pool.mu);
+}
+
+/* Cancels whatever is still queued and joins all workers.  Done callbacks
+ * posted after the event loop stopped wait for one more ev_run_posted(),
+ * which sees them cancelled, so they only free their arguments. */
+static void pool_shutdown(void) {
+    if (g_pool.nthreads == 0) return;
+    pthread_mutex_lock(&g_pool.mu);
+    for (Job *j = g_pool.live; j; j = j->live_next) j->cancelled = 1;
+    g_pool.shutdown = 1;
+    pthread_cond_broadcast(&g_pool.cv);
+    pthread_mutex_unlock(&g_pool.mu);
+    for (int i = 0; i < g_pool.nstarted; i++) pthread_join(g_pool.threads[i], NULL);
+    g_pool.nthreads = g_pool.nstarted = 0;
+}
+
+static void on_signal_request_exit(int sig) {
+    g_exit_signal = sig;
+    ev_signal_notify(sig);
+}
+
+static void on_signal_winch(int sig) {
+    ev_signal_notify(sig);
+}
+
+static void on_signal_crash(int sig) {
+    temp_cleanup_all();
     endwin();
+    term_bracketed_paste(0);
     signal(sig, SIG_DFL);
     raise(sig);
 }
@@ -875,6 +2286,12 @@ static void install_exit_signal_handlers(void) {
     sigaction(SIGHUP,  &sa, NULL);
     sigaction(SIGQUIT, &sa, NULL);
 
+#ifdef NCURSES_EXT_FUNCS
+    /* Installed before initscr, so curses leaves SIGWINCH to us (ev_resize) */
+    sa.sa_handler = on_signal_winch;
+    sigaction(SIGWINCH, &sa, NULL);
+#endif
+
     struct sigaction sa_crash;
     memset(&sa_crash, 0, sizeof(sa_crash));
     sa_crash.sa_handler = on_signal_crash;
@@ -887,10 +2304,18 @@ static void install_exit_signal_handlers(void) {
     sigaction(SIGFPE,  &sa_crash, NULL);
 }
 
+#define STATUS_SHOW_MS 4000
+
+static void status_expire(ViewerState *st, void *unused) {
+    (void)unused;
+    st->status_live = 0;
+}
+
 static void set_status(ViewerState *st, const char *msg) {
     if (!st) return;
     snprintf(st->status_msg, sizeof(st->status_msg), "%s", msg ? msg : "");
-    st->status_ticks = 80;
+    st->status_live = 1;
+    ev_timer_arm(TIMER_STATUS, STATUS_SHOW_MS, status_expire);
 }
 
 static const char *basename_path(const char *p) {
@@ -905,8 +2330,11 @@ static int file_exists(const char *path) {
 }
 
 static void strip_overstrikes(char *s) {
-    char *dst = s;
-    for (char *src = s; *src; src++) {
+    size_t n = strlen(s);
+    size_t k = scan_until(s, n, SCAN_BS);
+    if (k == n) return;
+    char *dst = s + k;
+    for (char *src = s + k; *src; src++) {
         if (*src == '\b') {
             if (dst > s) dst--;
         } else {
@@ -933,6 +2361,7 @@ static void trim_newlines(char *s) {
 static void manual_buffer_list_fallback(ViewerState *st) {
     def_prog_mode();
     endwin();
+    term_bracketed_paste(0);
 
     printf("\n=== Buffer List ===\n\n");
     for (int i = 0; i < st->buffer_count; i++) {
@@ -957,7 +2386,8 @@ static void manual_buffer_list_fallback(ViewerState *st) {
     tcsetattr(STDIN_FILENO, TCSANOW, &old_tio);
 
     reset_prog_mode();
-    refresh();
+    term_bracketed_paste(1);
+    screen_refresh();
 }
 
 static void get_cwd(char *out, size_t out_len) {
@@ -968,8 +2398,11 @@ static void get_cwd(char *out, size_t out_len) {
 }
 
 static void strip_ansi(char *s) {
-    char *d = s;
-    for (char *p = s; *p; ) {
+    size_t n = strlen(s);
+    size_t k = scan_until(s, n, SCAN_ESC);
+    if (k == n) return;
+    char *d = s + k;
+    for (char *p = s + k; *p; ) {
         if ((unsigned char)*p == 0x1B) {
             p++;
             if (*p == '[') {
@@ -1025,8 +2458,9 @@ static Language detect_language(const char *filepath) {
 }
 
 // -----------------------------
-// ANSI-aware wrapping (for raw_lines)
-// Keeps escape sequences intact and replays current SGR at segment starts.
+// ANSI parsing
+// Input with SGR escapes is parsed once at load into the plain text plus a
+// run list (LineMeta.ansi); rendering never sees the escapes again.
 // -----------------------------
 
 static int ansi_seq_len_osc(const char *s) {
@@ -1057,422 +2491,305 @@ static int ansi_seq_len_csi(const char *s) {
     return i;
 }
 
-static int is_printable_cell(unsigned char c) {
-    // We treat tabs as 1 cell to keep it simple (your editor likely expands elsewhere).
-    return (c >= 0x20 && c != 0x7F);
-}
-static void ansi_state_to_sgr(const AnsiState *st, char *out, size_t out_sz) {
-    if (!out || out_sz == 0) return;
-
-    size_t len = 0;
-    int first = 1;
-
-    len += (size_t)snprintf(out + len, out_sz - len, "\x1b[0");
-
-    if (st->bold && len < out_sz) {
-        len += (size_t)snprintf(out + len, out_sz - len, ";1");
-        first = 0;
-    }
-    if (st->ital && len < out_sz) {
-        len += (size_t)snprintf(out + len, out_sz - len, ";3");
-        first = 0;
-    }
-    if (st->ul && len < out_sz) {
-        len += (size_t)snprintf(out + len, out_sz - len, ";4");
-        first = 0;
-    }
-
-    if (st->fg >= 0 && len < out_sz) {
-        len += (size_t)snprintf(out + len, out_sz - len, ";38;5;%d", st->fg);
-        first = 0;
-    }
-    if (st->bg >= 0 && len < out_sz) {
-        len += (size_t)snprintf(out + len, out_sz - len, ";48;5;%d", st->bg);
-        first = 0;
-    }
-
-    (void)first;
-    if (len < out_sz) {
-        snprintf(out + len, out_sz - len, "m");
-    } else {
-        out[out_sz - 1] = '\0';
-    }
-}
-
-static void ansi_state_apply_params(AnsiState *st, const int *params, int pn) {
-    if (!st) return;
-
-    if (pn == 0) {
-        ansi_state_reset(st);
-        return;
-    }
-
-    for (int k = 0; k < pn; k++) {
-        int p = params[k];
-
-        if      (p == 0)  ansi_state_reset(st);
-        else if (p == 1)  st->bold = 1;
-        else if (p == 3)  st->ital = 1;
-        else if (p == 4)  st->ul   = 1;
-        else if (p == 22) st->bold = 0;
-        else if (p == 23) st->ital = 0;
-        else if (p == 24) st->ul   = 0;
-        else if (p >= 30 && p <= 37) st->fg = ansi_clamp8(p - 30);
-        else if (p == 39) st->fg = -1;
-        else if (p >= 40 && p <= 47) st->bg = ansi_clamp8(p - 40);
-        else if (p == 49) st->bg = -1;
-        else if (p >= 90 && p <= 97)  st->fg = ansi_clamp8(p - 90) + 8;
-        else if (p >= 100 && p <= 107) st->bg = ansi_clamp8(p - 100) + 8;
-        else if (p == 38 && k + 2 < pn && params[k + 1] == 5) {
-            st->fg = params[k + 2];
-            k += 2;
-        }
-        else if (p == 48 && k + 2 < pn && params[k + 1] == 5) {
-            st->bg = params[k + 2];
-            k += 2;
-        }
-    }
-}
-
-static WrappedLine ansi_wrap_line(const char *line, int width) {
-    WrappedLine out = (WrappedLine){0, NULL};
-    if (!line || width <= 0) return out;
-
-    int seg_cap = 8;
-    out.segments = (char **)calloc((size_t)seg_cap, sizeof(char *));
-    if (!out.segments) return (WrappedLine){0, NULL};
-
-    size_t buf_cap = 256;
-    size_t buf_len = 0;
-    char *buf = (char *)malloc(buf_cap);
-    if (!buf) {
-        free(out.segments);
-        return (WrappedLine){0, NULL};
-    }
-    buf[0] = '\0';
-
+/* Strip escape sequences from `s` in place and return its SGR styling as
+ * runs over the remaining bytes (*runs_out, NULL when unstyled).  Returns
+ * the run count; on allocation failure the styling is dropped (0). */
+static int ansi_parse_line(char *s, AnsiRun **runs_out) {
     AnsiState st;
     ansi_state_reset(&st);
-
-    char replay_sgr[128];
-    replay_sgr[0] = '\0';
-
-    int cells = 0;
-
-#define APPEND_BYTES(ptr, nbytes) do { \
-    size_t _n = (size_t)(nbytes); \
-    if (buf_len + _n + 1 > buf_cap) { \
-        while (buf_len + _n + 1 > buf_cap) buf_cap *= 2; \
-        char *_nb = (char *)realloc(buf, buf_cap); \
-        if (!_nb) goto oom; \
-        buf = _nb; \
-    } \
-    memcpy(buf + buf_len, (ptr), _n); \
-    buf_len += _n; \
-    buf[buf_len] = '\0'; \
-} while (0)
-
-#define FLUSH_SEG() do { \
-    if (out.count >= seg_cap) { \
-        int _nc = seg_cap * 2; \
-        char **_ns = (char **)realloc(out.segments, (size_t)_nc * sizeof(char *)); \
-        if (!_ns) goto oom; \
-        out.segments = _ns; \
-        memset(out.segments + seg_cap, 0, (size_t)(seg_cap) * sizeof(char *)); \
-        seg_cap = _nc; \
-    } \
-    out.segments[out.count++] = safe_strdup(buf_len ? buf : ""); \
-    buf_len = 0; \
-    buf[0] = '\0'; \
-    cells = 0; \
-    ansi_state_to_sgr(&st, replay_sgr, sizeof(replay_sgr)); \
-    if (replay_sgr[0]) { \
-        APPEND_BYTES(replay_sgr, strlen(replay_sgr)); \
-    } \
-} while (0)
-
-    for (int i = 0; line[i]; ) {
-        unsigned char c = (unsigned char)line[i];
-
-        if (c == 0x1B) {
-            int n = 0;
-
-            if (line[i + 1] == ']') {
-                n = ansi_seq_len_osc(line + i);
-                if (n <= 0) n = 1;
-                APPEND_BYTES(line + i, n);
-                i += n;
-                continue;
-            }
-
-            if (line[i + 1] == '[') {
-                n = ansi_seq_len_csi(line + i);
-                if (n <= 0) n = 1;
-
-                if (n > 2 && line[i + n - 1] == 'm') {
-                    int params[16];
-                    int pn = 0;
-                    int val = 0;
-                    int have = 0;
-
-                    int j = i + 2;
-                    while (j < i + n - 1 && pn < 16) {
-                        if (isdigit((unsigned char)line[j])) {
-                            val = val * 10 + (line[j] - '0');
+    AnsiRun *runs = NULL;
+    int n = 0, cap = 0;
+    int changed = 0, oom = 0;
+    int d = 0;
+
+    *runs_out = NULL;
+    for (int i = 0; s[i]; ) {
+        if ((unsigned char)s[i] == 0x1B) {
+            int len;
+            if (s[i+1] == '[') {
+                len = ansi_seq_len_csi(s + i);
+                if (s[i + len - 1] == 'm') {
+                    int params[16], pn = 0, val = 0, have = 0;
+                    for (int j = i + 2; j < i + len - 1 && pn < 16; j++) {
+                        if (isdigit((unsigned char)s[j])) {
+                            val = val * 10 + (s[j] - '0');
                             have = 1;
-                            j++;
-                        } else if (line[j] == ';') {
+                        } else if (s[j] == ';') {
                             params[pn++] = have ? val : 0;
-                            val = 0;
-                            have = 0;
-                            j++;
-                        } else {
-                            j++;
+                            val = 0; have = 0;
                         }
                     }
-                    if (pn < 16) {
-                        params[pn++] = have ? val : 0;
-                    }
-
+                    if (pn < 16) params[pn++] = have ? val : 0;
                     ansi_state_apply_params(&st, params, pn);
-                    ansi_state_to_sgr(&st, replay_sgr, sizeof(replay_sgr));
+                    changed = 1;
                 }
-
-                APPEND_BYTES(line + i, n);
-                i += n;
-                continue;
-            }
-
-            APPEND_BYTES(line + i, 1);
-            i += 1;
-            continue;
-        }
-
-        if (c == '\n' || c == '\r') break;
-
-        if (is_printable_cell(c)) {
-            if (cells >= width) {
-                FLUSH_SEG();
+            } else if (s[i+1] == ']') {
+                len = ansi_seq_len_osc(s + i);
+            } else {
+                len = s[i+1] ? 2 : 1;
             }
-            APPEND_BYTES(line + i, 1);
-            cells++;
-            i++;
+            i += len;
             continue;
         }
 
-        APPEND_BYTES(line + i, 1);
-        i++;
-    }
-
-    if (buf_len > 0 || out.count == 0) {
-        if (out.count >= seg_cap) {
-            char **_ns = (char **)realloc(out.segments, (size_t)(seg_cap + 1) * sizeof(char *));
-            if (!_ns) goto oom;
-            out.segments = _ns;
-        }
-        out.segments[out.count++] = safe_strdup(buf_len ? buf : "");
-    }
-
-    free(buf);
-    return out;
-
-oom:
-    free(buf);
-    if (out.segments) {
-        for (int k = 0; k < out.count; k++) free(out.segments[k]);
-        free(out.segments);
-    }
-    return (WrappedLine){0, NULL};
-
-#undef APPEND_BYTES
-#undef FLUSH_SEG
-}
-static WrappedLine wrap_line(const char *line, int width) {
-    WrappedLine result = (WrappedLine){0, NULL};
-    if (!line || width <= 0) return result;
-
-    int seg_cap = 8;
-    result.segments = (char**)calloc((size_t)seg_cap, sizeof(char*));
-    if (!result.segments) return result;
-
-    const char *p = line;
-
-    while (*p) {
-        const char *start = p;
-        const char *end = p;
-        int cells = 0;
-
-        while (*end) {
-            unsigned char c = (unsigned char)*end;
-            int add = 1;
-            int adv = 1;
-
-            if (c == '\t') {
-                add = 4 - (cells % 4);
-                adv = 1;
-            } else if (c < 0x80) {
-                add = 1;
-                adv = 1;
-            } else if ((c & 0xE0) == 0xC0) {
-                add = 1;
-                adv = 2;
-            } else if ((c & 0xF0) == 0xE0) {
-                add = 1;
-                adv = 3;
-            } else if ((c & 0xF8) == 0xF0) {
-                add = 1;
-                adv = 4;
-            }
-
-            if (cells + add > width && end > start) break;
-
-            cells += add;
-            end += adv;
-        }
-
-        size_t len = (size_t)(end - start);
-        char *seg = (char*)malloc(len + 1);
-        if (!seg) break;
-
-        memcpy(seg, start, len);
-        seg[len] = '\0';
-
-        if (result.count >= seg_cap) {
-            int new_cap = seg_cap * 2;
-            char **ns = (char**)realloc(result.segments, (size_t)new_cap * sizeof(char*));
-            if (!ns) {
-                free(seg);
-                break;
+        if (changed) {
+            AnsiRun r = { d, st.fg, st.bg,
+                          (unsigned char)((st.bold ? ANSI_BOLD : 0) | (st.ul ? ANSI_UL : 0) |
+                                          (st.ital ? ANSI_ITAL : 0)) };
+            const AnsiRun *prev = n ? &runs[n - 1] : NULL;
+            int same = prev ? (prev->fg == r.fg && prev->bg == r.bg && prev->flags == r.flags)
+                            : (r.fg < 0 && r.bg < 0 && r.flags == 0);
+            if (!same && !oom) {
+                if (n == cap) {
+                    int nc = cap ? cap * 2 : 4;
+                    AnsiRun *nr = (AnsiRun*)realloc(runs, (size_t)nc * sizeof(AnsiRun));
+                    if (nr) { runs = nr; cap = nc; }
+                    else oom = 1;
+                }
+                if (!oom) runs[n++] = r;
             }
-            result.segments = ns;
-            seg_cap = new_cap;
+            changed = 0;
         }
-
-        result.segments[result.count++] = seg;
-        p = end;
+        s[d++] = s[i++];
     }
+    s[d] = '\0';
 
-    if (result.count == 0) {
-        result.segments[0] = safe_strdup("");
-        result.count = 1;
-    }
-
-    return result;
-}
-static void free_wrapped_line(WrappedLine *wl) {
-    if (!wl || !wl->segments) return;
-    for (int i = 0; i < wl->count; i++) free(wl->segments[i]);
-    free(wl->segments);
-    wl->segments = NULL;
-    wl->count = 0;
+    if (oom) { free(runs); return 0; }
+    *runs_out = runs;
+    return n;
 }
 
-static int is_c_keyword(const char *word) {
-    static const char *kw[] = {
-        "auto","break","case","char","const","continue","default","do","double","else","enum","extern",
-        "float","for","goto","if","int","long","register","return","short","signed","sizeof","static",
-        "struct","switch","typedef","union","unsigned","void","volatile","while", NULL
-    };
-    for (int i = 0; kw[i]; i++) if (strcmp(word, kw[i]) == 0) return 1;
-    return 0;
-}
+// -----------------------------
+// Syntax lexer
+// Built-in highlighting, used whenever a buffer has no ANSI runs (no
+// external highlighter, or since the first edit).  Each language is one
+// row of g_syntax.  The lexer carries a small state from line to line -
+// inside a block comment or a multi-line string - cached per line as
+// meta[].lex_start/lex_end.  b->lex_valid counts the leading lines whose
+// end state is known good; an edit pulls it back to the edited line and
+// lex_state_at() walks forward on demand, re-lexing a line only if its
+// text or its start state changed, so a keystroke that leaves the end
+// state alone re-lexes just the line typed on.
+// -----------------------------
+enum { LEX_CODE = 0, LEX_BLOCK_COMMENT, LEX_TRIPLE_DQ, LEX_TRIPLE_SQ, LEX_BACKTICK,
+       /* only ever inside a line (a LexMark); never a line's end state */
+       LEX_LINE_COMMENT, LEX_DQ, LEX_SQ };
 
-static int is_python_keyword(const char *word) {
-    static const char *kw[] = {
-        "False","None","True","and","as","assert","async","await","break","class","continue","def","del",
-        "elif","else","except","finally","for","from","global","if","import","in","is","lambda","nonlocal",
-        "not","or","pass","raise","return","try","while","with","yield", NULL
-    };
-    for (int i = 0; kw[i]; i++) if (strcmp(word, kw[i]) == 0) return 1;
+typedef struct {
+    const char *line_comment[2];
+    const char *block_open;       /* NULL: none */
+    const char *block_close;
+    unsigned char triple_quotes;  /* """ and ''' strings span lines */
+    unsigned char backtick;       /* `...` strings span lines */
+    unsigned char kw_nocase;
+    const char *const *keywords;  /* NULL-terminated */
+} Syntax;
+
+static const char *const g_kw_c[] = {
+    "auto","break","case","char","const","continue","default","do","double","else","enum","extern",
+    "float","for","goto","if","int","long","register","return","short","signed","sizeof","static",
+    "struct","switch","typedef","union","unsigned","void","volatile","while", NULL
+};
+
+static const char *const g_kw_python[] = {
+    "False","None","True","and","as","assert","async","await","break","class","continue","def","del",
+    "elif","else","except","finally","for","from","global","if","import","in","is","lambda","nonlocal",
+    "not","or","pass","raise","return","try","while","with","yield", NULL
+};
+
+static const char *const g_kw_js[] = {
+    "async","await","break","case","catch","class","const","continue","debugger","default","delete","do",
+    "else","export","extends","finally","for","function","if","import","in","instanceof","let","new",
+    "return","super","switch","this","throw","try","typeof","var","void","while","with","yield", NULL
+};
+
+static const char *const g_kw_sql[] = {
+    "SELECT","FROM","WHERE","INSERT","UPDATE","DELETE","CREATE","DROP","ALTER","TABLE","JOIN",
+    "INNER","LEFT","RIGHT","OUTER","ON","AND","OR","NOT","NULL","IS","IN","LIKE","ORDER","BY",
+    "GROUP","HAVING","LIMIT","OFFSET","AS","DISTINCT", NULL
+};
+
+#define SYN_SLASH_COMMENTS { "//" }, "/*", "*/"
+#define SYN_MARKUP         { NULL }, "<!--", "-->"
+
+static const Syntax g_syntax[] = {
+    [LANG_NONE]     = { { NULL } },
+    [LANG_C]        = { SYN_SLASH_COMMENTS, .keywords = g_kw_c },
+    [LANG_CPP]      = { SYN_SLASH_COMMENTS, .keywords = g_kw_c },
+    [LANG_JAVA]     = { SYN_SLASH_COMMENTS },
+    [LANG_JS]       = { SYN_SLASH_COMMENTS, .backtick = 1, .keywords = g_kw_js },
+    [LANG_TS]       = { SYN_SLASH_COMMENTS, .backtick = 1, .keywords = g_kw_js },
+    [LANG_CSS]      = { SYN_SLASH_COMMENTS },
+    [LANG_GO]       = { SYN_SLASH_COMMENTS, .backtick = 1 },
+    [LANG_RUST]     = { SYN_SLASH_COMMENTS },
+    [LANG_PHP]      = { { "//", "#" }, "/*", "*/" },
+    [LANG_PYTHON]   = { { "#" }, .triple_quotes = 1, .keywords = g_kw_python },
+    [LANG_SHELL]    = { { "#" } },
+    [LANG_RUBY]     = { { "#" } },
+    [LANG_YAML]     = { { "#" } },
+    [LANG_SQL]      = { { "--" }, "/*", "*/", .kw_nocase = 1, .keywords = g_kw_sql },
+    [LANG_HTML]     = { SYN_MARKUP },
+    [LANG_XML]      = { SYN_MARKUP },
+    [LANG_MARKDOWN] = { SYN_MARKUP },
+    [LANG_MAN]      = { { NULL } },
+    [LANG_JSON]     = { { NULL } },
+    [LANG_XF]       = { { NULL } },
+};
+
+#undef SYN_SLASH_COMMENTS
+#undef SYN_MARKUP
+
+/* Whether a line of this language can leave the lexer in another state. */
+static int syntax_stateful(const Syntax *sx) {
+    return sx->block_open || sx->triple_quotes || sx->backtick;
+}
+
+static int syntax_is_keyword(const Syntax *sx, const char *word) {
+    if (!sx->keywords) return 0;
+    for (int i = 0; sx->keywords[i]; i++)
+        if ((sx->kw_nocase ? strcasecmp(word, sx->keywords[i]) : strcmp(word, sx->keywords[i])) == 0)
+            return 1;
     return 0;
 }
 
-static int is_js_keyword(const char *word) {
-    static const char *kw[] = {
-        "async","await","break","case","catch","class","const","continue","debugger","default","delete","do",
-        "else","export","extends","finally","for","function","if","import","in","instanceof","let","new",
-        "return","super","switch","this","throw","try","typeof","var","void","while","with","yield", NULL
-    };
-    for (int i = 0; kw[i]; i++) if (strcmp(word, kw[i]) == 0) return 1;
-    return 0;
+/* False when `line` cannot leave LEX_CODE: it holds no opener at all. */
+static int lex_may_open(const Syntax *sx, const char *line) {
+    return (sx->block_open && strstr(line, sx->block_open))
+        || (sx->triple_quotes && (strstr(line, "\"\"\"") || strstr(line, "'''")))
+        || (sx->backtick && strchr(line, '`'));
 }
 
-static int is_sql_keyword(const char *word) {
-    static const char *kw[] = {
-        "SELECT","FROM","WHERE","INSERT","UPDATE","DELETE","CREATE","DROP","ALTER","TABLE","JOIN",
-        "INNER","LEFT","RIGHT","OUTER","ON","AND","OR","NOT","NULL","IS","IN","LIKE","ORDER","BY",
-        "GROUP","HAVING","LIMIT","OFFSET","AS","DISTINCT", NULL
-    };
-    for (int i = 0; kw[i]; i++) if (strcasecmp(word, kw[i]) == 0) return 1;
-    return 0;
+static int lex_at(const char *line, int i, int full_len, const char *tok) {
+    int n = (int)strlen(tok);
+    return i + n <= full_len && memcmp(line + i, tok, (size_t)n) == 0;
 }
 
-static void highlight_line(const char *line, Language lang, int y, int start_x, int line_width,
-                          const char *search_term, int do_search_hl) {
-    if (!line) return;
-    int len = (int)strlen(line);
-    int i = 0;
-    int col = start_x;
-    int stlen = (do_search_hl && search_term && *search_term) ? (int)strlen(search_term) : 0;
-
-    while (i < len && col < line_width) {
-        if (stlen > 0) {
-            if (i + stlen <= len && strncmp(&line[i], search_term, (size_t)stlen) == 0) {
-                attron(COLOR_PAIR(COLOR_SEARCH_HL) | A_BOLD);
-                for (int k = 0; k < stlen && col < line_width; k++) mvaddch(y, col++, line[i++]);
-                attroff(COLOR_PAIR(COLOR_SEARCH_HL) | A_BOLD);
-                continue;
+/* A point between tokens where lex_line can pick up again. */
+typedef struct {
+    int off;
+    int state;
+} LexMark;
+
+#define LEX_MARK_BYTES 4096
+
+/* Lex `line` (full length `full_len`) from byte at->off in state
+ * at->state and return the state at its end.  With `out`, also write
+ * syntax-coloured cells for bytes [from, len), one chtype per byte with
+ * out[0] being byte `from`; the bytes before `from` are lexed only for
+ * their state.  A search span wins over the token colour and plain text
+ * gets attribute 0.  Without `out`, len must be full_len.
+ * at[k] (k < nat) is left at the last token boundary at or before
+ * from + k * LEX_MARK_BYTES. */
+static int lex_line(const Syntax *sx, const char *line, int from, int len, int full_len,
+                    LexMark *at, int nat, const MatchSpan *spans, int nspans, chtype *out) {
+    int i = at->off;
+    int state = at->state;
+    int lim = from;
+    MatchCursor mc;
+    match_cursor_init(&mc, spans, nspans);
+
+#define HL_PUT(attr) do { \
+        if (out && i >= from) \
+            out[i - from] = (chtype)(unsigned char)line[i] | \
+                     (match_cursor_at(&mc, i) ? (COLOR_PAIR(COLOR_SEARCH_HL) | A_BOLD) : (attr)); \
+        i++; \
+    } while (0)
+
+    /* Any byte inside a comment or string body is a place to resume too,
+     * so one huge token does not have to be lexed from its start. */
+#define LEX_MARK() do { \
+        for (; i > lim && nat > 1; nat--, lim += LEX_MARK_BYTES) { at[1] = at[0]; at++; } \
+        if (i <= lim) { at->off = i; at->state = state; } \
+    } while (0)
+
+    while (i < len) {
+        LEX_MARK();
+        /* Inside a construct carried over from an earlier line */
+        if (state == LEX_BLOCK_COMMENT) {
+            while (i < len && !lex_at(line, i, full_len, sx->block_close)) {
+                HL_PUT(COLOR_PAIR(COLOR_COMMENT));
+                LEX_MARK();
+            }
+            if (i < len) {
+                for (int k = (int)strlen(sx->block_close); k > 0 && i < len; k--)
+                    HL_PUT(COLOR_PAIR(COLOR_COMMENT));
+                state = LEX_CODE;
+            }
+            continue;
+        }
+        if (state == LEX_LINE_COMMENT) {
+            while (i < len) {
+                HL_PUT(COLOR_PAIR(COLOR_COMMENT));
+                LEX_MARK();
+            }
+            break;
+        }
+        if (state == LEX_DQ || state == LEX_SQ) {
+            char quote = state == LEX_DQ ? '"' : '\'';
+            while (i < len) {
+                int closes = (line[i] == quote && line[i-1] != '\\');
+                HL_PUT(COLOR_PAIR(COLOR_STRING));
+                if (closes) {
+                    state = LEX_CODE;
+                    break;
+                }
+                LEX_MARK();
+            }
+            continue;
+        }
+        if (state != LEX_CODE) {
+            const char *close = state == LEX_TRIPLE_DQ ? "\"\"\"" : state == LEX_TRIPLE_SQ ? "'''" : "`";
+            while (i < len && !(lex_at(line, i, full_len, close) && (i == 0 || line[i-1] != '\\'))) {
+                HL_PUT(COLOR_PAIR(COLOR_STRING));
+                LEX_MARK();
+            }
+            if (i < len) {
+                for (int k = (int)strlen(close); k > 0 && i < len; k--)
+                    HL_PUT(COLOR_PAIR(COLOR_STRING));
+                state = LEX_CODE;
             }
+            continue;
         }
 
         char ch = line[i];
 
-        if ((lang == LANG_C || lang == LANG_CPP || lang == LANG_JAVA || lang == LANG_JS || lang == LANG_TS ||
-             lang == LANG_CSS || lang == LANG_PHP || lang == LANG_GO || lang == LANG_RUST) &&
-            i + 1 < len && line[i] == '/' && line[i+1] == '/') {
-            attron(COLOR_PAIR(COLOR_COMMENT));
-            while (i < len && col < line_width) mvaddch(y, col++, line[i++]);
-            attroff(COLOR_PAIR(COLOR_COMMENT));
-            break;
+        if ((sx->line_comment[0] && lex_at(line, i, full_len, sx->line_comment[0])) ||
+            (sx->line_comment[1] && lex_at(line, i, full_len, sx->line_comment[1]))) {
+            state = LEX_LINE_COMMENT;
+            continue;
         }
 
-        if ((lang == LANG_PYTHON || lang == LANG_SHELL || lang == LANG_RUBY || lang == LANG_YAML || lang == LANG_PHP) &&
-            ch == '#') {
-            attron(COLOR_PAIR(COLOR_COMMENT));
-            while (i < len && col < line_width) mvaddch(y, col++, line[i++]);
-            attroff(COLOR_PAIR(COLOR_COMMENT));
-            break;
+        if (sx->block_open && lex_at(line, i, full_len, sx->block_open)) {
+            for (int k = (int)strlen(sx->block_open); k > 0 && i < len; k--)
+                HL_PUT(COLOR_PAIR(COLOR_COMMENT));
+            state = LEX_BLOCK_COMMENT;
+            continue;
         }
 
-        if (lang == LANG_SQL && i + 1 < len && line[i] == '-' && line[i+1] == '-') {
-            attron(COLOR_PAIR(COLOR_COMMENT));
-            while (i < len && col < line_width) mvaddch(y, col++, line[i++]);
-            attroff(COLOR_PAIR(COLOR_COMMENT));
-            break;
+        if (sx->triple_quotes && (lex_at(line, i, full_len, "\"\"\"") || lex_at(line, i, full_len, "'''"))) {
+            state = ch == '"' ? LEX_TRIPLE_DQ : LEX_TRIPLE_SQ;
+            for (int k = 3; k > 0 && i < len; k--) HL_PUT(COLOR_PAIR(COLOR_STRING));
+            continue;
+        }
+
+        if (sx->backtick && ch == '`') {
+            state = LEX_BACKTICK;
+            HL_PUT(COLOR_PAIR(COLOR_STRING));
+            continue;
         }
 
         if (ch == '"' || ch == '\'') {
-            char quote = ch;
-            attron(COLOR_PAIR(COLOR_STRING));
-            mvaddch(y, col++, line[i++]);
-            while (i < len && col < line_width) {
-                ch = line[i];
-                mvaddch(y, col++, ch);
-                if (ch == quote && (i == 0 || line[i-1] != '\\')) { i++; break; }
-                i++;
-            }
-            attroff(COLOR_PAIR(COLOR_STRING));
+            state = ch == '"' ? LEX_DQ : LEX_SQ;
+            HL_PUT(COLOR_PAIR(COLOR_STRING));
             continue;
         }
 
         if (isdigit((unsigned char)ch)) {
-            attron(COLOR_PAIR(COLOR_NUMBER));
-            while (i < len && col < line_width &&
+            while (i < len &&
                    (isdigit((unsigned char)line[i]) || line[i] == '.' || line[i] == 'x' || line[i] == 'X' ||
                     (line[i] >= 'a' && line[i] <= 'f') || (line[i] >= 'A' && line[i] <= 'F'))) {
-                mvaddch(y, col++, line[i++]);
+                HL_PUT(COLOR_PAIR(COLOR_NUMBER));
             }
-            attroff(COLOR_PAIR(COLOR_NUMBER));
             continue;
         }
 
@@ -1480,25 +2797,425 @@ static void highlight_line(const char *line, Language lang, int y, int start_x,
             char word[128];
             int w = 0;
             int start = i;
-            while (i < len && (isalnum((unsigned char)line[i]) || line[i] == '_') && w < 127) {
-                word[w++] = line[i++];
+            while (start + w < full_len && (isalnum((unsigned char)line[start + w]) || line[start + w] == '_') && w < 127) {
+                word[w] = line[start + w];
+                w++;
             }
             word[w] = '\0';
 
-            int iskw = 0;
-            if (lang == LANG_C || lang == LANG_CPP) iskw = is_c_keyword(word);
-            else if (lang == LANG_PYTHON) iskw = is_python_keyword(word);
-            else if (lang == LANG_JS || lang == LANG_TS) iskw = is_js_keyword(word);
-            else if (lang == LANG_SQL) iskw = is_sql_keyword(word);
-
-            if (iskw) attron(COLOR_PAIR(COLOR_KEYWORD) | A_BOLD);
-            for (int k = 0; k < w && col < line_width; k++) mvaddch(y, col++, line[start + k]);
-            if (iskw) attroff(COLOR_PAIR(COLOR_KEYWORD) | A_BOLD);
+            attr_t a = (out && start + w > from && syntax_is_keyword(sx, word)) ? (COLOR_PAIR(COLOR_KEYWORD) | A_BOLD) : 0;
+            while (i < start + w && i < len) HL_PUT(a);
             continue;
         }
 
-        mvaddch(y, col++, line[i++]);
+        HL_PUT(0);
+    }
+
+#undef LEX_MARK
+#undef HL_PUT
+    for (; nat > 1; nat--) { at[1] = at[0]; at++; }
+    /* a // comment or an unclosed quote ends with the line */
+    return state >= LEX_LINE_COMMENT ? LEX_CODE : state;
+}
+
+/* Lexer state at the start of line idx, lexing forward from the last line
+ * known good.  A line whose text and start state both match what it was
+ * last lexed with keeps its cached end state without being looked at. */
+static int lex_state_at(Buffer *b, int idx) {
+    const Syntax *sx = &g_syntax[b->lang];
+    if (!syntax_stateful(sx) || idx <= 0) return LEX_CODE;
+    if (idx > b->line_count) idx = b->line_count;
+
+    while (b->lex_valid < idx) {
+        int k = b->lex_valid;
+        int state = k > 0 ? b->meta[k - 1].lex_end : LEX_CODE;
+        LineMeta *m = &b->meta[k];
+        if (m->lex_version != m->version || m->lex_start != state) {
+            const char *line = b->lines[k];
+            if (state == LEX_CODE && !lex_may_open(sx, line)) {
+                m->lex_end = LEX_CODE;
+            } else {
+                int n = (int)strlen(line);
+                LexMark at = { 0, state };
+                m->lex_end = (unsigned char)lex_line(sx, line, 0, n, n, &at, 1, NULL, 0, NULL);
+            }
+            m->lex_start = (unsigned char)state;
+            m->lex_version = m->version;
+        }
+        b->lex_valid++;
+    }
+    return b->meta[idx - 1].lex_end;
+}
+
+/* Forget every cached lexer state, e.g. when the language changes. */
+static void lex_reset(Buffer *b) {
+    for (int i = 0; i < b->line_count; i++) b->meta[i].lex_version = 0;
+    b->lex_valid = 0;
+}
+
+// -----------------------------
+// Lexer marks
+// For lines longer than LEX_MARK_BYTES, a token boundary and the lexer
+// state there about every LEX_MARK_BYTES bytes, so drawing a line scrolled
+// far right lexes from the nearest mark instead of from its start.  Keyed
+// by the line's version stamp and start state like the caches below.
+// -----------------------------
+#define LCACHE_SETS 64
+#define LCACHE_WAYS 2
+
+typedef struct {
+    unsigned version;    /* 0: empty */
+    int      key;        /* language and start state */
+    int      n;
+    int      cap;
+    LexMark *marks;      /* marks[k] is at or before k * LEX_MARK_BYTES */
+    unsigned used;
+} LexIndexEnt;
+
+static LexIndexEnt g_lcache[LCACHE_SETS][LCACHE_WAYS];
+static unsigned    g_lcache_clock = 0;
+
+/* The last mark at or before byte `from` of line idx, which starts in
+ * state `lex`; byte 0 itself for a short line (or when out of memory). */
+static LexMark lex_mark_before(const Buffer *b, int idx, int lex, int from) {
+    LexMark start = { 0, lex };
+    const char *line = b->lines[idx];
+    if (from < LEX_MARK_BYTES) return start;
+
+    unsigned version = b->meta[idx].version;
+    int key = ((int)b->lang << 4) | lex;
+    LexIndexEnt *set = g_lcache[(version * 2654435761u) >> 26 & (LCACHE_SETS - 1)];
+
+    LexIndexEnt *e = NULL, *victim = &set[0];
+    for (int w = 0; w < LCACHE_WAYS && !e; w++) {
+        if (set[w].version == version && set[w].key == key) e = &set[w];
+        else if (set[w].used < victim->used) victim = &set[w];
+    }
+    if (!e) {
+        const Syntax *sx = &g_syntax[b->lang];
+        int len = (int)strlen(line);
+        int need = len / LEX_MARK_BYTES + 1;
+        if (need > victim->cap) {
+            LexMark *nm = (LexMark*)realloc(victim->marks, (size_t)need * sizeof(LexMark));
+            if (!nm) return start;
+            victim->marks = nm;
+            victim->cap = need;
+        }
+        victim->marks[0] = start;
+        lex_line(sx, line, 0, len, len, victim->marks, need, NULL, 0, NULL);
+        victim->version = version;
+        victim->key = key;
+        victim->n = need;
+        e = victim;
+    }
+    e->used = ++g_lcache_clock;
+    int k = from / LEX_MARK_BYTES;
+    return e->marks[k < e->n ? k : e->n - 1];
+}
+
+// -----------------------------
+// Line snapshots
+// An immutable view of a buffer's lines that worker threads read without
+// locks.  Once a buffer has been snapshotted it keeps its lines as a table
+// of reference-counted blocks of up to LINE_BLOCK line pointers, each
+// tagged with the line it starts at, and a snapshot is one reference on
+// that table.  Edits keep the table current copy-on-write: it is copied
+// only while a snapshot still shares it, a block only when another table
+// shares that, and an edit rebuilds just the blocks around the lines it
+// changed (inserting or removing lines also renumbers the later ones).
+// Line strings are never modified in place (buf_set_line swaps in a new
+// one), so a string the buffer lets go of only has to outlive the
+// snapshots that may still see it: lines_retire() defers the free until
+// they have all been released.
+// -----------------------------
+#define LINE_BLOCK 256
+
+typedef struct {
+    int refs;                    /* under g_snap.mu */
+    char *line[LINE_BLOCK];
+} LineBlock;
+
+typedef struct {
+    int start;                   /* buffer line of blk->line[0] */
+    int n;                       /* lines in blk, 1..LINE_BLOCK */
+    LineBlock *blk;
+} LineSpan;
+
+struct LineTable {
+    int refs;                    /* under g_snap.mu; the buffer holds one */
+    int count;
+    int n, cap;
+    LineSpan span[];             /* back to back, covering [0, count) */
+};
+
+typedef struct LineSnap {
+    int count;
+    LineTable *tab;
+    unsigned long seq;
+    struct LineSnap *prev, *next;   /* live list, oldest first */
+} LineSnap;
+
+typedef struct {
+    char *s;
+    unsigned long seq;           /* newest snapshot issued when retired */
+} RetiredLine;
+
+static struct {
+    pthread_mutex_t mu;
+    LineSnap *oldest, *newest;
+    volatile int nlive;          /* read unlocked by the UI thread, see lines_retire */
+    unsigned long seq;
+    RetiredLine *dead;           /* ordered by seq */
+    int ndead, dead_cap;
+} g_snap = { .mu = PTHREAD_MUTEX_INITIALIZER };
+
+/* The span holding line i (< t->count), or t->n for i == t->count.  Tries
+ * `hint` and the span after it first, so a scan pays no search. */
+static inline int line_table_find(const LineTable *t, int i, int hint) {
+    if (hint >= 0 && hint < t->n && i >= t->span[hint].start) {
+        if (i < t->span[hint].start + t->span[hint].n) return hint;
+        if (hint + 1 == t->n || i < t->span[hint + 1].start + t->span[hint + 1].n) return hint + 1;
+    }
+    int lo = 0, hi = t->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (t->span[mid].start + t->span[mid].n <= i) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+/* Line i of the snapshot.  *hint carries the block between calls: start it
+ * at 0 and keep it per scan. */
+static inline const char *snap_line(const LineSnap *s, int i, int *hint) {
+    const LineTable *t = s->tab;
+    int k = *hint = line_table_find(t, i, *hint);
+    return t->span[k].blk->line[i - t->span[k].start];
+}
+
+static LineBlock *line_block_new(char *const *lines, int n) {
+    LineBlock *k = (LineBlock*)malloc(sizeof(*k));
+    if (!k) return NULL;
+    k->refs = 1;
+    memcpy(k->line, lines, (size_t)n * sizeof(char*));
+    return k;
+}
+
+/* Caller holds g_snap.mu. */
+static void line_block_unref(LineBlock *k) {
+    if (k && --k->refs == 0) free(k);
+}
+
+/* Caller holds g_snap.mu. */
+static void line_table_unref(LineTable *t) {
+    if (!t || --t->refs > 0) return;
+    for (int k = 0; k < t->n; k++) line_block_unref(t->span[k].blk);
+    free(t);
+}
+
+/* Free line strings the buffer no longer holds, or park them until every
+ * snapshot that could see them is released. */
+static void lines_retire(char **v, int n) {
+    if (n <= 0) return;
+    /* Only the UI thread takes snapshots, so zero here cannot be stale */
+    if (g_snap.nlive == 0) {
+        for (int i = 0; i < n; i++) free(v[i]);
+        return;
+    }
+    pthread_mutex_lock(&g_snap.mu);
+    if (!g_snap.oldest) {
+        pthread_mutex_unlock(&g_snap.mu);
+        for (int i = 0; i < n; i++) free(v[i]);
+        return;
+    }
+    if (g_snap.ndead + n > g_snap.dead_cap) {
+        int nc = g_snap.dead_cap ? g_snap.dead_cap : 256;
+        while (nc < g_snap.ndead + n) nc *= 2;
+        RetiredLine *nd = (RetiredLine*)realloc(g_snap.dead, (size_t)nc * sizeof(RetiredLine));
+        if (!nd) { pthread_mutex_unlock(&g_snap.mu); return; }  /* leak, never free early */
+        g_snap.dead = nd;
+        g_snap.dead_cap = nc;
+    }
+    for (int i = 0; i < n; i++) {
+        if (!v[i]) continue;
+        g_snap.dead[g_snap.ndead].s = v[i];
+        g_snap.dead[g_snap.ndead].seq = g_snap.seq;
+        g_snap.ndead++;
+    }
+    pthread_mutex_unlock(&g_snap.mu);
+}
+
+/* A table of `cap` spans, holding none yet. */
+static LineTable *line_table_new(int count, int cap) {
+    LineTable *t = (LineTable*)malloc(sizeof(LineTable) + (size_t)(cap ? cap : 1) * sizeof(LineSpan));
+    if (!t) return NULL;
+    t->refs = 1;
+    t->count = count;
+    t->n = 0;
+    t->cap = cap;
+    return t;
+}
+
+/* The buffer's lines as full blocks, for its first snapshot.  UI thread. */
+static LineTable *line_table_build(Buffer *b) {
+    int n = (b->line_count + LINE_BLOCK - 1) / LINE_BLOCK;
+    LineTable *t = line_table_new(b->line_count, n + n / 8 + 4);
+    if (!t) return NULL;
+    for (int pos = 0; pos < b->line_count; pos += LINE_BLOCK) {
+        int m = b->line_count - pos < LINE_BLOCK ? b->line_count - pos : LINE_BLOCK;
+        LineBlock *k = line_block_new(&b->lines[pos], m);
+        if (!k) {
+            pthread_mutex_lock(&g_snap.mu);
+            line_table_unref(t);
+            pthread_mutex_unlock(&g_snap.mu);
+            return NULL;
+        }
+        t->span[t->n++] = (LineSpan){ pos, m, k };
+    }
+    return t;
+}
+
+/* Lines [at, at + removed) of the buffer were replaced by `inserted`
+ * lines, already in b->lines.  Bring b->snap_tab up to date: copy it if a
+ * snapshot shares it, patch an unshared block in place, otherwise rebuild
+ * the blocks holding the edit (merging a short result with a neighbour)
+ * from b->lines, and renumber the blocks after it.  On OOM the table is
+ * dropped; the next snapshot builds it afresh. */
+static void buf_blocks_edit(Buffer *b, int at, int removed, int inserted) {
+    LineTable *t = b->snap_tab;
+    if (!t) return;
+    int delta = inserted - removed;
+
+    pthread_mutex_lock(&g_snap.mu);
+    if (t->refs > 1) {
+        LineTable *c = line_table_new(t->count, t->cap);
+        if (!c) goto drop;
+        memcpy(c->span, t->span, (size_t)t->n * sizeof(LineSpan));
+        c->n = t->n;
+        for (int k = 0; k < c->n; k++) c->span[k].blk->refs++;
+        t->refs--;
+        b->snap_tab = t = c;
+    }
+
+    int lo = line_table_find(t, at, -1);
+    if (lo == t->n && lo > 0) lo--;   /* appending: the last block */
+    LineSpan *sp = &t->span[lo];
+    if (lo < t->n && sp->blk->refs == 1 && at + removed <= sp->start + sp->n &&
+        sp->n + delta <= LINE_BLOCK && (delta >= 0 || sp->n + delta >= LINE_BLOCK / 2)) {
+        /* inside one block of ours: shift its tail in place */
+        int off = at - sp->start;
+        memmove(&sp->blk->line[off + inserted], &sp->blk->line[off + removed],
+                (size_t)(sp->n - off - removed) * sizeof(char*));
+        memcpy(&sp->blk->line[off], &b->lines[at], (size_t)inserted * sizeof(char*));
+        sp->n += delta;
+    } else {
+        /* Rebuild spans [lo, k1): every block holding a removed line, or
+         * the one a pure insert splits, as lines [rs, re) of the buffer. */
+        int k1 = lo;
+        while (k1 < t->n && t->span[k1].start < at + removed) k1++;
+        int rs = lo < k1 ? t->span[lo].start : at;
+        int re = (lo < k1 ? t->span[k1 - 1].start + t->span[k1 - 1].n : at) + delta;
+        /* a short result takes in a neighbour, so short blocks cannot pile up */
+        while (re - rs < LINE_BLOCK / 2) {
+            if (k1 < t->n && re - rs + t->span[k1].n <= LINE_BLOCK) re += t->span[k1++].n;
+            else if (lo > 0 && re - rs + t->span[lo - 1].n <= LINE_BLOCK) rs = t->span[--lo].start;
+            else break;
+        }
+
+        int len = re - rs;
+        int m = (len + LINE_BLOCK - 1) / LINE_BLOCK;
+        int n = t->n - (k1 - lo) + m;
+        if (n > t->cap) {
+            int nc = t->cap * 2 > n ? t->cap * 2 : n;
+            LineTable *nt = (LineTable*)realloc(t, sizeof(LineTable) + (size_t)nc * sizeof(LineSpan));
+            if (!nt) goto drop;
+            b->snap_tab = t = nt;
+            t->cap = nc;
+        }
+        LineBlock *nb[4], **blks = m <= 4 ? nb : (LineBlock**)malloc((size_t)m * sizeof(*blks));
+        if (!blks) goto drop;
+        int ok = 1;
+        for (int j = 0, pos = rs; j < m; j++) {
+            int cnt = len / m + (j < len % m);
+            if (!(blks[j] = line_block_new(&b->lines[pos], cnt))) {
+                while (j-- > 0) free(blks[j]);
+                ok = 0;
+                break;
+            }
+            pos += cnt;
+        }
+        if (ok) {
+            for (int k = lo; k < k1; k++) line_block_unref(t->span[k].blk);
+            memmove(&t->span[lo + m], &t->span[k1], (size_t)(t->n - k1) * sizeof(LineSpan));
+            for (int j = 0, pos = rs; j < m; j++) {
+                int cnt = len / m + (j < len % m);
+                t->span[lo + j] = (LineSpan){ pos, cnt, blks[j] };
+                pos += cnt;
+            }
+            t->n = n;
+            lo += m - 1;
+        }
+        if (blks != nb) free(blks);
+        if (!ok) goto drop;
+    }
+    if (delta)
+        for (int k = lo + 1; k < t->n; k++) t->span[k].start += delta;
+    t->count += delta;
+    pthread_mutex_unlock(&g_snap.mu);
+    return;
+
+drop:
+    line_table_unref(b->snap_tab);
+    b->snap_tab = NULL;
+    pthread_mutex_unlock(&g_snap.mu);
+}
+
+static void buf_blocks_free(Buffer *b) {
+    pthread_mutex_lock(&g_snap.mu);
+    line_table_unref(b->snap_tab);
+    pthread_mutex_unlock(&g_snap.mu);
+    b->snap_tab = NULL;
+}
+
+/* UI thread only.  Returns NULL on OOM. */
+static LineSnap *line_snap_take(Buffer *b) {
+    LineSnap *s = (LineSnap*)calloc(1, sizeof(*s));
+    if (!s) return NULL;
+    if (!b->snap_tab && !(b->snap_tab = line_table_build(b))) { free(s); return NULL; }
+
+    pthread_mutex_lock(&g_snap.mu);
+    b->snap_tab->refs++;
+    s->tab = b->snap_tab;
+    s->count = b->snap_tab->count;
+    s->seq = ++g_snap.seq;
+    g_snap.nlive++;
+    s->prev = g_snap.newest;
+    if (g_snap.newest) g_snap.newest->next = s;
+    else g_snap.oldest = s;
+    g_snap.newest = s;
+    pthread_mutex_unlock(&g_snap.mu);
+    return s;
+}
+
+/* Any thread.  Frees retired lines no remaining snapshot can see. */
+static void line_snap_release(LineSnap *s) {
+    if (!s) return;
+    pthread_mutex_lock(&g_snap.mu);
+    line_table_unref(s->tab);
+    if (s->prev) s->prev->next = s->next;
+    else g_snap.oldest = s->next;
+    if (s->next) s->next->prev = s->prev;
+    else g_snap.newest = s->prev;
+    g_snap.nlive--;
+
+    int n = 0;
+    while (n < g_snap.ndead && (!g_snap.oldest || g_snap.dead[n].seq < g_snap.oldest->seq))
+        free(g_snap.dead[n++].s);
+    if (n > 0) {
+        memmove(g_snap.dead, g_snap.dead + n, (size_t)(g_snap.ndead - n) * sizeof(RetiredLine));
+        g_snap.ndead -= n;
     }
+    pthread_mutex_unlock(&g_snap.mu);
+    free(s);
 }
 
 static int buf_ensure_capacity(Buffer *b, int needed) {
@@ -1508,20 +3225,102 @@ static int buf_ensure_capacity(Buffer *b, int needed) {
     char **np = (char**)realloc(b->lines, (size_t)new_cap * sizeof(char*));
     if (!np) return 0;
     b->lines = np;
+    LineMeta *nm = (LineMeta*)realloc(b->meta, (size_t)new_cap * sizeof(LineMeta));
+    if (!nm) return 0;
+    memset(nm + b->line_cap, 0, (size_t)(new_cap - b->line_cap) * sizeof(LineMeta));
+    b->meta = nm;
     b->line_cap = new_cap;
     return 1;
 }
 
+static unsigned g_line_version_seq = 0;
+static unsigned g_next_buf_id = 1;
+
+/* Mark line i as changed: every cache keyed on its version goes stale. */
+static void line_touch(Buffer *b, int i) {
+    b->meta[i].version = ++g_line_version_seq;
+    if (b->lex_valid > i) b->lex_valid = i;
+}
+
+static void line_meta_free(LineMeta *m) {
+    free(m->matches);
+    free(m->ansi);
+    memset(m, 0, sizeof(*m));
+}
+
+/* Replace line i with `plain` (ownership taken).  Its ANSI runs, if any,
+ * are dropped: the line renders unstyled while the buffer is still in
+ * ANSI mode. */
+static void buf_set_line(Buffer *b, int i, char *plain) {
+    lines_retire(&b->lines[i], 1);
+    b->lines[i] = plain;
+    buf_blocks_edit(b, i, 1, 1);
+    free(b->meta[i].ansi);
+    b->meta[i].ansi = NULL;
+    b->meta[i].ansi_count = 0;
+    line_touch(b, i);
+    rows_line_changed(b, i);
+    b->dirty = 1;
+}
+
+/* Open n NULL slots at `at`, shifting lines/meta down together.
+ * The caller must fill every slot (buf_set_line accepts a NULL slot). */
+static int buf_insert_slots(Buffer *b, int at, int n) {
+    if (n <= 0) return 1;
+    if (!buf_ensure_capacity(b, b->line_count + n)) return 0;
+    int tail = b->line_count - at;
+    if (tail > 0) {
+        memmove(&b->lines[at + n],     &b->lines[at],     (size_t)tail * sizeof(char*));
+        memmove(&b->meta[at + n],      &b->meta[at],      (size_t)tail * sizeof(LineMeta));
+    }
+    for (int i = at; i < at + n; i++) {
+        b->lines[i] = NULL;
+        memset(&b->meta[i], 0, sizeof(LineMeta));
+    }
+    b->line_count += n;
+    b->row_tree_valid = 0;
+    if (b->lex_valid > at) b->lex_valid = at;
+    buf_blocks_edit(b, at, 0, n);
+    return 1;
+}
+
+/* Free lines [at, at+n) and close the gap.  May leave line_count == 0. */
+static void buf_remove_lines(Buffer *b, int at, int n) {
+    if (at < 0 || n <= 0 || at >= b->line_count) return;
+    if (at + n > b->line_count) n = b->line_count - at;
+    lines_retire(&b->lines[at], n);
+    for (int i = at; i < at + n; i++) line_meta_free(&b->meta[i]);
+    int tail = b->line_count - (at + n);
+    if (tail > 0) {
+        memmove(&b->lines[at],     &b->lines[at + n],     (size_t)tail * sizeof(char*));
+        memmove(&b->meta[at],      &b->meta[at + n],      (size_t)tail * sizeof(LineMeta));
+    }
+    for (int i = b->line_count - n; i < b->line_count; i++) {
+        b->lines[i] = NULL;
+        memset(&b->meta[i], 0, sizeof(LineMeta));
+    }
+    b->line_count -= n;
+    b->row_tree_valid = 0;
+    if (b->lex_valid > at) b->lex_valid = at;
+    buf_blocks_edit(b, at, n, 0);
+    b->dirty = 1;
+}
+
+/* Keep at least one (empty) line so cursor code never sees line_count == 0. */
+static void buf_ensure_nonempty(Buffer *b) {
+    if (b->line_count > 0) return;
+    if (!buf_insert_slots(b, 0, 1)) return;
+    buf_set_line(b, 0, safe_strdup(""));
+}
+
 static void buffer_init_blank(Buffer *b, const char *filepath) {
     memset(b, 0, sizeof(*b));
+    b->id = g_next_buf_id++;
     b->is_active = 1;
 
     b->line_cap = INITIAL_LINE_CAP;
     b->lines = (char**)calloc((size_t)b->line_cap, sizeof(char*));
-
-    b->raw_cap = INITIAL_LINE_CAP;
-    b->raw_lines = (char**)calloc((size_t)b->raw_cap, sizeof(char*));
-    b->raw_has_ansi = 0;
+    b->meta = (LineMeta*)calloc((size_t)b->line_cap, sizeof(LineMeta));
 
     if (filepath && *filepath) {
         snprintf(b->filepath, sizeof(b->filepath), "%s", filepath);
@@ -1533,8 +3332,8 @@ static void buffer_init_blank(Buffer *b, const char *filepath) {
 
     b->line_count = 1;
     b->lines[0] = safe_strdup("");
+    line_touch(b, 0);
 
-    b->raw_lines[0] = safe_strdup("");
     b->scroll_offset = 0;
     b->dirty = 0;
 
@@ -1542,125 +3341,215 @@ static void buffer_init_blank(Buffer *b, const char *filepath) {
     b->redo = NULL; b->redo_len = 0; b->redo_cap = 0;
 }
 
+static void undo_rec_free(UndoRec *r) {
+    free(r->snap);
+    free(r->edits);
+    free(r->pool);
+    memset(r, 0, sizeof(*r));
+}
+
 static void free_buffer(Buffer *b) {
     if (!b) return;
 
+    buf_blocks_free(b);
+    lines_retire(b->lines, b->line_count);
     for (int i = 0; i < b->line_count; i++) {
-        free(b->lines[i]);
         b->lines[i] = NULL;
+        line_meta_free(&b->meta[i]);
     }
     free(b->lines);
     b->lines = NULL;
-
-    if (b->raw_lines) {
-        for (int i = 0; i < b->line_count; i++) {
-            free(b->raw_lines[i]);
-            b->raw_lines[i] = NULL;
-        }
-        free(b->raw_lines);
-        b->raw_lines = NULL;
-    }
+    free(b->meta);
+    b->meta = NULL;
 
     b->line_count = 0;
     b->line_cap = 0;
-    b->raw_cap = 0;
-    b->raw_has_ansi = 0;
+    b->has_ansi = 0;
 
     b->is_active = 0;
+    job_cancel(0, b->id);
 
-    for (int i = 0; i < b->undo_len; i++) free(b->undo[i]);
+    for (int i = 0; i < b->undo_len; i++) undo_rec_free(&b->undo[i]);
     free(b->undo); b->undo = NULL; b->undo_len = 0; b->undo_cap = 0;
 
-    for (int i = 0; i < b->redo_len; i++) free(b->redo[i]);
+    for (int i = 0; i < b->redo_len; i++) undo_rec_free(&b->redo[i]);
     free(b->redo); b->redo = NULL; b->redo_len = 0; b->redo_cap = 0;
+
+    free(b->row_tree); b->row_tree = NULL; b->row_tree_valid = 0; b->row_width = 0;
+}
+
+/* Push rec onto a stack, taking ownership; frees rec on failure. */
+static void undo_stack_push(UndoRec **stack, int *len, int *cap, UndoRec rec) {
+    if (*len >= *cap) {
+        int new_cap = *cap ? *cap * 2 : 32;
+        UndoRec *np = realloc(*stack, (size_t)new_cap * sizeof(UndoRec));
+        if (!np) { undo_rec_free(&rec); return; }
+        *stack = np;
+        *cap = new_cap;
+    }
+    (*stack)[(*len)++] = rec;
+}
+
+static void redo_clear(Buffer *b) {
+    for (int i = 0; i < b->redo_len; i++) undo_rec_free(&b->redo[i]);
+    b->redo_len = 0;
 }
 
 static void undo_push(Buffer *b) {
     if (!b) return;
-    char *snap = buffer_serialize(b);
-    if (!snap) return;
-    for (int i = 0; i < b->redo_len; i++) free(b->redo[i]);
-    b->redo_len = 0;
-    if (b->undo_len >= b->undo_cap) {
-        int new_cap = b->undo_cap ? b->undo_cap * 2 : 32;
-        char **np = realloc(b->undo, new_cap * sizeof(char*));
-        if (!np) { free(snap); return; }
-        b->undo = np;
-        b->undo_cap = new_cap;
+    UndoRec rec = {0};
+    rec.snap = buffer_serialize(b);
+    if (!rec.snap) return;
+    redo_clear(b);
+    undo_stack_push(&b->undo, &b->undo_len, &b->undo_cap, rec);
+}
+
+/* Record an already-applied patch (see UndoEdit) as one undo step. */
+static void undo_push_patch(Buffer *b, UndoRec rec) {
+    if (!b || rec.nedits <= 0) { undo_rec_free(&rec); return; }
+    redo_clear(b);
+    undo_stack_push(&b->undo, &b->undo_len, &b->undo_cap, rec);
+}
+
+/* Swap every edit of a patch into the buffer.  The record is rewritten in
+ * place to hold the text it displaced, so it becomes its own inverse. */
+static int undo_patch_apply(Buffer *b, UndoRec *rec) {
+    size_t pool_len = 0;
+    for (int i = 0; i < rec->nedits; i++) pool_len += (size_t)rec->edits[i].del_len;
+    char *pool = (char*)malloc(pool_len + 1);
+    if (!pool) return -1;
+
+    size_t off = 0;
+    for (int i = 0; i < rec->nedits; i++) {
+        UndoEdit *e = &rec->edits[i];
+        if (e->line < 0 || e->line >= b->line_count) continue;
+        const char *cur = b->lines[e->line];
+        size_t cur_len = strlen(cur);
+        size_t tail = cur_len - (size_t)(e->col + e->del_len);
+        char *nl = (char*)malloc(cur_len - (size_t)e->del_len + (size_t)e->ins_len + 1);
+        if (!nl) { free(pool); return -1; }
+        memcpy(nl, cur, (size_t)e->col);
+        memcpy(nl + e->col, rec->pool + e->ins_off, (size_t)e->ins_len);
+        memcpy(nl + e->col + e->ins_len, cur + e->col + e->del_len, tail + 1);
+        memcpy(pool + off, cur + e->col, (size_t)e->del_len);
+
+        int removed = e->del_len;
+        e->del_len = e->ins_len;
+        e->ins_off = (int)off;
+        e->ins_len = removed;
+        off += (size_t)removed;
+        buf_set_line(b, e->line, nl);
+    }
+    free(rec->pool);
+    rec->pool = pool;
+    return 0;
+}
+
+/* Undo/redo share this: apply the top of `from`, push its inverse to `to`. */
+static void undo_transfer(ViewerState *st, UndoRec **from, int *from_len,
+                          UndoRec **to, int *to_len, int *to_cap) {
+    Buffer *b = &st->buffers[st->current_buffer];
+    if (*from_len <= 0) return;
+    UndoRec *top = &(*from)[*from_len - 1];
+
+    if (top->snap) {
+        UndoRec cur = {0};
+        cur.snap = buffer_serialize(b);
+        if (!cur.snap) return;
+        UndoRec rec = (*from)[--(*from_len)];
+        buffer_deserialize(b, rec.snap);
+        undo_rec_free(&rec);
+        undo_stack_push(to, to_len, to_cap, cur);
+    } else {
+        if (undo_patch_apply(b, top) != 0) { set_status(st, "Out of memory"); return; }
+        UndoRec rec = (*from)[--(*from_len)];
+        st->cursor_line = rec.edits[0].line;
+        st->cursor_col = rec.edits[0].col;
+        undo_stack_push(to, to_len, to_cap, rec);
     }
-    b->undo[b->undo_len++] = snap;
+    b->dirty = 1;
+    ensure_cursor_bounds(st);
 }
 
 static void do_undo(ViewerState *st) {
     Buffer *b = &st->buffers[st->current_buffer];
-    if (b->undo_len <= 0) return;
-    char *cur = buffer_serialize(b);
-    if (!cur) return;
-    if (b->redo_len >= b->redo_cap) {
-        int new_cap = b->redo_cap ? b->redo_cap * 2 : 32;
-        char **np = realloc(b->redo, new_cap * sizeof(char*));
-        if (!np) { free(cur); return; }
-        b->redo = np;
-        b->redo_cap = new_cap;
-    }
-    b->redo[b->redo_len++] = cur;
-    char *snap = b->undo[--b->undo_len];
-    buffer_deserialize(b, snap);
-    free(snap);
-    b->dirty = 1;
-    /* After undo, raw_lines are stale; sync them from plain lines */
-    for (int i = 0; i < b->line_count; i++) {
-        free(b->raw_lines[i]);
-        b->raw_lines[i] = safe_strdup(b->lines[i]);
-    }
-    b->raw_has_ansi = 0;
+    undo_transfer(st, &b->undo, &b->undo_len, &b->redo, &b->redo_len, &b->redo_cap);
 }
 
 static void do_redo(ViewerState *st) {
     Buffer *b = &st->buffers[st->current_buffer];
-    if (b->redo_len <= 0) return;
-    char *cur = buffer_serialize(b);
-    if (!cur) return;
-    if (b->undo_len >= b->undo_cap) {
-        int new_cap = b->undo_cap ? b->undo_cap * 2 : 32;
-        char **np = realloc(b->undo, new_cap * sizeof(char*));
-        if (!np) { free(cur); return; }
-        b->undo = np;
-        b->undo_cap = new_cap;
-    }
-    b->undo[b->undo_len++] = cur;
-    char *snap = b->redo[--b->redo_len];
-    buffer_deserialize(b, snap);
-    free(snap);
-    b->dirty = 1;
-    /* After redo, raw_lines are stale; sync them from plain lines */
-    for (int i = 0; i < b->line_count; i++) {
-        free(b->raw_lines[i]);
-        b->raw_lines[i] = safe_strdup(b->lines[i]);
+    undo_transfer(st, &b->redo, &b->redo_len, &b->undo, &b->undo_len, &b->undo_cap);
+}
+
+/* Style the buffer with syntax-highlighted output from the external
+ * `highlight` binary, parsed into ANSI runs.  The process runs as a job in
+ * the buffer's group; the runs are attached on the UI thread
+ * (highlight_job_done) only if the job was not cancelled and the buffer is
+ * still open, unmodified and the line counts agree.  Lines[]
+ * (plain text) is never touched; a line whose highlighted text differs from
+ * it (e.g. tabs expanded) stays unstyled. */
+typedef struct {
+    unsigned buf_id;
+    char path[1024];
+    const char *lang;    /* highlight_lang() name or NULL */
+    int count;
+    char **text;         /* stripped text per output line */
+    AnsiRun **runs;
+    int *nruns;
+} HighlightJob;
+
+static void highlight_job_free(HighlightJob *job) {
+    for (int i = 0; i < job->count; i++) {
+        free(job->text[i]);
+        free(job->runs[i]);
+    }
+    free(job->text);
+    free(job->runs);
+    free(job->nruns);
+    free(job);
+}
+
+static void highlight_job_done(ViewerState *st, void *arg, int cancelled) {
+    HighlightJob *job = (HighlightJob*)arg;
+    Buffer *b = NULL;
+    for (int i = 0; !cancelled && i < st->buffer_count; i++) {
+        if (st->buffers[i].is_active && st->buffers[i].id == job->buf_id) {
+            b = &st->buffers[i];
+            break;
+        }
+    }
+
+    /* STRICT 1:1 line mapping required */
+    if (b && !b->dirty && job->count > 0 && job->count == b->line_count) {
+        int has_ansi = 0;
+        for (int i = 0; i < b->line_count; i++) {
+            AnsiRun *runs = job->runs[i];
+            int n = job->nruns[i];
+            if (strcmp(job->text[i], b->lines[i]) != 0) { free(runs); runs = NULL; n = 0; }
+            job->runs[i] = NULL;
+            free(b->meta[i].ansi);
+            b->meta[i].ansi = runs;
+            b->meta[i].ansi_count = n;
+            if (n) has_ansi = 1;
+            line_touch(b, i);
+        }
+        b->has_ansi = has_ansi;
     }
-    b->raw_has_ansi = 0;
+    highlight_job_free(job);
 }
 
-/* Replace raw_lines[] with syntax-highlighted output from the external
- * `highlight` binary.  Lines[] (plain text) is never touched here.
- * Returns 0 on success, -1 if highlight is unavailable or line counts
- * diverge (caller keeps plain raw_lines as fallback). */
-static int load_raw_via_highlight(Buffer *b, const char *filepath) {
-    if (!b) return -1;
-    if (!check_command_exists("highlight")) return -1;
-    if (!filepath || !filepath[0]) return -1;
-    if (strcmp(filepath, "<stdin>") == 0) return -1;
+static void highlight_job_run(void *arg) {
+    HighlightJob *job = (HighlightJob*)arg;
 
     char qpath[4096];
-    shell_quote_single(qpath, sizeof(qpath), filepath);
+    shell_quote_single(qpath, sizeof(qpath), job->path);
 
+    /* A missing binary just yields no output and a failed status */
     char cmd[8192];
-    const char *lang = (b->lang != LANG_NONE) ? highlight_lang(b->lang) : NULL;
-
-    if (lang && *lang) {
+    if (job->lang && *job->lang) {
         snprintf(cmd, sizeof(cmd),
                  "highlight --force-color --lang %s --path %s < %s 2>/dev/null",
-                 lang, qpath, qpath);
+                 job->lang, qpath, qpath);
     } else {
         snprintf(cmd, sizeof(cmd),
                  "highlight --force-color --path %s < %s 2>/dev/null",
@@ -1668,83 +3557,193 @@ static int load_raw_via_highlight(Buffer *b, const char *filepath) {
     }
 
     FILE *p = popen(cmd, "r");
-    if (!p) return -1;
-
-    int cap = (b->line_count > 0 ? b->line_count : 1) + 8;
-    char **tmp = (char**)calloc((size_t)cap, sizeof(char*));
-    if (!tmp) {
-        pclose(p);
-        return -1;
-    }
+    int cap = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
 
-    int count = 0;
-    int has_ansi = 0;
-    char line[MAX_LINE_LEN];
-
-    while (fgets(line, sizeof(line), p)) {
+    while (p && !job_cancelled() && getline(&line, &line_cap, p) != -1) {
         size_t len = strlen(line);
         while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
             line[--len] = '\0';
         }
 
-        if (count >= cap) {
-            int new_cap = cap * 2;
-            char **nt = (char**)realloc(tmp, (size_t)new_cap * sizeof(char*));
-            if (!nt) {
-                for (int i = 0; i < count; i++) free(tmp[i]);
-                free(tmp);
-                pclose(p);
-                return -1;
-            }
-            memset(nt + cap, 0, (size_t)(new_cap - cap) * sizeof(char*));
-            tmp = nt;
+        if (job->count >= cap) {
+            int new_cap = cap ? cap * 2 : 256;
+            char **nt = (char**)realloc(job->text, (size_t)new_cap * sizeof(char*));
+            if (nt) job->text = nt;
+            AnsiRun **nr = (AnsiRun**)realloc(job->runs, (size_t)new_cap * sizeof(AnsiRun*));
+            if (nr) job->runs = nr;
+            int *nn = (int*)realloc(job->nruns, (size_t)new_cap * sizeof(int));
+            if (nn) job->nruns = nn;
+            if (!nt || !nr || !nn) break;  /* short count: discarded on delivery */
             cap = new_cap;
         }
 
-        tmp[count] = safe_strdup(line);
-        if (!has_ansi && line_has_ansi_esc(tmp[count])) has_ansi = 1;
-        count++;
+        char *text = safe_strdup(line);
+        AnsiRun *runs = NULL;
+        int n = ansi_parse_line(text, &runs);
+        rtrim(text);
+        job->text[job->count] = text;
+        job->runs[job->count] = runs;
+        job->nruns[job->count] = n;
+        job->count++;
     }
 
-    int rc = pclose(p);
+    free(line);
+    if (p) pclose(p);
+}
 
-    if (count == 0 && rc != 0) {
-        free(tmp);
-        return -1;
-    }
+static void load_ansi_via_highlight(Buffer *b, const char *filepath) {
+    if (!b) return;
+    if (!filepath || !filepath[0]) return;
+    if (strcmp(filepath, "<stdin>") == 0) return;
 
-    /* STRICT 1:1 line mapping required */
-    if (count != b->line_count) {
-        for (int i = 0; i < count; i++) free(tmp[i]);
-        free(tmp);
-        return -1;
-    }
+    HighlightJob *job = (HighlightJob*)calloc(1, sizeof(*job));
+    if (!job) return;
+    job->buf_id = b->id;
+    snprintf(job->path, sizeof(job->path), "%s", filepath);
+    job->lang = (b->lang != LANG_NONE) ? highlight_lang(b->lang) : NULL;
 
-    if (!buf_ensure_raw_capacity(b, b->line_count)) {
-        for (int i = 0; i < count; i++) free(tmp[i]);
-        free(tmp);
-        return -1;
-    }
+    /* Supersedes any pass still pending for this buffer */
+    job_cancel(0, b->id);
+    if (!job_submit(b->id, highlight_job_run, highlight_job_done, job)) highlight_job_free(job);
+}
+// -----------------------------
+// Line loading
+// Files and stdin are read in large blocks and split in place; each line
+// is cleaned (overstrikes, escapes, trailing blanks) straight into its
+// own allocation.  A line without ESC or BS - nearly all of them - costs
+// a newline search, a scan and one copy.
+// -----------------------------
+#define LOAD_CHUNK (256 * 1024)
 
-    for (int i = 0; i < b->line_count; i++) {
-        free(b->raw_lines[i]);
-        b->raw_lines[i] = tmp[i];
-        tmp[i] = NULL;
+typedef struct {
+    int    fd;
+    char  *buf;
+    size_t cap, start, end;
+    int    eof;
+    int    err;               /* read error or OOM: the input was cut short */
+} LineReader;
+
+static int line_reader_init(LineReader *r, int fd) {
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->cap = LOAD_CHUNK;
+    r->buf = (char*)malloc(r->cap);
+    return r->buf != NULL;
+}
+
+static void line_reader_free(LineReader *r) {
+    free(r->buf);
+    r->buf = NULL;
+}
+
+/* Next line, without its '\n', as a span of the reader's block (valid
+ * until the next call).  Returns 0 at end of input, or with r->err set when
+ * a read fails or a line outgrows memory; a final line with no newline is
+ * still returned, an empty tail is not. */
+static int line_reader_next(LineReader *r, const char **out, size_t *out_len) {
+    size_t scanned = 0;
+    for (;;) {
+        char *nl = (char*)memchr(r->buf + r->start + scanned, '\n', r->end - r->start - scanned);
+        if (nl) {
+            *out = r->buf + r->start;
+            *out_len = (size_t)(nl - *out);
+            r->start += *out_len + 1;
+            return 1;
+        }
+        scanned = r->end - r->start;
+        if (r->eof) {
+            if (scanned == 0) return 0;
+            *out = r->buf + r->start;
+            *out_len = scanned;
+            r->start = r->end;
+            return 1;
+        }
+        /* keep the partial line, growing the block if it fills it */
+        if (r->start > 0) {
+            memmove(r->buf, r->buf + r->start, scanned);
+            r->start = 0;
+            r->end = scanned;
+        }
+        if (r->end == r->cap) {
+            char *nb = (char*)realloc(r->buf, r->cap * 2);
+            if (!nb) { r->err = 1; return 0; }
+            r->buf = nb;
+            r->cap *= 2;
+        }
+        ssize_t got = read(r->fd, r->buf + r->end, r->cap - r->end);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) { r->err = 1; return 0; }
+        if (got == 0) r->eof = 1;
+        else r->end += (size_t)got;
+    }
+}
+
+/* Append the raw line p[0..n) to b.  Overstrikes and trailing blanks go;
+ * escape sequences are parsed into ANSI runs when parse_ansi is set and
+ * dropped otherwise.  Versions are left to load_finish(). */
+static int load_line(Buffer *b, const char *p, size_t n, int parse_ansi) {
+    if (!buf_ensure_capacity(b, b->line_count + 1)) return 0;
+    n = strnlen(p, n);  /* the line ends at a NUL, as a C string would */
+
+    char *line;
+    if (scan_until(p, n, SCAN_ESC | SCAN_BS) == n) {
+        while (n > 0 && (p[n-1] == ' ' || p[n-1] == '\t')) n--;
+        line = (char*)malloc(n + 1);
+        if (!line) return 0;
+        memcpy(line, p, n);
+        line[n] = '\0';
+    } else {
+        line = (char*)malloc(n + 1);
+        if (!line) return 0;
+        memcpy(line, p, n);
+        line[n] = '\0';
+        strip_overstrikes(line);
+        rtrim(line);
+        if (parse_ansi) {
+            if (line_has_ansi_esc(line)) {
+                LineMeta *m = &b->meta[b->line_count];
+                m->ansi_count = ansi_parse_line(line, &m->ansi);
+                b->has_ansi = 1;
+            }
+        } else {
+            strip_ansi(line);
+        }
+        rtrim(line);
     }
 
-    free(tmp);
-    b->raw_has_ansi = has_ansi ? 1 : 0;
-    return 0;
+    b->lines[b->line_count] = line;
+    b->line_count++;
+    return 1;
 }
-static int load_file(Buffer *b, const char *filepath) {
-    if (!file_exists(filepath)) {
-        buffer_init_blank(b, filepath);
-        b->dirty = 1;
-        return 0;
+
+/* Undo a load that failed part way.  Like the loaders, touches no shared
+ * state: none of the lines has been published yet. */
+static void load_discard(Buffer *b) {
+    for (int i = 0; i < b->line_count; i++) {
+        free(b->lines[i]);
+        line_meta_free(&b->meta[i]);
     }
+    free(b->lines);
+    free(b->meta);
+    memset(b, 0, sizeof(*b));
+}
 
-    FILE *f = fopen(filepath, "r");
-    if (!f) return -1;
+/* Read an existing file into b.  Touches no shared state (ids, line
+ * versions, jobs), so it may run on a worker; load_finish() then makes
+ * the buffer live on the UI thread. */
+static int load_file_lines(Buffer *b, const char *filepath) {
+    LineReader r;
+    int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (!line_reader_init(&r, fd)) {
+        close(fd);
+        return -1;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
 
     memset(b, 0, sizeof(*b));
     b->is_active = 1;
@@ -1752,97 +3751,253 @@ static int load_file(Buffer *b, const char *filepath) {
 
     b->line_cap = INITIAL_LINE_CAP;
     b->lines = (char**)calloc((size_t)b->line_cap, sizeof(char*));
-
-    b->raw_cap = INITIAL_LINE_CAP;
-    b->raw_lines = (char**)calloc((size_t)b->raw_cap, sizeof(char*));
-    b->raw_has_ansi = 0;
+    b->meta = (LineMeta*)calloc((size_t)b->line_cap, sizeof(LineMeta));
+    int ok = b->lines && b->meta;
 
     snprintf(b->filepath, sizeof(b->filepath), "%s", filepath);
     b->lang = detect_language(filepath);
     b->dirty = 0;
 
-    char line[MAX_LINE_LEN];
-    while (fgets(line, sizeof(line), f)) {
-        if (!buf_ensure_capacity(b, b->line_count + 1)) break;
-        if (!buf_ensure_raw_capacity(b, b->line_count + 1)) break;
-
-        line[strcspn(line, "\n")] = 0;
-        strip_overstrikes(line);
-        rtrim(line);
-
-        /* plain for editing/search */
-        char *plain = safe_strdup(line);
-        strip_ansi(plain);
-        rtrim(plain);
-
-        /* raw starts as plain; may be replaced by highlight below */
-        b->raw_lines[b->line_count] = safe_strdup(plain);
-        b->lines[b->line_count] = plain;
-        b->line_count++;
+    /* plain text for editing/search; styling comes from the highlighter */
+    const char *p;
+    size_t n;
+    while (ok && line_reader_next(&r, &p, &n)) {
+        if (!load_line(b, p, n, 0)) ok = 0;
+        if ((b->line_count & 0xFFFF) == 0 && job_cancelled()) ok = 0;
     }
-    fclose(f);
+    if (r.err) ok = 0;
+    line_reader_free(&r);
+    close(fd);
 
+    /* a short buffer would write back a truncated file */
+    if (!ok) {
+        load_discard(b);
+        return -1;
+    }
     if (b->line_count == 0) {
         b->line_count = 1;
         b->lines[0] = safe_strdup("");
-        b->raw_lines[0] = safe_strdup("");
     }
+    return 0;
+}
+
+/* UI thread: give a freshly read buffer its id and line versions, and
+ * start the external highlighter for it. */
+static void load_finish(Buffer *b) {
+    b->id = g_next_buf_id++;
+    for (int i = 0; i < b->line_count; i++) line_touch(b, i);
 
-    /* Try to replace raw_lines with externally highlighted version */
+    /* Style with the external highlighter when available; on failure the
+     * built-in highlighting is used */
     if (b->lang != LANG_NONE) {
-        load_raw_via_highlight(b, filepath);
-        /* On failure, raw_lines already holds plain copies — safe to continue */
+        load_ansi_via_highlight(b, b->filepath);
     }
 
     b->undo_len = 0;
     b->redo_len = 0;
+}
+
+static int load_file(Buffer *b, const char *filepath) {
+    if (!file_exists(filepath)) {
+        buffer_init_blank(b, filepath);
+        b->dirty = 1;
+        return 0;
+    }
+    if (load_file_lines(b, filepath) != 0) return -1;
+    load_finish(b);
     return 0;
 }
 
+/* Returns -1 when stdin is empty, -2 when it could not be read whole. */
 static int load_stdin(Buffer *b) {
     memset(b, 0, sizeof(*b));
     b->is_active = 1;
 
     b->line_cap = INITIAL_LINE_CAP;
     b->lines = (char**)calloc((size_t)b->line_cap, sizeof(char*));
-
-    b->raw_cap = INITIAL_LINE_CAP;
-    b->raw_lines = (char**)calloc((size_t)b->raw_cap, sizeof(char*));
-    b->raw_has_ansi = 0;
+    b->meta = (LineMeta*)calloc((size_t)b->line_cap, sizeof(LineMeta));
 
     snprintf(b->filepath, sizeof(b->filepath), "%s", "<stdin>");
     b->lang = LANG_NONE;
     b->scroll_offset = 0;
     b->dirty = 0;
 
-    char line[MAX_LINE_LEN];
-    while (fgets(line, sizeof(line), stdin)) {
-        if (!buf_ensure_capacity(b, b->line_count + 1)) break;
-        if (!buf_ensure_raw_capacity(b, b->line_count + 1)) break;
+    /* piped output keeps its colours */
+    LineReader r;
+    if (!b->lines || !b->meta || !line_reader_init(&r, STDIN_FILENO)) {
+        load_discard(b);
+        return -2;
+    }
+    int ok = 1;
+    const char *p;
+    size_t n;
+    while (ok && line_reader_next(&r, &p, &n)) {
+        while (n > 0 && p[n-1] == '\r') n--;
+        if (!load_line(b, p, n, 1)) ok = 0;
+    }
+    if (r.err) ok = 0;
+    line_reader_free(&r);
 
-        size_t len = strlen(line);
-        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) line[--len] = '\0';
+    if (!ok) {
+        load_discard(b);
+        return -2;
+    }
+    if (b->line_count == 0) {
+        load_discard(b);
+        return -1;
+    }
 
-        strip_overstrikes(line);
-        rtrim(line);
+    load_finish(b);
+    return 0;
+}
+
+// -----------------------------
+// Startup loading
+// The files named on the command line are read on workers, each into its
+// own slot, and installed on the UI thread in argv order: main waits only
+// until the first buffer is ready, the rest arrive through done callbacks
+// while it is already on screen.  stdin ("-") and files that do not exist
+// yet are loaded in place, since neither costs a read.
+// -----------------------------
+enum { LOAD_PENDING, LOAD_READY, LOAD_DONE, LOAD_FAILED, LOAD_CANCELLED };
 
-        char *raw = safe_strdup(line);
-        if (line_has_ansi_esc(raw)) b->raw_has_ansi = 1;
+typedef struct LoadBatch LoadBatch;
 
-        char *plain = safe_strdup(raw);
-        strip_ansi(plain);
-        rtrim(plain);
+typedef struct {
+    LoadBatch *batch;
+    char   path[1024];
+    int    state;         /* LOAD_*; READY still needs load_finish() */
+    Buffer buf;
+} LoadSlot;
+
+struct LoadBatch {
+    pthread_mutex_t mu;   /* guards state, next */
+    pthread_cond_t  cv;   /* a slot left LOAD_PENDING */
+    int n;
+    int next;             /* first slot not yet installed */
+    int refs;             /* done callbacks still to run */
+    LoadSlot slots[MAX_BUFFERS];
+};
+
+static LoadBatch *load_batch_new(void) {
+    LoadBatch *lb = (LoadBatch*)calloc(1, sizeof(*lb));
+    if (!lb) return NULL;
+    pthread_mutex_init(&lb->mu, NULL);
+    pthread_cond_init(&lb->cv, NULL);
+    return lb;
+}
+
+static void load_batch_free(LoadBatch *lb) {
+    pthread_mutex_destroy(&lb->mu);
+    pthread_cond_destroy(&lb->cv);
+    free(lb);
+}
+
+static void load_slot_set(LoadSlot *s, int state) {
+    pthread_mutex_lock(&s->batch->mu);
+    if (s->state == LOAD_PENDING) s->state = state;
+    pthread_cond_broadcast(&s->batch->cv);
+    pthread_mutex_unlock(&s->batch->mu);
+}
+
+static void load_slot_run(void *arg) {
+    LoadSlot *s = (LoadSlot*)arg;
+    load_slot_set(s, load_file_lines(&s->buf, s->path) == 0 ? LOAD_READY : LOAD_FAILED);
+}
+
+/* Move the finished slots at the front of the batch into st->buffers. */
+static void load_batch_install(ViewerState *st, LoadBatch *lb) {
+    for (;;) {
+        pthread_mutex_lock(&lb->mu);
+        LoadSlot *s = NULL;
+        if (lb->next < lb->n && lb->slots[lb->next].state != LOAD_PENDING)
+            s = &lb->slots[lb->next++];
+        pthread_mutex_unlock(&lb->mu);
+        if (!s) return;
+
+        if (s->state == LOAD_CANCELLED) continue;
+        if (s->state == LOAD_FAILED) {
+            char msg[1100];
+            snprintf(msg, sizeof(msg), "Failed to load %s", s->path);
+            if (stdscr) set_status(st, msg);
+            else fprintf(stderr, "%s\n", msg);
+            continue;
+        }
+        if (st->buffer_count >= MAX_BUFFERS) {
+            free_buffer(&s->buf);
+            set_status(st, "Max buffers reached");
+            continue;
+        }
+        if (s->state == LOAD_READY) load_finish(&s->buf);
+        st->buffers[st->buffer_count++] = s->buf;
+    }
+}
 
-        b->raw_lines[b->line_count] = raw;
-        b->lines[b->line_count] = plain;
-        b->line_count++;
+static void load_slot_done(ViewerState *st, void *arg, int cancelled) {
+    LoadSlot *s = (LoadSlot*)arg;
+    LoadBatch *lb = s->batch;
+    if (cancelled) {
+        /* the pool is shutting down: drop the slot, and what it read */
+        pthread_mutex_lock(&lb->mu);
+        if (s - lb->slots >= lb->next) {
+            if (s->state == LOAD_READY) load_discard(&s->buf);
+            s->state = LOAD_CANCELLED;
+        }
+        pthread_cond_broadcast(&lb->cv);
+        pthread_mutex_unlock(&lb->mu);
     }
+    load_batch_install(st, lb);
+    if (--lb->refs == 0) load_batch_free(lb);
+}
 
-    if (b->line_count == 0) return -1;
+/* Add path to the batch (or, with `now`, the already loaded *now). */
+static void load_batch_add(LoadBatch *lb, const char *path, const Buffer *now) {
+    LoadSlot *s = &lb->slots[lb->n++];
+    s->batch = lb;
+    snprintf(s->path, sizeof(s->path), "%s", path);
+    s->state = now ? LOAD_DONE : LOAD_PENDING;
+    if (now) s->buf = *now;
+}
 
-    b->undo_len = 0;
-    b->redo_len = 0;
-    return 0;
+/* Add a command-line path: one that does not exist yet opens as a blank
+ * buffer for the new file, the rest are left to load_batch_start(). */
+static void load_batch_add_path(LoadBatch *lb, const char *path) {
+    if (file_exists(path)) {
+        load_batch_add(lb, path, NULL);
+        return;
+    }
+    Buffer tmp;
+    load_file(&tmp, path);
+    load_batch_add(lb, path, &tmp);
+}
+
+/* Queue the pending slots.  Workers run their own newest job first, so
+ * they go in back to front and the first file is read first. */
+static void load_batch_start(LoadBatch *lb) {
+    for (int i = lb->n - 1; i >= 0; i--) {
+        LoadSlot *s = &lb->slots[i];
+        if (s->state != LOAD_PENDING) continue;
+        if (job_submit(0, load_slot_run, load_slot_done, s)) lb->refs++;
+        else load_slot_run(s);
+    }
+}
+
+/* Install buffers until one is open or every slot has been tried.  The
+ * batch frees itself with its last done callback; returns 1 when it has
+ * none and the caller must free it. */
+static int load_batch_wait_first(ViewerState *st, LoadBatch *lb) {
+    for (;;) {
+        load_batch_install(st, lb);
+        pthread_mutex_lock(&lb->mu);
+        int more = lb->next < lb->n;
+        if (st->buffer_count == 0 && more) {
+            while (lb->slots[lb->next].state == LOAD_PENDING)
+                pthread_cond_wait(&lb->cv, &lb->mu);
+        }
+        pthread_mutex_unlock(&lb->mu);
+        if (st->buffer_count > 0 || !more) break;
+    }
+    return lb->refs == 0;
 }
 
 static char *buffer_serialize(const Buffer *b) {
@@ -1864,51 +4019,27 @@ static char *buffer_serialize(const Buffer *b) {
 
 static void buffer_deserialize(Buffer *b, const char *text) {
     if (!b) return;
-    for (int i = 0; i < b->line_count; i++) { free(b->lines[i]); b->lines[i] = NULL; }
-    b->line_count = 0;
-
-    if (!text) {
-        if (!buf_ensure_capacity(b, 1)) return;
-        b->line_count = 1;
-        b->lines[0] = safe_strdup("");
-        return;
-    }
+    buf_remove_lines(b, 0, b->line_count);
 
-    const char *p = text;
-    while (*p) {
+    /* Exact inverse of buffer_serialize: N-1 separators give N lines, so a
+     * trailing empty line survives the round trip. */
+    const char *p = text ? text : "";
+    for (;;) {
         const char *nl = strchr(p, '\n');
         size_t len = nl ? (size_t)(nl - p) : strlen(p);
-        if (!buf_ensure_capacity(b, b->line_count + 1)) break;
+        if (!buf_insert_slots(b, b->line_count, 1)) break;
         char *line = (char*)malloc(len + 1);
+        if (!line) { b->line_count--; break; }
         memcpy(line, p, len);
         line[len] = '\0';
-        b->lines[b->line_count++] = line;
+        /* restored lines are unstyled — highlight output is not undoable */
+        buf_set_line(b, b->line_count - 1, line);
         if (!nl) break;
         p = nl + 1;
     }
 
-    if (b->line_count == 0) {
-        if (buf_ensure_capacity(b, 1)) {
-            b->line_count = 1;
-            b->lines[0] = safe_strdup("");
-        }
-    }
-
-    /* Sync raw_lines to match new line_count — plain copies for now */
-    if (b->raw_lines) {
-        /* free old raw entries beyond new line_count */
-        /* We don't track the old raw count separately; just rebuild from
-         * lines[] which is now set by this function. */
-    }
-    /* Ensure raw capacity matches */
-    if (buf_ensure_raw_capacity(b, b->line_count)) {
-        /* Free and rebuild */
-        for (int i = 0; i < b->line_count; i++) {
-            free(b->raw_lines[i]);
-            b->raw_lines[i] = safe_strdup(b->lines[i]);
-        }
-    }
-    b->raw_has_ansi = 0;
+    buf_ensure_nonempty(b);
+    buffer_drop_ansi(b);
 }
 
 static void clipboard_copy_text(const char *text) {
@@ -1955,6 +4086,35 @@ static void clear_search(ViewerState *st) {
     st->search_term[0] = '\0';
     st->search_match_count = 0;
     st->current_match = 0;
+    st->search_gen++;
+}
+
+/* Non-overlapping search hits in line i, recomputed only when the line's
+ * version or the search generation moved since the last call. */
+static const LineMeta *line_matches(ViewerState *st, Buffer *b, int i) {
+    LineMeta *m = &b->meta[i];
+    if (m->match_version == m->version && m->match_gen == st->search_gen) return m;
+
+    m->match_count = 0;
+    m->match_version = m->version;
+    m->match_gen = st->search_gen;
+    if (!st->search_highlight || !st->search_term[0]) return m;
+
+    const char *line = b->lines[i];
+    size_t tlen = strlen(st->search_term);
+    for (const char *hit = strstr(line, st->search_term); hit; hit = strstr(hit + tlen, st->search_term)) {
+        if (m->match_count >= m->match_cap) {
+            int nc = m->match_cap ? m->match_cap * 2 : 4;
+            MatchSpan *ns = (MatchSpan*)realloc(m->matches, (size_t)nc * sizeof(MatchSpan));
+            if (!ns) break;
+            m->matches = ns;
+            m->match_cap = nc;
+        }
+        m->matches[m->match_count].start = (int)(hit - line);
+        m->matches[m->match_count].len = (int)tlen;
+        m->match_count++;
+    }
+    return m;
 }
 
 static void find_all_matches(ViewerState *st) {
@@ -2042,73 +4202,342 @@ static int text_width_for(ViewerState *st) {
     if (w < 1) w = 1;
     return w;
 }
-static int visual_width_line(const char *line) {
-    if (!line || !*line) return 0;
+/* Cells before byte stop_byte of s; a stop inside a grapheme cluster
+ * counts up to the cluster's start. */
+static int visual_width_until(const char *s, int stop_byte) {
+    if (!s || stop_byte <= 0) return 0;
+    /* a cluster running past the stop must still be seen whole */
+    size_t len = strnlen(s, (size_t)stop_byte + GC_MAX_BYTES);
+    return cells_to_byte(s, len, 0, 0, stop_byte);
+}
 
-    int cells = 0;
-    for (int i = 0; line[i]; ) {
-        unsigned char c = (unsigned char)line[i];
+/* Total cells of line idx, cached in its LineMeta against the version. */
+static int line_cells(Buffer *b, int idx) {
+    LineMeta *m = &b->meta[idx];
+    if (m->cells_version != m->version || !m->version) {
+        m->cells = visual_width_until(b->lines[idx], INT_MAX);
+        m->cells_version = m->version;
+    }
+    return m->cells;
+}
+// -----------------------------
+// Wrap layout cache
+// Where each wrapped row of a line starts, as byte offsets into the line,
+// so drawing slices the line in place.  Keyed like the render cache by the
+// line's version stamp plus the wrap width; hits allocate nothing.
+// -----------------------------
+typedef struct {
+    int off;
+    int len;
+    int cells;
+} WrapSeg;
 
-        if (c == '\t') {
-            cells += 4 - (cells % 4);
-            i++;
-            continue;
+typedef struct {
+    unsigned version;   /* 0: empty */
+    int      width;
+    int      nsegs;
+    int      cap;
+    WrapSeg *segs;
+    unsigned used;
+} WrapEnt;
+
+#define WCACHE_SETS 256
+#define WCACHE_WAYS 4
+
+static WrapEnt  g_wcache[WCACHE_SETS][WCACHE_WAYS];
+static unsigned g_wcache_clock = 0;
+
+/* Split `line` into rows of at most `width` cells.  A tab advances to the
+ * next TAB_WIDTH stop of its row; neither a tab nor a grapheme cluster is
+ * ever split.  Fills up to `cap` segments and returns how many are needed
+ * (always at least one, so an empty line still takes a row). */
+static int wrap_measure(const char *line, int width, WrapSeg *segs, int cap) {
+    int n = 0;
+    int i = 0;
+    const size_t len = strlen(line);
+    do {
+        int start = i;
+        int cells = 0;
+        while (line[i]) {
+            int r = ascii_run(line + i, len - (size_t)i, width - cells);
+            if (r > 0) {
+                i += r;
+                cells += r;
+                continue;
+            }
+            int ni = i, nc = cells;
+            cell_step(line, &ni, &nc);
+            if (nc > width && i > start) break;
+            i = ni;
+            cells = nc;
         }
+        if (n < cap) segs[n] = (WrapSeg){ start, i - start, cells };
+        n++;
+    } while (line[i]);
+    return n;
+}
 
-        if (c < 0x80) {
-            cells++;
-            i++;
-            continue;
-        }
+/* Row count only.  Most lines are no wider than the window, which the
+ * cached cell count answers without measuring the line again. */
+static int wrap_count(Buffer *b, int idx, int width) {
+    if (line_cells(b, idx) <= width) return 1;
+    return wrap_measure(b->lines[idx], width, NULL, 0);
+}
 
-        if ((c & 0xE0) == 0xC0) i += 2;
-        else if ((c & 0xF0) == 0xE0) i += 3;
-        else if ((c & 0xF8) == 0xF0) i += 4;
-        else i++;
+/* Wrap layout of line idx at `width` (> 0).  NULL only when out of memory. */
+static const WrapEnt *wrap_layout(const Buffer *b, int idx, int width) {
+    unsigned version = b->meta[idx].version;
+    WrapEnt *set = g_wcache[(version * 2654435761u) >> 24 & (WCACHE_SETS - 1)];
 
-        cells++;
+    WrapEnt *victim = &set[0];
+    for (int w = 0; w < WCACHE_WAYS; w++) {
+        WrapEnt *e = &set[w];
+        if (e->version == version && e->width == width) {
+            e->used = ++g_wcache_clock;
+            return e;
+        }
+        if (e->used < victim->used) victim = e;
     }
 
-    return cells;
+    const char *line = b->lines[idx];
+    int n = wrap_measure(line, width, victim->segs, victim->cap);
+    if (n > victim->cap) {
+        WrapSeg *ns = (WrapSeg*)realloc(victim->segs, (size_t)n * sizeof(WrapSeg));
+        if (!ns) return NULL;
+        victim->segs = ns;
+        victim->cap = n;
+        wrap_measure(line, width, victim->segs, victim->cap);
+    }
+    victim->version = version;
+    victim->width = width;
+    victim->nsegs = n;
+    victim->used = ++g_wcache_clock;
+    return victim;
 }
-static int visual_width_until(const char *s, int stop_byte) {
-    if (!s || stop_byte <= 0) return 0;
 
-    int cells = 0;
-    int i = 0;
+// -----------------------------
+// Cell index
+// For lines longer than CELL_MARK_BYTES, the byte offset and cell column
+// of a character boundary every CELL_MARK_BYTES bytes, so no-wrap drawing
+// and the cursor find a column far into a long line by walking at most one
+// interval.  Keyed by the line's version stamp like the caches above.
+// -----------------------------
+#define CELL_MARK_BYTES 4096
+#define CCACHE_SETS 64
+#define CCACHE_WAYS 2
 
-    while (s[i] && i < stop_byte) {
-        unsigned char c = (unsigned char)s[i];
+typedef struct {
+    int off;
+    int cells;
+} CellMark;
 
-        if (c == '\t') {
-            cells += 4 - (cells % 4);
-            i++;
+typedef struct {
+    unsigned  version;   /* 0: empty */
+    int       len;       /* the line's length in bytes */
+    int       n;
+    int       cap;
+    CellMark *marks;     /* marks[0] is {0, 0} */
+    unsigned  used;
+} CellEnt;
+
+static CellEnt  g_ccache[CCACHE_SETS][CCACHE_WAYS];
+static unsigned g_ccache_clock = 0;
+
+/* Marks for line idx, or NULL when it is short (or out of memory) and is
+ * cheaper to walk from the start. */
+static const CellEnt *cell_index(const Buffer *b, int idx) {
+    unsigned version = b->meta[idx].version;
+    CellEnt *set = g_ccache[(version * 2654435761u) >> 26 & (CCACHE_SETS - 1)];
+
+    CellEnt *victim = &set[0];
+    for (int w = 0; w < CCACHE_WAYS; w++) {
+        CellEnt *e = &set[w];
+        if (e->version == version) {
+            e->used = ++g_ccache_clock;
+            return e;
+        }
+        if (e->used < victim->used) victim = e;
+    }
+
+    const char *line = b->lines[idx];
+    size_t len = strlen(line);
+    if (len < CELL_MARK_BYTES) return NULL;
+
+    int need = (int)(len / CELL_MARK_BYTES) + 1;
+    if (need > victim->cap) {
+        CellMark *nm = (CellMark*)realloc(victim->marks, (size_t)need * sizeof(CellMark));
+        if (!nm) return NULL;
+        victim->marks = nm;
+        victim->cap = need;
+    }
+    int n = 0, i = 0, cells = 0;
+    victim->marks[n++] = (CellMark){ 0, 0 };
+    while (line[i]) {
+        int r = ascii_run(line + i, len - (size_t)i,
+                          n < need ? n * CELL_MARK_BYTES - i : INT_MAX - 1);
+        if (r > 0) {
+            i += r;
+            cells += r;
+        } else {
+            cell_step(line, &i, &cells);
+        }
+        if (i >= n * CELL_MARK_BYTES && line[i] && n < need)
+            victim->marks[n++] = (CellMark){ i, cells };
+    }
+    victim->version = version;
+    victim->len = (int)len;
+    victim->n = n;
+    victim->used = ++g_ccache_clock;
+    return victim;
+}
+
+/* Cell column at which byte `col` of line idx starts (its grapheme
+ * cluster's column when col falls inside one). */
+static int line_cell_col(const Buffer *b, int idx, int col) {
+    const char *line = b->lines[idx];
+    const CellEnt *ci = cell_index(b, idx);
+    int i = 0, cells = 0;
+    if (ci) {
+        int lo = 0, hi = ci->n - 1;
+        while (lo < hi) {
+            int mid = (lo + hi + 1) / 2;
+            if (ci->marks[mid].off <= col) lo = mid; else hi = mid - 1;
+        }
+        i = ci->marks[lo].off;
+        cells = ci->marks[lo].cells;
+    }
+    size_t len = ci ? (size_t)ci->len : strlen(line);
+    return cells_to_byte(line, len, i, cells, col);
+}
+
+/* Byte offset of the character of line idx that covers cell column `cell`
+ * (the line's end if it is narrower), with that character's own starting
+ * column in *out_cell. */
+static int line_cell_seek(const Buffer *b, int idx, int cell, int *out_cell) {
+    const char *line = b->lines[idx];
+    const CellEnt *ci = cell_index(b, idx);
+    int i = 0, cells = 0;
+    if (ci) {
+        int lo = 0, hi = ci->n - 1;
+        while (lo < hi) {
+            int mid = (lo + hi + 1) / 2;
+            if (ci->marks[mid].cells <= cell) lo = mid; else hi = mid - 1;
+        }
+        i = ci->marks[lo].off;
+        cells = ci->marks[lo].cells;
+    }
+    size_t len = ci ? (size_t)ci->len : strlen(line);
+    while (line[i]) {
+        int r = ascii_run(line + i, len - (size_t)i, cell - cells);
+        if (r > 0) {
+            i += r;
+            cells += r;
             continue;
         }
+        int ni = i, nc = cells;
+        cell_step(line, &ni, &nc);
+        if (nc > cell) break;
+        i = ni;
+        cells = nc;
+    }
+    *out_cell = cells;
+    return i;
+}
 
-        if (c < 0x80) {
-            cells++;
-            i++;
-            continue;
+// -----------------------------
+// Row index
+// meta[i].rows holds line i's wrapped row count at b->row_width, and
+// row_tree is a Fenwick tree over those counts, so line<->row mapping is
+// O(log n).  Edits through buf_set_line update it in place; inserting or
+// removing lines marks it stale and the next query rebuilds it in O(n).
+// -----------------------------
+static void row_tree_add(Buffer *b, int i, int delta) {
+    for (int k = i + 1; k <= b->line_count; k += k & -k) b->row_tree[k] += delta;
+}
+
+static void rows_line_changed(Buffer *b, int i) {
+    if (b->row_width <= 0) return;
+    int r = wrap_count(b, i, b->row_width);
+    if (b->row_tree_valid) row_tree_add(b, i, r - b->meta[i].rows);
+    b->meta[i].rows = r;
+}
+
+/* Bring meta[].rows and row_tree up to date for `width`. */
+static int rows_index_ensure(Buffer *b, int width) {
+    if (b->row_width != width) {
+        for (int i = 0; i < b->line_count; i++)
+            b->meta[i].rows = wrap_count(b, i, width);
+        b->row_width = width;
+        b->row_tree_valid = 0;
+    }
+    if (!b->row_tree_valid) {
+        int n = b->line_count;
+        int *t = (int*)realloc(b->row_tree, (size_t)(n + 1) * sizeof(int));
+        if (!t) return -1;
+        t[0] = 0;
+        for (int k = 1; k <= n; k++) t[k] = b->meta[k - 1].rows;
+        for (int k = 1; k <= n; k++) {
+            int parent = k + (k & -k);
+            if (parent <= n) t[parent] += t[k];
         }
+        b->row_tree = t;
+        b->row_tree_valid = 1;
+    }
+    return 0;
+}
 
-        if ((c & 0xE0) == 0xC0) i += 2;
-        else if ((c & 0xF0) == 0xE0) i += 3;
-        else if ((c & 0xF8) == 0xF0) i += 4;
-        else i++;
+static int wrapped_rows_for_line(ViewerState *st, int idx) {
+    if (!st->wrap_enabled) return 1;
+    const WrapEnt *wl = wrap_layout(&st->buffers[st->current_buffer], idx, text_width_for(st));
+    return wl ? wl->nsegs : 1;
+}
 
-        cells++;
+/* Screen rows taken by lines [0, n) of the current buffer. */
+static int rows_before(ViewerState *st, int n) {
+    Buffer *b = &st->buffers[st->current_buffer];
+    if (n > b->line_count) n = b->line_count;
+    if (!st->wrap_enabled) return n;
+    if (rows_index_ensure(b, text_width_for(st)) != 0) {
+        int rows = 0;
+        for (int i = 0; i < n; i++) rows += wrapped_rows_for_line(st, i);
+        return rows;
     }
+    int rows = 0;
+    for (int k = n; k > 0; k -= k & -k) rows += b->row_tree[k];
+    return rows;
+}
 
-    return cells;
+/* The line of the current buffer that contains screen row `row`. */
+static int line_at_row(ViewerState *st, int row) {
+    Buffer *b = &st->buffers[st->current_buffer];
+    int n = b->line_count;
+    if (row < 0) return 0;
+    if (!st->wrap_enabled || rows_index_ensure(b, text_width_for(st)) != 0)
+        return row < n ? row : n - 1;
+
+    int pos = 0;
+    int step = 1;
+    while (step * 2 <= n) step *= 2;
+    for (; step > 0; step /= 2) {
+        if (pos + step <= n && b->row_tree[pos + step] <= row) {
+            pos += step;
+            row -= b->row_tree[pos];
+        }
+    }
+    return pos < n ? pos : n - 1;
 }
-static int wrapped_rows_for_line(ViewerState *st, const char *line) {
-    if (!st->wrap_enabled) return 1;
-    int w = text_width_for(st);
-    int cells = visual_width_line(line);
-    int rows = (cells <= 0) ? 1 : ((cells + w - 1) / w);
-    if (rows < 1) rows = 1;
-    return rows;
+
+/* Which wrapped row of line idx holds byte `col`, and its cell column there. */
+static void wrap_locate(ViewerState *st, int idx, int col, int *out_seg, int *out_cell) {
+    const char *line = st->buffers[st->current_buffer].lines[idx];
+    const WrapEnt *wl = wrap_layout(&st->buffers[st->current_buffer], idx, text_width_for(st));
+    int seg = 0;
+    if (wl) {
+        while (seg + 1 < wl->nsegs && wl->segs[seg + 1].off <= col) seg++;
+    }
+    int off = wl ? wl->segs[seg].off : 0;
+    *out_seg = seg;
+    *out_cell = visual_width_until(line + off, col - off);
 }
 static void ensure_cursor_visible(ViewerState *st) {
     Buffer *b = &st->buffers[st->current_buffer];
@@ -2129,13 +4558,13 @@ static void ensure_cursor_visible(ViewerState *st) {
         return;
     }
 
-    int rows = 0;
-    for (int i = b->scroll_offset; i <= st->cursor_line && i < b->line_count; i++)
-        rows += wrapped_rows_for_line(st, b->lines[i]);
-
-    while (rows > h && b->scroll_offset < st->cursor_line) {
-        rows -= wrapped_rows_for_line(st, b->lines[b->scroll_offset]);
-        b->scroll_offset++;
+    /* Smallest scroll_offset that still shows the cursor line's last row. */
+    int end = rows_before(st, st->cursor_line + 1);
+    if (end - rows_before(st, b->scroll_offset) > h) {
+        int top = line_at_row(st, end - h);
+        if (rows_before(st, top) < end - h) top++;
+        if (top > st->cursor_line) top = st->cursor_line;
+        b->scroll_offset = top;
     }
 
     if (b->scroll_offset < 0) b->scroll_offset = 0;
@@ -2152,9 +4581,36 @@ static void scroll_viewport(ViewerState *st, int delta) {
     b->scroll_offset = new_scroll;
 }
 
+/* Ctrl-D / Ctrl-U: move the view and the cursor by half a screen of rows. */
+static void half_page(ViewerState *st, int dir) {
+    Buffer *b = &st->buffers[st->current_buffer];
+    int h = content_height();
+    int delta = h / 2 > 0 ? h / 2 : 1;
+    int total = rows_before(st, b->line_count);
+    int last = total > 0 ? total - 1 : 0;
+
+    int top_now = rows_before(st, b->scroll_offset);
+    int top = top_now + dir * delta;
+    if (dir > 0) {
+        int max_top = total - h > top_now ? total - h : top_now;
+        if (top > max_top) top = max_top;
+    }
+    if (top < 0) top = 0;
+
+    int cur = rows_before(st, st->cursor_line) + dir * delta;
+    if (cur > last) cur = last;
+    if (cur < 0) cur = 0;
+
+    b->scroll_offset = line_at_row(st, top);
+    st->cursor_line = line_at_row(st, cur);
+    ensure_cursor_bounds(st);
+}
+
 static void move_left(ViewerState *st) {
-    if (st->cursor_col > 0) st->cursor_col--;
-    else if (st->cursor_line > 0) {
+    if (st->cursor_col > 0) {
+        const char *line = st->buffers[st->current_buffer].lines[st->cursor_line];
+        st->cursor_col = gc_start(line, st->cursor_col - 1);
+    } else if (st->cursor_line > 0) {
         st->cursor_line--;
         Buffer *b = &st->buffers[st->current_buffer];
         st->cursor_col = (int)strlen(b->lines[st->cursor_line]);
@@ -2163,9 +4619,12 @@ static void move_left(ViewerState *st) {
 
 static void move_right(ViewerState *st) {
     Buffer *b = &st->buffers[st->current_buffer];
-    int ll = (int)strlen(b->lines[st->cursor_line]);
-    if (st->cursor_col < ll) st->cursor_col++;
-    else if (st->cursor_line < b->line_count - 1) {
+    const char *line = b->lines[st->cursor_line];
+    int ll = (int)strlen(line);
+    if (st->cursor_col < ll) {
+        int w;
+        st->cursor_col += line[st->cursor_col] == '\t' ? 1 : gc_len(line + st->cursor_col, &w);
+    } else if (st->cursor_line < b->line_count - 1) {
         st->cursor_line++;
         st->cursor_col = 0;
     }
@@ -2176,6 +4635,7 @@ static void move_up(ViewerState *st) {
     Buffer *b = &st->buffers[st->current_buffer];
     int ll = (int)strlen(b->lines[st->cursor_line]);
     if (st->cursor_col > ll) st->cursor_col = ll;
+    st->cursor_col = gc_start(b->lines[st->cursor_line], st->cursor_col);
 }
 
 static void move_down(ViewerState *st) {
@@ -2183,6 +4643,7 @@ static void move_down(ViewerState *st) {
     if (st->cursor_line < b->line_count - 1) st->cursor_line++;
     int ll = (int)strlen(b->lines[st->cursor_line]);
     if (st->cursor_col > ll) st->cursor_col = ll;
+    st->cursor_col = gc_start(b->lines[st->cursor_line], st->cursor_col);
 }
 
 static int is_open_br(char c) { return (c=='(' || c=='[' || c=='{'); }
@@ -2286,7 +4747,6 @@ static int jump_percent(ViewerState *st, int *out_to_line, int *out_to_col, int
 static void insert_char_at(Buffer *b, int line, int col, char c) {
     char *s = b->lines[line];
     int len = (int)strlen(s);
-    if(len>=MAX_LINE_LEN-1) return;
     if (col < 0) col = 0;
     if (col > len) col = len;
 
@@ -2296,16 +4756,10 @@ static void insert_char_at(Buffer *b, int line, int col, char c) {
     memcpy(ns + col + 1, s + col, (size_t)(len - col));
     ns[len + 1] = '\0';
 
-    free(b->lines[line]);
-    b->lines[line] = ns;
-
-    /* Keep raw_line in sync with plain text while editing.
-     * We don't re-highlight on every keystroke — raw becomes plain. */
-    free(b->raw_lines[line]);
-    b->raw_lines[line] = safe_strdup(ns);
-    b->raw_has_ansi = 0;
-
-    b->dirty = 1;
+    /* We don't re-highlight on every keystroke: editing drops the ANSI
+     * styling and the buffer falls back to built-in highlighting. */
+    buf_set_line(b, line, ns);
+    buffer_drop_ansi(b);
 }
 
 static void delete_char_before(Buffer *b, int *line_io, int *col_io) {
@@ -2319,12 +4773,8 @@ static void delete_char_before(Buffer *b, int *line_io, int *col_io) {
         char *ns = (char*)malloc((size_t)len+1);
         memcpy(ns, s, (size_t)(col));
         memcpy(ns + (col - 1), s + col, (size_t)(len - col + 1));
-        free(b->lines[line]);
-        b->lines[line] = ns;
-        free(b->raw_lines[line]);
-        b->raw_lines[line] = safe_strdup(ns);
+        buf_set_line(b, line, ns);
         *col_io = col - 1;
-        b->dirty = 1;
         return;
     }
 
@@ -2336,76 +4786,95 @@ static void delete_char_before(Buffer *b, int *line_io, int *col_io) {
     memcpy(joined, prev, (size_t)plen);
     memcpy(joined + plen, s, (size_t)len + 1);
 
-    free(b->lines[line - 1]);
-    b->lines[line - 1] = joined;
-    free(b->raw_lines[line - 1]);
-    b->raw_lines[line - 1] = safe_strdup(joined);
-
-    free(b->lines[line]);
-    free(b->raw_lines[line]);
-
-    for (int i = line; i < b->line_count - 1; i++) {
-        b->lines[i] = b->lines[i + 1];
-        b->raw_lines[i] = b->raw_lines[i + 1];
-    }
-    b->lines[b->line_count - 1] = NULL;
-    b->raw_lines[b->line_count - 1] = NULL;
-    b->line_count--;
+    buf_set_line(b, line - 1, joined);
+    buf_remove_lines(b, line, 1);
 
     *line_io = line - 1;
     *col_io = plen;
-    b->raw_has_ansi = 0;
-    b->dirty = 1;
+    buffer_drop_ansi(b);
 }
 
-static void insert_newline(Buffer *b, int *line_io, int *col_io) {
-    int line = *line_io;
-    int col = *col_io;
+/* Insert `len` bytes of `text` at (line, col) in one step: each '\n' ends
+ * a line, and the slots for all new lines are opened at once.  *end_line
+ * and *end_col receive the position just past the inserted text. */
+static void buf_splice_text(Buffer *b, int line, int col, const char *text, size_t len,
+                            int *end_line, int *end_col) {
+    *end_line = line;
+    *end_col = col;
     if (line < 0 || line >= b->line_count) return;
 
-    if (!buf_ensure_capacity(b, b->line_count + 1)) return;
-    if (!buf_ensure_raw_capacity(b, b->line_count + 1)) return;
+    int k = 0;
+    for (size_t i = 0; i < len; i++) if (text[i] == '\n') k++;
 
-    char *s = b->lines[line];
-    int len = (int)strlen(s);
+    const char *s = b->lines[line];
+    int slen = (int)strlen(s);
     if (col < 0) col = 0;
-    if (col > len) col = len;
-
-    char *left = (char*)malloc((size_t)col + 1);
-    memcpy(left, s, (size_t)col);
-    left[col] = '\0';
+    if (col > slen) col = slen;
     char *right = safe_strdup(s + col);
+    int rlen = slen - col;
+
+    if (k > 0 && !buf_insert_slots(b, line + 1, k)) { free(right); return; }
 
-    free(b->lines[line]);
-    b->lines[line] = left;
-    free(b->raw_lines[line]);
-    b->raw_lines[line] = safe_strdup(left);
+    const char *p = text, *end = text + len;
+    for (int i = 0; i <= k; i++) {
+        const char *q = memchr(p, '\n', (size_t)(end - p));
+        if (!q) q = end;
+        int seg = (int)(q - p);
+        int pre = (i == 0) ? col : 0;
+        int post = (i == k) ? rlen : 0;
+
+        char *nl = (char*)malloc((size_t)(pre + seg + post) + 1);
+        if (!nl) break;
+        memcpy(nl, b->lines[line], (size_t)pre);
+        memcpy(nl + pre, p, (size_t)seg);
+        memcpy(nl + pre + seg, right, (size_t)post);
+        nl[pre + seg + post] = '\0';
+        buf_set_line(b, line + i, nl);
 
-    for (int i = b->line_count; i > line + 1; i--) {
-        b->lines[i] = b->lines[i - 1];
-        b->raw_lines[i] = b->raw_lines[i - 1];
+        *end_line = line + i;
+        *end_col = pre + seg;
+        p = q + 1;
     }
-    b->lines[line + 1] = right;
-    b->raw_lines[line + 1] = safe_strdup(right);
-    b->line_count++;
+    free(right);
+    buffer_drop_ansi(b);
+}
 
-    b->raw_has_ansi = 0;
-    *line_io = line + 1;
-    *col_io = 0;
-    b->dirty = 1;
+/* Collect a bracketed paste up to its end marker.  CR and CRLF become
+ * '\n'; other keypad codes are dropped.  Returns NULL on OOM. */
+static char *read_bracketed_paste(size_t *len_out) {
+    size_t cap = 4096, len = 0;
+    char *buf = (char*)malloc(cap);
+    if (!buf) return NULL;
+
+    int prev = 0;
+    for (;;) {
+        int ch = getch();
+        if (ch == ERR || ch == KEY_PASTE_END) break;
+        int raw = ch;
+        if (ch == '\n' && prev == '\r') { prev = raw; continue; }
+        prev = raw;
+        if (ch == '\r' || ch == KEY_ENTER) ch = '\n';
+        else if (ch <= 0 || ch > 255) continue;
+
+        if (len + 1 >= cap) {
+            char *nb = (char*)realloc(buf, cap * 2);
+            if (!nb) { free(buf); return NULL; }
+            buf = nb;
+            cap *= 2;
+        }
+        buf[len++] = (char)ch;
+    }
+    buf[len] = '\0';
+    *len_out = len;
+    return buf;
 }
 
 static void paste_text_at_cursor(ViewerState *st, const char *text) {
     if (!text || !*text) return;
     Buffer *b = &st->buffers[st->current_buffer];
-    undo_push(b);
-    for (const char *p = text; *p; p++) {
-        if (*p == '\n') insert_newline(b, &st->cursor_line, &st->cursor_col);
-        else {
-            insert_char_at(b, st->cursor_line, st->cursor_col, *p);
-            st->cursor_col++;
-        }
-    }
+    undo_push(b);
+    buf_splice_text(b, st->cursor_line, st->cursor_col, text, strlen(text),
+                    &st->cursor_line, &st->cursor_col);
 }
 
 static void yank_range_to_match(ViewerState *st, int aL, int aC, int bL, int bC) {
@@ -2520,10 +4989,7 @@ static void delete_range_to_match(ViewerState *st, int aL, int aC, int bL, int b
             if (!nl) { free(tmp); return; }
             memcpy(nl, line, (size_t)sC);
             memcpy(nl + sC, line + eC + 1, (size_t)(line_len - (eC + 1) + 1));
-            free(b->lines[sL]);
-            b->lines[sL] = nl;
-            free(b->raw_lines[sL]);
-            b->raw_lines[sL] = safe_strdup(nl);
+            buf_set_line(b, sL, nl);
         }
         st->cursor_line = sL;
         st->cursor_col = sC;
@@ -2548,26 +5014,9 @@ static void delete_range_to_match(ViewerState *st, int aL, int aC, int bL, int b
     memcpy(joined, prefix, (size_t)prefix_len);
     memcpy(joined + prefix_len, suffix, (size_t)suffix_len);
     joined[prefix_len + suffix_len] = '\0';
-    for (int L = sL; L <= eL; L++) {
-        free(b->lines[L]);
-        free(b->raw_lines[L]);
-    }
-    int dst = sL + 1;
-    int src = eL + 1;
-    while (src < b->line_count) {
-        b->lines[dst] = b->lines[src];
-        b->raw_lines[dst] = b->raw_lines[src];
-        dst++; src++;
-    }
-    b->lines[sL] = joined;
-    b->raw_lines[sL] = safe_strdup(joined);
-    int new_count = dst;
-    for (int i = new_count; i < b->line_count; i++) {
-        b->lines[i] = NULL;
-        b->raw_lines[i] = NULL;
-    }
-    b->line_count = new_count;
-    b->raw_has_ansi = 0;
+    buf_set_line(b, sL, joined);
+    buf_remove_lines(b, sL + 1, eL - sL);
+    buffer_drop_ansi(b);
     st->cursor_line = sL;
     st->cursor_col = sC;
     ensure_cursor_bounds(st);
@@ -2594,31 +5043,8 @@ static char *delete_visual_lines(ViewerState *st) {
 
     undo_push(b);
 
-    for (int i = lo; i <= hi; i++) {
-        free(b->lines[i]);
-        b->lines[i] = NULL;
-        free(b->raw_lines[i]);
-        b->raw_lines[i] = NULL;
-    }
-
-    int deleted = hi - lo + 1;
-    for (int i = lo; i < b->line_count - deleted; i++) {
-        b->lines[i] = b->lines[i + deleted];
-        b->raw_lines[i] = b->raw_lines[i + deleted];
-    }
-    for (int i = b->line_count - deleted; i < b->line_count; i++) {
-        b->lines[i] = NULL;
-        b->raw_lines[i] = NULL;
-    }
-    b->line_count -= deleted;
-
-    if (b->line_count == 0) {
-        b->line_count = 1;
-        b->lines[0] = safe_strdup("");
-        b->raw_lines[0] = safe_strdup("");
-    }
-
-    b->dirty = 1;
+    buf_remove_lines(b, lo, hi - lo + 1);
+    buf_ensure_nonempty(b);
 
     st->cursor_line = lo;
     st->cursor_col  = 0;
@@ -2641,15 +5067,9 @@ static void delete_all_lines(ViewerState *st) {
     char *snap = buffer_serialize(b);
     if (snap) { clipboard_copy_text(snap); free(snap); }
     undo_push(b);
-    for (int i = 0; i < b->line_count; i++) {
-        free(b->lines[i]);    b->lines[i] = NULL;
-        free(b->raw_lines[i]); b->raw_lines[i] = NULL;
-    }
-    b->line_count = 1;
-    b->lines[0] = safe_strdup("");
-    b->raw_lines[0] = safe_strdup("");
-    b->raw_has_ansi = 0;
-    b->dirty = 1;
+    buf_remove_lines(b, 0, b->line_count);
+    buf_ensure_nonempty(b);
+    buffer_drop_ansi(b);
     st->cursor_line = 0;
     st->cursor_col  = 0;
     set_status(st, "Deleted all lines");
@@ -3176,9 +5596,11 @@ static void cmd_list_buffers(ViewerState *st) {
 
     def_prog_mode();
     endwin();
+    term_bracketed_paste(0);
     int rc = system(cmd);
     reset_prog_mode();
-    refresh();
+    term_bracketed_paste(1);
+    screen_refresh();
 
     unlink(list_template);
     temp_forget_path(list_template);
@@ -3257,11 +5679,12 @@ static void cmd_write(ViewerState *st, const char *arg) {
         if (b->filepath[0] == '\0' || strcmp(b->filepath, "<stdin>") == 0 || b->filepath[0] == '[') {
             snprintf(b->filepath, sizeof(b->filepath), "%s", target);
             b->lang = detect_language(b->filepath);
+            lex_reset(b);
         }
         b->dirty = 0;
-        /* Re-highlight after write so raw_lines get fresh ANSI */
+        /* Re-highlight after write so the ANSI runs match the new text */
         if (b->lang != LANG_NONE) {
-            load_raw_via_highlight(b, b->filepath);
+            load_ansi_via_highlight(b, b->filepath);
         }
         set_status(st, "Wrote file");
     } else {
@@ -3322,7 +5745,8 @@ static void draw_status_bar(ViewerState *st) {
     attron(COLOR_PAIR(COLOR_STATUS) | A_BOLD);
 
     const char *name = basename_path(b->filepath);
-    int percent = b->line_count > 0 ? (b->scroll_offset * 100) / b->line_count : 0;
+    int total_rows = rows_before(st, b->line_count);
+    int percent = total_rows > 0 ? (int)((long)rows_before(st, b->scroll_offset) * 100 / total_rows) : 0;
 
     char left[768];
     snprintf(left, sizeof(left),
@@ -3363,7 +5787,7 @@ static void draw_status_bar(ViewerState *st) {
             if (start_x < min_x) start_x = min_x;
             mvprintw(max_y - 1, start_x, "%.*s", viewlen, view);
         }
-    } else if (st->status_ticks > 0 && st->status_msg[0]) {
+    } else if (st->status_live && st->status_msg[0]) {
         mvprintw(max_y - 1, max_x - (int)strlen(st->status_msg) - 2, "%s", st->status_msg);
     } else if (st->search_highlight && st->search_term[0] != '\0') {
         char right[256];
@@ -3374,177 +5798,342 @@ static void draw_status_bar(ViewerState *st) {
 
     attroff(COLOR_PAIR(COLOR_STATUS) | A_BOLD);
 }
-static char *ansi_slice_for_plain_range(const char *raw, int byte_start, int byte_len) {
-    if (!raw || byte_len <= 0) return NULL;
-
-    size_t out_cap = strlen(raw) + 64;
-    char *out = (char*)malloc(out_cap);
-    if (!out) return NULL;
-    size_t out_len = 0;
-    out[0] = '\0';
-
-    AnsiState st;
-    ansi_state_reset(&st);
-
-    int plain_byte = 0;
-    int in_range = 0;
-    int emitted_prefix = 0;
-    int remaining = byte_len;
-
-    for (int i = 0; raw[i]; ) {
-        unsigned char c = (unsigned char)raw[i];
-
-        if (c == 0x1B) {
-            if (raw[i + 1] == '[') {
-                int n = ansi_seq_len_csi(raw + i);
-                if (n <= 0) n = 1;
-
-                if (n > 2 && raw[i + n - 1] == 'm') {
-                    int params[16];
-                    int pn = 0;
-                    int val = 0;
-                    int have = 0;
-                    int j = i + 2;
-
-                    while (j < i + n - 1 && pn < 16) {
-                        if (isdigit((unsigned char)raw[j])) {
-                            val = val * 10 + (raw[j] - '0');
-                            have = 1;
-                            j++;
-                        } else if (raw[j] == ';') {
-                            params[pn++] = have ? val : 0;
-                            val = 0;
-                            have = 0;
-                            j++;
-                        } else {
-                            j++;
-                        }
-                    }
-                    if (pn < 16) params[pn++] = have ? val : 0;
-                    ansi_state_apply_params(&st, params, pn);
-                }
-
-                if (in_range) {
-                    if (out_len + (size_t)n + 1 > out_cap) {
-                        while (out_len + (size_t)n + 1 > out_cap) out_cap *= 2;
-                        char *nb = (char*)realloc(out, out_cap);
-                        if (!nb) { free(out); return NULL; }
-                        out = nb;
-                    }
-                    memcpy(out + out_len, raw + i, (size_t)n);
-                    out_len += (size_t)n;
-                    out[out_len] = '\0';
-                }
-
-                i += n;
-                continue;
-            }
-
-            if (raw[i + 1] == ']') {
-                int n = ansi_seq_len_osc(raw + i);
-                if (n <= 0) n = 1;
-
-                if (in_range) {
-                    if (out_len + (size_t)n + 1 > out_cap) {
-                        while (out_len + (size_t)n + 1 > out_cap) out_cap *= 2;
-                        char *nb = (char*)realloc(out, out_cap);
-                        if (!nb) { free(out); return NULL; }
-                        out = nb;
-                    }
-                    memcpy(out + out_len, raw + i, (size_t)n);
-                    out_len += (size_t)n;
-                    out[out_len] = '\0';
-                }
-
-                i += n;
-                continue;
-            }
+// -----------------------------
+// Render cache
+// Attributed cells (one chtype per plain byte) for recently drawn lines,
+// or for the window of one that is on screen when it is scrolled right.
+// Entries are keyed by the line's version stamp, which is unique across all
+// buffers, so the cache needs no invalidation on edits and costs nothing per
+// line.  RCACHE_WAYS-way set associative, least recently used way evicted.
+// -----------------------------
+#define RCACHE_SETS 256
+#define RCACHE_WAYS 4
+#define RCACHE_KEEP 4096   /* cells a reused entry may hold on to unneeded */
 
-            if (in_range) {
-                if (out_len + 2 > out_cap) {
-                    out_cap *= 2;
-                    char *nb = (char*)realloc(out, out_cap);
-                    if (!nb) { free(out); return NULL; }
-                    out = nb;
+typedef struct {
+    unsigned version;     /* 0: empty */
+    unsigned search_gen;
+    int      key;         /* language, lexer start state and ANSI flag */
+    unsigned pair_epoch;  /* g_ansi_pair_epoch for ANSI cells, else 0 */
+    int      from;        /* byte of the line in cells[0] */
+    int      complete;    /* cells run to the end of the line */
+    int      len;
+    int      cap;
+    chtype  *cells;
+    unsigned used;        /* LRU clock */
+} RenderEnt;
+
+static RenderEnt g_rcache[RCACHE_SETS][RCACHE_WAYS];
+static unsigned  g_rcache_clock = 0;
+
+/* Cells for line idx covering at least its bytes [from, from + need) (the
+ * rest of the line when need < 0); the entry may start before `from`.
+ * Returns NULL only when out of memory. */
+static const RenderEnt *render_line(Buffer *b, int idx, const MatchSpan *spans, int nspans,
+                                    unsigned search_gen, int from, int need) {
+    const char *line = b->lines[idx];
+    unsigned version = b->meta[idx].version;
+    int use_ansi = b->has_ansi;
+    int lex = use_ansi ? LEX_CODE : lex_state_at(b, idx);
+    int key = ((int)b->lang << 4) | (lex << 1) | use_ansi;
+    unsigned pair_epoch = use_ansi ? g_ansi_pair_epoch : 0;
+    RenderEnt *set = g_rcache[(version * 2654435761u) >> 24 & (RCACHE_SETS - 1)];
+
+    RenderEnt *victim = &set[0];
+    for (int w = 0; w < RCACHE_WAYS; w++) {
+        RenderEnt *e = &set[w];
+        if (e->version == version && e->search_gen == search_gen && e->key == key &&
+            e->pair_epoch == pair_epoch && e->from <= from &&
+            (e->complete || (need >= 0 && e->from + e->len >= from + need))) {
+            e->used = ++g_rcache_clock;
+            return e;
+        }
+        if (e->used < victim->used) victim = e;
+    }
+
+    int full_len = (int)strlen(line);
+    if (from > full_len) from = full_len;
+    int end = (need < 0 || need > full_len - from) ? full_len : from + need;
+    int len = end - from;
+    /* Grow to fit, and give back what a very long line left behind */
+    if (len + 1 > victim->cap || (victim->cap > RCACHE_KEEP && victim->cap > 4 * (len + 1))) {
+        chtype *nc = (chtype*)realloc(victim->cells, (size_t)(len + 1) * sizeof(chtype));
+        if (!nc) return NULL;
+        victim->cells = nc;
+        victim->cap = len + 1;
+    }
+    if (use_ansi) {
+        ansi_line_cells(line, from, end, b->meta[idx].ansi, b->meta[idx].ansi_count,
+                        spans, nspans, victim->cells);
+    } else {
+        LexMark at = lex_mark_before(b, idx, lex, from);
+        lex_line(&g_syntax[b->lang], line, from, end, full_len, &at, 1, spans, nspans, victim->cells);
+    }
+
+    victim->version = version;
+    victim->search_gen = search_gen;
+    victim->key = key;
+    victim->pair_epoch = use_ansi ? g_ansi_pair_epoch : 0;  /* after painting: see ansi_get_pair */
+    victim->from = from;
+    victim->complete = (end == full_len);
+    victim->len = len;
+    victim->used = ++g_rcache_clock;
+    return victim;
+}
+
+/* Paint n cells on row y, clipped at max_x.  cells[0] sits at column `col`
+ * of the line (0 for a wrapped row), and column `left` of the line lands at
+ * screen column x; anything left of it is dropped.  Printable ASCII goes
+ * out in mvaddchnstr batches; tabs become spaces up to the next TAB_WIDTH
+ * stop; other grapheme clusters go out as one cchar_t through mvadd_wch
+ * and ASCII controls as ^X, taking the cells cell_step counts for them.
+ * `sel` adds the visual-selection look. */
+static void blit_cells(int y, int x, int max_x, const chtype *cells, int n,
+                       int col, int left, int sel) {
+    chtype row[512];
+    int rn = 0;
+    int start = x + (col > left ? col - left : 0);
+    x -= left;
+
+#define BLIT_FLUSH() do { if (rn) { mvaddchnstr(y, start, row, rn); start += rn; rn = 0; } } while (0)
+
+    for (int i = 0; i < n && x + col < max_x; ) {
+        chtype c = cells[i];
+        if (sel) {
+            c |= A_REVERSE;
+            if (!(c & A_COLOR)) c |= COLOR_PAIR(COLOR_COPY_SELECT);
+        }
+        unsigned char ch = (unsigned char)(c & A_CHARTEXT);
+
+        if (ch == '\t') {
+            int stop = (col / TAB_WIDTH + 1) * TAB_WIDTH;
+            chtype sp = (c & ~A_CHARTEXT) | ' ';
+            while (col < stop && x + col < max_x) {
+                if (col >= left) {
+                    if (rn == (int)(sizeof(row) / sizeof(row[0]))) BLIT_FLUSH();
+                    row[rn++] = sp;
                 }
-                out[out_len++] = raw[i];
-                out[out_len] = '\0';
+                col++;
             }
-
             i++;
             continue;
         }
-
-        int adv = 1;
-        if (c >= 0x80) {
-            if ((c & 0xE0) == 0xC0) adv = 2;
-            else if ((c & 0xF0) == 0xE0) adv = 3;
-            else if ((c & 0xF8) == 0xF0) adv = 4;
+        if (ch >= 0x20 && ch < 0x7f && (i + 1 >= n || !(cells[i + 1] & 0x80))) {
+            if (rn == (int)(sizeof(row) / sizeof(row[0]))) BLIT_FLUSH();
+            row[rn++] = c;
+            col++;
+            i++;
+            continue;
         }
 
-        if (plain_byte >= byte_start && !emitted_prefix) {
-            char prefix[128];
-            ansi_state_to_sgr(&st, prefix, sizeof(prefix));
-            size_t plen = strlen(prefix);
-
-            if (out_len + plen + 1 > out_cap) {
-                while (out_len + plen + 1 > out_cap) out_cap *= 2;
-                char *nb = (char*)realloc(out, out_cap);
-                if (!nb) { free(out); return NULL; }
-                out = nb;
+        char gb[GC_MAX_BYTES + 1];
+        int gn = 0;
+        for (; gn < GC_MAX_BYTES && i + gn < n; gn++) gb[gn] = (char)(cells[i + gn] & A_CHARTEXT);
+        gb[gn] = '\0';
+        int w;
+        int len = gc_len(gb, &w);
+        chtype a = c & ~A_CHARTEXT;
+
+        if (col < left || ch < 0x20 || ch == 0x7f) {
+            /* Controls as ^X; a cluster cut by the left edge as blanks */
+            chtype pic[2] = { a | '^', a | (chtype)(ch ^ 0x40) };
+            for (int k = 0; k < w && x + col < max_x; k++, col++) {
+                if (col < left) continue;
+                if (rn == (int)(sizeof(row) / sizeof(row[0]))) BLIT_FLUSH();
+                row[rn++] = (ch < 0x20 || ch == 0x7f) ? pic[k] : (a | ' ');
             }
-
-            memcpy(out + out_len, prefix, plen);
-            out_len += plen;
-            out[out_len] = '\0';
-
-            emitted_prefix = 1;
-            in_range = 1;
+            i += len;
+            continue;
         }
-
-        if (in_range && remaining > 0) {
-            if (out_len + (size_t)adv + 1 > out_cap) {
-                while (out_len + (size_t)adv + 1 > out_cap) out_cap *= 2;
-                char *nb = (char*)realloc(out, out_cap);
-                if (!nb) { free(out); return NULL; }
-                out = nb;
+        if (x + col + w > max_x) break;
+
+        /* Base character plus the zero-width ones drawn over it */
+        wchar_t wc[CCHARW_MAX + 1];
+        int nw = 0;
+        for (int k = 0; k < len && nw < CCHARW_MAX; ) {
+            uint32_t cp;
+            k += utf8_decode(gb + k, &cp);
+            int cw = cp_width(cp);
+            if (nw == 0) {
+                if (cw < 0) cp = 0xFFFD;
+                else if (cw == 0) wc[nw++] = L' ';
+                wc[nw++] = (wchar_t)cp;
+            } else if (cw == 0) {
+                wc[nw++] = (wchar_t)cp;
             }
-
-            memcpy(out + out_len, raw + i, (size_t)adv);
-            out_len += (size_t)adv;
-            out[out_len] = '\0';
-
-            remaining -= adv;
-            if (remaining <= 0) break;
         }
+        wc[nw < CCHARW_MAX ? nw : CCHARW_MAX] = L'\0';
 
-        i += adv;
-        plain_byte += adv;
+        BLIT_FLUSH();
+        cchar_t cc;
+        setcchar(&cc, wc, a & A_ATTRIBUTES & ~A_COLOR, (short)PAIR_NUMBER(a), NULL);
+        mvadd_wch(y, x + col, &cc);
+        col += w;
+        i += len;
+        start = x + col;
     }
+    BLIT_FLUSH();
 
-    if (!emitted_prefix || out_len == 0) {
-        free(out);
-        return NULL;
+#undef BLIT_FLUSH
+}
+
+// -----------------------------
+// Damage tracking
+// Each content row remembers what it last showed; draw_buffer repaints a
+// row only when that changes.  Anything that scribbles over the text area
+// outside draw_buffer (popups) must call damage_invalidate_all().  When the
+// rows merely moved (scrolling), the text area is scrolled in place and
+// only the rows that came into view are painted.
+// -----------------------------
+enum {
+    ROW_SEL       = 1 << 0,
+    ROW_LINENR    = 1 << 1,
+    ROW_WRAP      = 1 << 2,
+    ROW_ANSI      = 1 << 3,
+};
+
+typedef struct {
+    const Buffer *buf;
+    int      line;         /* -1: past end of buffer */
+    int      seg;          /* wrap segment within the line */
+    int      hcol;         /* Buffer.hscroll when not wrapping */
+    unsigned version;      /* LineMeta.version of `line` */
+    unsigned search_gen;   /* 0 when search highlighting is off */
+    int      lang;
+    int      lex;          /* lexer state the line starts in */
+    int      flags;        /* ROW_* */
+} RowSig;
+
+static struct {
+    RowSig *rows;
+    RowSig *next;          /* this frame's layout, for shift detection */
+    int     nrows;
+    int     cols;
+    int     full;
+} g_damage;
+
+static void damage_invalidate_all(void) {
+    g_damage.full = 1;
+}
+
+/* Size the row table for this frame; a geometry change repaints everything. */
+static void damage_begin_frame(int h, int cols) {
+    if (h != g_damage.nrows || cols != g_damage.cols) {
+        size_t n = (size_t)(h > 0 ? h : 1);
+        RowSig *nr = (RowSig*)realloc(g_damage.rows, n * sizeof(RowSig));
+        if (nr) g_damage.rows = nr;
+        RowSig *nn = (RowSig*)realloc(g_damage.next, n * sizeof(RowSig));
+        if (nn) g_damage.next = nn;
+        g_damage.nrows = (nr && nn) ? h : 0;
+        g_damage.cols = cols;
+        g_damage.full = 1;
+    }
+}
+
+/* Returns 1 if row y already shows `sig`.  Otherwise records it, clears the
+ * row and returns 0 so the caller paints it. */
+static int damage_row_clean(int y, const RowSig *sig) {
+    if (y < g_damage.nrows) {
+        if (!g_damage.full && memcmp(&g_damage.rows[y], sig, sizeof(*sig)) == 0) return 1;
+        g_damage.rows[y] = *sig;
+    }
+    move(y, 0);
+    clrtoeol();
+    return 0;
+}
+
+static void row_sig_init(RowSig *sig, const ViewerState *st, Buffer *b,
+                         int line, int seg, int in_sel, int do_search_hl) {
+    memset(sig, 0, sizeof(*sig));  /* padding too: rows are compared with memcmp */
+    sig->buf = b;
+    sig->line = line;
+    sig->seg = seg;
+    if (line >= 0) {
+        sig->version = b->meta[line].version;
+        sig->search_gen = do_search_hl ? st->search_gen : 0;
+        sig->lang = (int)b->lang;
+        sig->lex = b->has_ansi ? LEX_CODE : lex_state_at(b, line);
+        sig->hcol = st->wrap_enabled ? 0 : b->hscroll;
+    }
+    sig->flags = (in_sel ? ROW_SEL : 0)
+               | (st->show_line_numbers ? ROW_LINENR : 0)
+               | (st->wrap_enabled ? ROW_WRAP : 0)
+               | (b->has_ansi ? ROW_ANSI : 0);
+}
+
+/* Fill out[0..h) with the signature each content row will have, walking
+ * the rows the same way draw_buffer_pass paints them. */
+static void damage_layout(ViewerState *st, Buffer *b, int h, int sel_lo, int sel_hi,
+                          int do_search_hl, RowSig *out) {
+    int y = 0;
+    if (!st->wrap_enabled) {
+        for (; y < h; y++) {
+            int line_idx = b->scroll_offset + y;
+            if (line_idx < 0 || line_idx >= b->line_count) {
+                row_sig_init(&out[y], st, b, -1, 0, 0, 0);
+                continue;
+            }
+            const int in_sel = (st->mode == MODE_VISUAL && line_idx >= sel_lo && line_idx <= sel_hi);
+            row_sig_init(&out[y], st, b, line_idx, 0, in_sel, do_search_hl);
+        }
+        return;
     }
 
-    {
-        const char *reset = "\x1b[0m";
-        size_t rlen = strlen(reset);
-        if (out_len + rlen + 1 > out_cap) {
-            while (out_len + rlen + 1 > out_cap) out_cap *= 2;
-            char *nb = (char*)realloc(out, out_cap);
-            if (!nb) { free(out); return NULL; }
-            out = nb;
+    const int text_w = text_width_for(st);
+    int logical = b->scroll_offset < 0 ? 0 : b->scroll_offset;
+    while (y < h && logical < b->line_count) {
+        const WrapEnt *wl = wrap_layout(b, logical, text_w);
+        if (!wl) break;
+        const int in_sel = (st->mode == MODE_VISUAL && logical >= sel_lo && logical <= sel_hi);
+        for (int seg = 0; seg < wl->nsegs && y < h; seg++, y++)
+            row_sig_init(&out[y], st, b, logical, seg, in_sel, do_search_hl);
+        logical++;
+    }
+    for (; y < h; y++) row_sig_init(&out[y], st, b, -1, 0, 0, 0);
+}
+
+/* The shift d (rows moved up; negative: down) that lines up most of the
+ * new layout with what is on screen, or 0 when fewer than half the rows
+ * would be reused. */
+static int damage_find_shift(int h) {
+    const RowSig *old = g_damage.rows, *cur = g_damage.next;
+    int best = 0, best_hits = h / 2;
+    for (int d = 1; d < h - best_hits; d++) {
+        for (int dir = 1; dir >= -1; dir -= 2) {
+            int hits = 0;
+            for (int y = 0; y < h - d; y++) {
+                const RowSig *a = dir > 0 ? &cur[y] : &cur[y + d];
+                const RowSig *o = dir > 0 ? &old[y + d] : &old[y];
+                if (a->line >= 0 && memcmp(a, o, sizeof(*a)) == 0) hits++;
+            }
+            if (hits > best_hits) { best_hits = hits; best = dir * d; }
         }
-        memcpy(out + out_len, reset, rlen);
-        out_len += rlen;
-        out[out_len] = '\0';
+        if (best) break;  /* the smallest shift that works */
     }
+    return best;
+}
 
-    return out;
+/* Scroll rows [0, h) of stdscr and the row table by d and leave a hint for
+ * the renderer; rows scrolled in start out dirty. */
+static void damage_scroll(int h, int d) {
+    setscrreg(0, h - 1);
+    scrollok(stdscr, TRUE);
+    wscrl(stdscr, d);
+    scrollok(stdscr, FALSE);
+    setscrreg(0, getmaxy(stdscr) - 1);
+
+    int n = d > 0 ? d : -d;
+    if (d > 0) {
+        memmove(&g_damage.rows[0], &g_damage.rows[n], (size_t)(h - n) * sizeof(RowSig));
+        memset(&g_damage.rows[h - n], 0, (size_t)n * sizeof(RowSig));
+    } else {
+        memmove(&g_damage.rows[n], &g_damage.rows[0], (size_t)(h - n) * sizeof(RowSig));
+        memset(&g_damage.rows[0], 0, (size_t)n * sizeof(RowSig));
+    }
+    screen_scroll_hint(0, h - 1, d);
 }
-static void draw_buffer(ViewerState *st) {
-    if (!st) return;
+
+static void draw_buffer_pass(ViewerState *st) {
 
     Buffer *b = &st->buffers[st->current_buffer];
     int max_x = getmaxx(stdscr);
@@ -3553,12 +6142,9 @@ static void draw_buffer(ViewerState *st) {
     const int line_nr_width = line_nr_width_for(st);
     const int start_x       = line_nr_width + 1;
     const int do_search_hl  = (st->search_highlight && st->search_term[0] != '\0');
-    const int use_ansi      = b->raw_has_ansi;
+    RowSig sig;
 
-    for (int y = 0; y < h; y++) {
-        move(y, 0);
-        clrtoeol();
-    }
+    damage_begin_frame(h, max_x);
 
     int sel_lo = 0, sel_hi = -1;
     if (st->mode == MODE_VISUAL) {
@@ -3568,10 +6154,24 @@ static void draw_buffer(ViewerState *st) {
         if (sel_hi >= b->line_count) sel_hi = b->line_count - 1;
     }
 
+    if (!g_damage.full && g_damage.nrows == h && h > 2) {
+        damage_layout(st, b, h, sel_lo, sel_hi, do_search_hl, g_damage.next);
+        int d = damage_find_shift(h);
+        if (d) damage_scroll(h, d);
+    }
+
     if (!st->wrap_enabled) {
         for (int y = 0; y < h; y++) {
             int line_idx = b->scroll_offset + y;
-            if (line_idx < 0 || line_idx >= b->line_count) continue;
+            if (line_idx < 0 || line_idx >= b->line_count) {
+                row_sig_init(&sig, st, b, -1, 0, 0, 0);
+                damage_row_clean(y, &sig);
+                continue;
+            }
+
+            const int in_sel = (st->mode == MODE_VISUAL && line_idx >= sel_lo && line_idx <= sel_hi);
+            row_sig_init(&sig, st, b, line_idx, 0, in_sel, do_search_hl);
+            if (damage_row_clean(y, &sig)) continue;
 
             if (st->show_line_numbers) {
                 attron(COLOR_PAIR(COLOR_LINENR));
@@ -3579,19 +6179,21 @@ static void draw_buffer(ViewerState *st) {
                 attroff(COLOR_PAIR(COLOR_LINENR));
             }
 
-            const int in_sel = (st->mode == MODE_VISUAL && line_idx >= sel_lo && line_idx <= sel_hi);
-
-            if (in_sel) attron(COLOR_PAIR(COLOR_COPY_SELECT) | A_REVERSE);
-
-            if (use_ansi && b->raw_lines && b->raw_lines[line_idx]) {
-                draw_ansi_line(b->raw_lines[line_idx], y, start_x, max_x);
-            } else {
-                highlight_line(b->lines[line_idx], b->lang, y, start_x, max_x,
-                               st->search_term, do_search_hl);
-            }
-
-            if (in_sel) attroff(COLOR_PAIR(COLOR_COPY_SELECT) | A_REVERSE);
+            const LineMeta *lm = do_search_hl ? line_matches(st, b, line_idx) : NULL;
+            const MatchSpan *spans = lm ? lm->matches : NULL;
+            const int nspans = lm ? lm->match_count : 0;
+
+            /* Scrolled right: render just the window starting at the
+             * character on the left edge. */
+            int off = 0, col0 = 0;
+            if (b->hscroll > 0) off = line_cell_seek(b, line_idx, b->hscroll, &col0);
+            const RenderEnt *re = render_line(b, line_idx, spans, nspans, sig.search_gen,
+                                              off, 4 * max_x);
+            if (re && off - re->from < re->len)
+                blit_cells(y, start_x, max_x, re->cells + (off - re->from), re->len - (off - re->from),
+                           col0, b->hscroll, in_sel);
         }
+        g_damage.full = 0;
         return;
     }
 
@@ -3602,12 +6204,18 @@ static void draw_buffer(ViewerState *st) {
         if (logical < 0) logical = 0;
 
         while (y < h && logical < b->line_count) {
-            WrappedLine wl = wrap_line(b->lines[logical], text_w);
+            const WrapEnt *wl = wrap_layout(b, logical, text_w);
+            if (!wl) break;
             const int in_sel = (st->mode == MODE_VISUAL && logical >= sel_lo && logical <= sel_hi);
+            const LineMeta *lm = do_search_hl ? line_matches(st, b, logical) : NULL;
+            const MatchSpan *spans = lm ? lm->matches : NULL;
+            const int nspans = lm ? lm->match_count : 0;
+            const RenderEnt *re = NULL;
 
-            int byte_off = 0;
+            for (int seg = 0; seg < wl->nsegs && y < h; seg++, y++) {
+                row_sig_init(&sig, st, b, logical, seg, in_sel, do_search_hl);
+                if (damage_row_clean(y, &sig)) continue;
 
-            for (int seg = 0; seg < wl.count && y < h; seg++) {
                 if (st->show_line_numbers) {
                     if (seg == 0) {
                         attron(COLOR_PAIR(COLOR_LINENR));
@@ -3618,38 +6226,50 @@ static void draw_buffer(ViewerState *st) {
                     }
                 }
 
-                if (in_sel) attron(COLOR_PAIR(COLOR_COPY_SELECT) | A_REVERSE);
-
-                if (use_ansi && b->raw_lines && b->raw_lines[logical]) {
-                    int seg_byte_len = (int)strlen(wl.segments[seg]);
-                    char *ansi_seg = ansi_slice_for_plain_range(
-                        b->raw_lines[logical],
-                        byte_off,
-                        seg_byte_len
-                    );
-
-                    if (ansi_seg) {
-                        draw_ansi_line(ansi_seg, y, start_x, max_x);
-                        free(ansi_seg);
-                    } else {
-                        highlight_line(wl.segments[seg], b->lang, y, start_x, max_x,
-                                       st->search_term, do_search_hl);
-                    }
-
-                    byte_off += seg_byte_len;
-                } else {
-                    highlight_line(wl.segments[seg], b->lang, y, start_x, max_x,
-                                   st->search_term, do_search_hl);
-                    byte_off += (int)strlen(wl.segments[seg]);
+                const WrapSeg *sg = &wl->segs[seg];
+                if (!re) re = render_line(b, logical, spans, nspans, sig.search_gen, 0, -1);
+                if (re && sg->off < re->len) {
+                    int n = re->len - sg->off < sg->len ? re->len - sg->off : sg->len;
+                    blit_cells(y, start_x, max_x, re->cells + sg->off, n, 0, 0, in_sel);
                 }
-
-                if (in_sel) attroff(COLOR_PAIR(COLOR_COPY_SELECT) | A_REVERSE);
-                y++;
             }
-
-            free_wrapped_line(&wl);
             logical++;
         }
+
+        for (; y < h; y++) {
+            row_sig_init(&sig, st, b, -1, 0, 0, 0);
+            damage_row_clean(y, &sig);
+        }
+    }
+    g_damage.full = 0;
+}
+
+/* Without wrapping, keep the cursor's column on screen: slide hscroll for
+ * small moves, recentre on the cursor after a jump of more than a screen. */
+static void hscroll_follow(ViewerState *st) {
+    Buffer *b = &st->buffers[st->current_buffer];
+    if (st->wrap_enabled || st->cursor_line < 0 || st->cursor_line >= b->line_count) return;
+    int w = text_width_for(st);
+    int cx = line_cell_col(b, st->cursor_line, st->cursor_col);
+    if (cx >= b->hscroll && cx < b->hscroll + w) return;
+    if (cx < b->hscroll - w || cx >= b->hscroll + 2 * w) b->hscroll = cx - w / 2;
+    else if (cx < b->hscroll) b->hscroll = cx;
+    else b->hscroll = cx - w + 1;
+    if (b->hscroll < 0) b->hscroll = 0;
+}
+
+/* A pass that had to recycle an ANSI colour pair may have redefined one
+ * still shown on a row it skipped as clean, so repaint everything once
+ * more; pairs used during a frame are never recycled within it. */
+static void draw_buffer(ViewerState *st) {
+    if (!st) return;
+    hscroll_follow(st);
+    unsigned epoch = g_ansi_pair_epoch;
+    g_ansi_frame++;
+    draw_buffer_pass(st);
+    if (g_ansi_pair_epoch != epoch) {
+        damage_invalidate_all();
+        draw_buffer_pass(st);
     }
 }
 
@@ -3665,17 +6285,12 @@ static void cursor_to_screen(ViewerState *st, int *out_y, int *out_x) {
         y = st->cursor_line - b->scroll_offset;
         if (y < 0) y = 0;
         if (y >= h) y = h - 1;
-        x = line_nr_width + 1 + visual_width_until(b->lines[st->cursor_line], st->cursor_col);
+        x = line_nr_width + 1 + line_cell_col(b, st->cursor_line, st->cursor_col) - b->hscroll;
     } else {
-        int w = text_width_for(st);
-        int row = 0;
-        for (int L = b->scroll_offset; L < st->cursor_line && L < b->line_count; L++) {
-            row += wrapped_rows_for_line(st, b->lines[L]);
-        }
+        int row = rows_before(st, st->cursor_line) - rows_before(st, b->scroll_offset);
 
-        int cells = visual_width_until(b->lines[st->cursor_line], st->cursor_col);
-        int seg = (w > 0) ? (cells / w) : 0;
-        int segcol = (w > 0) ? (cells % w) : 0;
+        int seg, segcol;
+        wrap_locate(st, st->cursor_line, st->cursor_col, &seg, &segcol);
 
         row += seg;
         y = row;
@@ -3693,7 +6308,6 @@ static void cursor_to_screen(ViewerState *st, int *out_y, int *out_x) {
 static void draw_ui(ViewerState *st) {
     draw_buffer(st);
     draw_status_bar(st);
-    if (st->status_ticks > 0) st->status_ticks--;
 
     int cy, cx;
     cursor_to_screen(st, &cy, &cx);
@@ -3707,61 +6321,509 @@ static void draw_ui(ViewerState *st) {
     } else {
         move(cy, cx);
     }
-    refresh();
+    screen_refresh();
+}
+
+static void cmdhist_add(ViewerState *st, const char *cmd) {
+    if (!st || !cmd) return;
+    while (*cmd && isspace((unsigned char)*cmd)) cmd++;
+    if (*cmd == '\0') return;
+
+    if (st->cmdhist_len > 0 && strcmp(st->cmdhist[st->cmdhist_len - 1], cmd) == 0) {
+        st->cmdhist_pos = st->cmdhist_len;
+        return;
+    }
+
+    if (st->cmdhist_len == CMDHIST_MAX) {
+        free(st->cmdhist[0]);
+        memmove(&st->cmdhist[0], &st->cmdhist[1], sizeof(char*) * (CMDHIST_MAX - 1));
+        st->cmdhist_len--;
+    }
+
+    st->cmdhist[st->cmdhist_len++] = safe_strdup(cmd);
+    st->cmdhist_pos = st->cmdhist_len;
+}
+
+static void cmdhist_prev(ViewerState *st) {
+    if (st->cmdhist_len == 0) return;
+    if (st->cmdhist_pos <= 0) st->cmdhist_pos = 0;
+    else st->cmdhist_pos--;
+    snprintf(st->cmdline, sizeof(st->cmdline), "%s", st->cmdhist[st->cmdhist_pos]);
+    st->cmdlen = (int)strlen(st->cmdline);
+}
+
+static void cmdhist_next(ViewerState *st) {
+    if (st->cmdhist_len == 0) return;
+    if (st->cmdhist_pos >= st->cmdhist_len - 1) {
+        st->cmdhist_pos = st->cmdhist_len;
+        st->cmdline[0] = '\0';
+        st->cmdlen = 0;
+        return;
+    }
+    st->cmdhist_pos++;
+    snprintf(st->cmdline, sizeof(st->cmdline), "%s", st->cmdhist[st->cmdhist_pos]);
+    st->cmdlen = (int)strlen(st->cmdline);
+}
+
+static int any_dirty(ViewerState *st) {
+    for (int i = 0; i < st->buffer_count; i++) {
+        if (st->buffers[i].dirty) return 1;
+    }
+    return 0;
+}
+
+static int dirty_count(ViewerState *st) {
+    int n = 0;
+    for (int i = 0; i < st->buffer_count; i++) if (st->buffers[i].dirty) n++;
+    return n;
+}
+
+// -----------------------------
+// Ex ranges and :s
+// -----------------------------
+
+/* One address at *pp: N, ., $, '<, '>.  Stores a 0-based line. */
+static int ex_parse_address(ViewerState *st, const char **pp, int *out) {
+    const char *p = *pp;
+    Buffer *b = &st->buffers[st->current_buffer];
+    int lo = st->vis_start < st->vis_end ? st->vis_start : st->vis_end;
+    int hi = st->vis_start > st->vis_end ? st->vis_start : st->vis_end;
+
+    if (isdigit((unsigned char)*p)) {
+        long n = strtol(p, (char**)&p, 10);
+        *out = (int)(n > 0 ? n - 1 : 0);
+    } else if (*p == '.') {
+        *out = st->cursor_line; p++;
+    } else if (*p == '$') {
+        *out = b->line_count - 1; p++;
+    } else if (p[0] == '\'' && p[1] == '<') {
+        *out = lo; p += 2;
+    } else if (p[0] == '\'' && p[1] == '>') {
+        *out = hi; p += 2;
+    } else {
+        return 0;
+    }
+    *pp = p;
+    return 1;
+}
+
+/* Optional [range] prefix: %, addr or addr,addr.  Returns 1 and a clamped,
+ * ordered lo..hi when present, 0 when absent, -1 when malformed. */
+static int ex_parse_range(ViewerState *st, const char **pp, int *lo, int *hi) {
+    Buffer *b = &st->buffers[st->current_buffer];
+    const char *p = *pp;
+    int a, c;
+
+    if (*p == '%') {
+        a = 0; c = b->line_count - 1; p++;
+    } else if (ex_parse_address(st, &p, &a)) {
+        c = a;
+        if (*p == ',') {
+            p++;
+            if (!ex_parse_address(st, &p, &c)) return -1;
+        }
+    } else {
+        return 0;
+    }
+
+    if (a > c) { int t = a; a = c; c = t; }
+    if (a < 0) a = 0;
+    if (c > b->line_count - 1) c = b->line_count - 1;
+    *lo = a;
+    *hi = c;
+    while (*p && isspace((unsigned char)*p)) p++;
+    *pp = p;
+    return 1;
+}
+
+/* Growable byte buffer; reused across lines so :s allocates per result only. */
+typedef struct {
+    char  *buf;
+    size_t len;
+    size_t cap;
+} StrBuf;
+
+static int sb_append(StrBuf *sb, const char *s, size_t n) {
+    if (sb->len + n + 1 > sb->cap) {
+        size_t new_cap = sb->cap ? sb->cap : 256;
+        while (new_cap < sb->len + n + 1) new_cap *= 2;
+        char *np = (char*)realloc(sb->buf, new_cap);
+        if (!np) return -1;
+        sb->buf = np;
+        sb->cap = new_cap;
+    }
+    memcpy(sb->buf + sb->len, s, n);
+    sb->len += n;
+    sb->buf[sb->len] = '\0';
+    return 0;
+}
+
+#define SUB_NGROUPS 10
+
+typedef struct {
+    regex_t re;
+    char    pattern[256];
+    int     cflags;
+    char    repl[256];
+    int     global;
+} SubSpec;
+
+/* Copy one delimited field of :s, turning \<delim> into <delim>.  Other
+ * escapes are kept for regcomp / the replacement expander. */
+static const char *sub_read_field(const char *p, char delim, char *out, size_t out_sz) {
+    size_t n = 0;
+    while (*p && *p != delim) {
+        if (p[0] == '\\' && p[1] == delim) p++;
+        else if (p[0] == '\\' && p[1]) { if (n + 1 < out_sz) out[n++] = *p; p++; }
+        if (n + 1 >= out_sz) return NULL;
+        out[n++] = *p++;
+    }
+    out[n] = '\0';
+    return p;
+}
+
+/* Quote a literal (the / search term) as an ERE.  Returns -1 if it does
+ * not fit. */
+static int sub_quote_literal(const char *lit, char *out, size_t out_sz) {
+    size_t n = 0;
+    for (; *lit; lit++) {
+        if (strchr(".[]()*+?{}|^$\\", *lit)) {
+            if (n + 1 >= out_sz) return -1;
+            out[n++] = '\\';
+        }
+        if (n + 1 >= out_sz) return -1;
+        out[n++] = *lit;
+    }
+    out[n] = '\0';
+    return 0;
+}
+
+/* Expand the replacement for one match: & and \0 are the whole match,
+ * \1..\9 capture groups, \& and \\ literals. */
+static int sub_expand(StrBuf *out, const char *repl, const char *base, const regmatch_t *m) {
+    for (const char *r = repl; *r; r++) {
+        int g = -1;
+        if (*r == '&') g = 0;
+        else if (*r == '\\' && r[1] >= '0' && r[1] <= '9') g = *++r - '0';
+        else if (*r == '\\' && r[1]) r++;
+
+        if (g < 0) {
+            if (sb_append(out, r, 1) != 0) return -1;
+        } else if (m[g].rm_so >= 0) {
+            if (sb_append(out, base + m[g].rm_so, (size_t)(m[g].rm_eo - m[g].rm_so)) != 0) return -1;
+        }
+    }
+    return 0;
+}
+
+/* Rewrite one line in a single left-to-right pass into `out`.  Returns the
+ * number of replacements (-1 on OOM); when non-zero, [*first, *last_end)
+ * is the span of the original line that differs from the result. */
+static int sub_rewrite_line(const regex_t *re, const SubSpec *spec, const char *line,
+                            StrBuf *out, int *first, int *last_end) {
+    regmatch_t m[SUB_NGROUPS];
+    int len = (int)strlen(line);
+    int off = 0, count = 0;
+    int prev_end = -1;   /* end of the last non-empty match */
+
+    out->len = 0;
+    if (out->buf) out->buf[0] = '\0';
+    *first = -1;
+    *last_end = 0;
+    while (off <= len) {
+        if (regexec(re, line + off, SUB_NGROUPS, m, off > 0 ? REG_NOTBOL : 0) != 0) break;
+        int ms = off + m[0].rm_so;
+        int me = off + m[0].rm_eo;
+        if (me == ms && ms == prev_end) {
+            /* as in sed: no empty match right after a non-empty one */
+            if (ms < len && sb_append(out, line + ms, 1) != 0) return -1;
+            off = ms + 1;
+            continue;
+        }
+        if (sb_append(out, line + off, (size_t)(ms - off)) != 0) return -1;
+        if (sub_expand(out, spec->repl, line + off, m) != 0) return -1;
+        if (*first < 0) *first = ms;
+        *last_end = me;
+        count++;
+        if (me == ms) {
+            /* empty match: step over one char so the scan always advances */
+            if (ms < len && sb_append(out, line + ms, 1) != 0) return -1;
+            off = ms + 1;
+        } else {
+            off = me;
+            prev_end = me;
+        }
+        if (!spec->global) break;
+    }
+    if (count == 0) return 0;
+    if (off < len && sb_append(out, line + off, (size_t)(len - off)) != 0) return -1;
+    if (!out->buf && sb_append(out, "", 0) != 0) return -1;
+    return count;
+}
+
+/* Ranges at least this long are split into SUB_CHUNK_LINES pieces and
+ * rewritten on the worker pool; smaller ones run inline. */
+#define SUB_PARALLEL_MIN_LINES  65536
+#define SUB_CHUNK_LINES         32768
+#define SUB_PROGRESS_STRIDE     4096
+
+typedef struct {
+    pthread_mutex_t mu;
+    pthread_cond_t  done_cv;
+    int  jobs_total;
+    int  jobs_done;
+    long lines_done;
+    volatile int cancel;
+} SubCtx;
+
+/* One slice of the range.  Workers only read b->lines; results stay here
+ * (edits[k] describes new_lines[k]) until the UI thread commits them. */
+typedef struct {
+    SubCtx        *ctx;
+    const SubSpec *spec;
+    const Buffer  *b;
+    int lo, hi;
+    UndoEdit *edits;
+    char    **new_lines;
+    int       nedits, cap;
+    StrBuf    pool;
+    int       total;
+    int       failed;
+} SubChunk;
+
+static void sub_chunk_run(SubChunk *c, const regex_t *re) {
+    StrBuf out = {0};
+    int since = 0;
+
+    for (int li = c->lo; li <= c->hi; li++) {
+        if (++since == SUB_PROGRESS_STRIDE) {
+            pthread_mutex_lock(&c->ctx->mu);
+            c->ctx->lines_done += since;
+            pthread_mutex_unlock(&c->ctx->mu);
+            since = 0;
+            if (c->ctx->cancel) break;
+        }
+        const char *line = c->b->lines[li];
+        int first, last_end;
+        int n = sub_rewrite_line(re, c->spec, line, &out, &first, &last_end);
+        if (n == 0) continue;
+        if (n < 0) { c->failed = 1; break; }
+
+        if (c->nedits >= c->cap) {
+            int new_cap = c->cap ? c->cap * 2 : 64;
+            UndoEdit *ne = (UndoEdit*)realloc(c->edits, (size_t)new_cap * sizeof(UndoEdit));
+            if (ne) c->edits = ne;
+            char **nl = ne ? (char**)realloc(c->new_lines, (size_t)new_cap * sizeof(char*)) : NULL;
+            if (nl) c->new_lines = nl;
+            if (!ne || !nl) { c->failed = 1; break; }
+            c->cap = new_cap;
+        }
+        char *nl = (char*)malloc(out.len + 1);
+        if (!nl || sb_append(&c->pool, line + first, (size_t)(last_end - first)) != 0) {
+            free(nl);
+            c->failed = 1;
+            break;
+        }
+        memcpy(nl, out.buf, out.len + 1);
+
+        int old_len = (int)strlen(line);
+        UndoEdit *e = &c->edits[c->nedits];
+        e->line = li;
+        e->col = first;
+        e->del_len = (int)out.len - (old_len - last_end) - first;
+        e->ins_off = (int)c->pool.len - (last_end - first);
+        e->ins_len = last_end - first;
+        c->new_lines[c->nedits++] = nl;
+        c->total += n;
+    }
+    free(out.buf);
+
+    pthread_mutex_lock(&c->ctx->mu);
+    c->ctx->lines_done += since;
+    pthread_mutex_unlock(&c->ctx->mu);
+}
+
+/* Worker entry.  glibc serialises regexec on one regex_t, so each chunk
+ * compiles its own copy of the (already validated) pattern. */
+static void sub_chunk_job(void *arg) {
+    SubChunk *c = (SubChunk*)arg;
+    regex_t re;
+    if (regcomp(&re, c->spec->pattern, c->spec->cflags) == 0) {
+        sub_chunk_run(c, &re);
+        regfree(&re);
+    } else {
+        c->failed = 1;
+    }
+    pthread_mutex_lock(&c->ctx->mu);
+    c->ctx->jobs_done++;
+    pthread_cond_signal(&c->ctx->done_cv);
+    pthread_mutex_unlock(&c->ctx->mu);
+}
+
+static void sub_chunk_free(SubChunk *c) {
+    for (int k = 0; k < c->nedits; k++) free(c->new_lines[k]);
+    free(c->new_lines);
+    free(c->edits);
+    free(c->pool.buf);
+}
+
+/* Wait for the workers, showing progress in the status bar; ESC cancels. */
+static void sub_wait(ViewerState *st, SubCtx *ctx, long total_lines) {
+    pthread_mutex_lock(&ctx->mu);
+    while (ctx->jobs_done < ctx->jobs_total) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 100L * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) { ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+        pthread_cond_timedwait(&ctx->done_cv, &ctx->mu, &ts);
+        if (ctx->jobs_done >= ctx->jobs_total || ctx->cancel) continue;
+        long done = ctx->lines_done;
+        pthread_mutex_unlock(&ctx->mu);
+
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Substituting... %ld%% (ESC to cancel)",
+                 total_lines > 0 ? done * 100 / total_lines : 0);
+        set_status(st, msg);
+        draw_ui(st);
+        timeout(0);
+        int ch = getch();
+        timeout(-1);
+
+        pthread_mutex_lock(&ctx->mu);
+        if (ch == 27) ctx->cancel = 1;
+    }
+    pthread_mutex_unlock(&ctx->mu);
+}
+
+/* Apply every chunk's lines in order and fold their edits into one patch.
+ * Nothing in the buffer changes until all chunks have succeeded. */
+static int sub_commit(Buffer *b, SubChunk *chunks, int nchunks) {
+    int nedits = 0, total = 0;
+    size_t pool_len = 0;
+    for (int i = 0; i < nchunks; i++) {
+        nedits += chunks[i].nedits;
+        pool_len += chunks[i].pool.len;
+        total += chunks[i].total;
+    }
+    if (total == 0) return 0;
+
+    UndoRec rec = {0};
+    rec.edits = (UndoEdit*)malloc((size_t)nedits * sizeof(UndoEdit));
+    rec.pool = (char*)malloc(pool_len + 1);
+    if (!rec.edits || !rec.pool) { undo_rec_free(&rec); return -1; }
+
+    buffer_drop_ansi(b);
+    size_t base = 0;
+    for (int i = 0; i < nchunks; i++) {
+        SubChunk *c = &chunks[i];
+        if (c->pool.len) memcpy(rec.pool + base, c->pool.buf, c->pool.len);
+        for (int k = 0; k < c->nedits; k++) {
+            UndoEdit e = c->edits[k];
+            e.ins_off += (int)base;
+            rec.edits[rec.nedits++] = e;
+            buf_set_line(b, e.line, c->new_lines[k]);
+            c->new_lines[k] = NULL;
+        }
+        base += c->pool.len;
+    }
+    undo_push_patch(b, rec);
+    return total;
 }
 
-static void cmdhist_add(ViewerState *st, const char *cmd) {
-    if (!st || !cmd) return;
-    while (*cmd && isspace((unsigned char)*cmd)) cmd++;
-    if (*cmd == '\0') return;
-
-    if (st->cmdhist_len > 0 && strcmp(st->cmdhist[st->cmdhist_len - 1], cmd) == 0) {
-        st->cmdhist_pos = st->cmdhist_len;
-        return;
+/* :[range]s/pat/repl/[gi] — POSIX extended regex, whole buffer when no
+ * range is given.  The result is recorded as a single undo patch holding
+ * only the changed column span of each modified line. */
+static void cmd_substitute(ViewerState *st, int lo, int hi, const char *p) {
+    Buffer *b = &st->buffers[st->current_buffer];
+    while (*p && isspace((unsigned char)*p)) p++;
+    if (!*p) { set_status(st, "Usage: :[range]s/pat/repl/[gi]"); return; }
+
+    char delim = *p++;
+    if (isalnum((unsigned char)delim) || delim == '\\') { set_status(st, "Bad substitution syntax"); return; }
+
+    SubSpec spec;
+    memset(&spec, 0, sizeof(spec));
+    p = sub_read_field(p, delim, spec.pattern, sizeof(spec.pattern));
+    if (!p) { set_status(st, "Pattern too long"); return; }
+    if (*p != delim) { set_status(st, "Bad substitution syntax"); return; }
+    p = sub_read_field(p + 1, delim, spec.repl, sizeof(spec.repl));
+    if (!p) { set_status(st, "Replacement too long"); return; }
+
+    spec.cflags = REG_EXTENDED;
+    if (*p == delim) {
+        for (p++; *p; p++) {
+            if (*p == 'g') spec.global = 1;
+            else if (*p == 'i') spec.cflags |= REG_ICASE;
+        }
     }
-
-    if (st->cmdhist_len == CMDHIST_MAX) {
-        free(st->cmdhist[0]);
-        memmove(&st->cmdhist[0], &st->cmdhist[1], sizeof(char*) * (CMDHIST_MAX - 1));
-        st->cmdhist_len--;
+    if (!spec.pattern[0]) {
+        if (!st->search_term[0]) { set_status(st, "Empty pattern"); return; }
+        /* the last / search is a plain substring, not a regex */
+        if (sub_quote_literal(st->search_term, spec.pattern, sizeof(spec.pattern)) != 0) {
+            set_status(st, "Pattern too long");
+            return;
+        }
     }
 
-    st->cmdhist[st->cmdhist_len++] = safe_strdup(cmd);
-    st->cmdhist_pos = st->cmdhist_len;
-}
-
-static void cmdhist_prev(ViewerState *st) {
-    if (st->cmdhist_len == 0) return;
-    if (st->cmdhist_pos <= 0) st->cmdhist_pos = 0;
-    else st->cmdhist_pos--;
-    snprintf(st->cmdline, sizeof(st->cmdline), "%s", st->cmdhist[st->cmdhist_pos]);
-    st->cmdlen = (int)strlen(st->cmdline);
-}
-
-static void cmdhist_next(ViewerState *st) {
-    if (st->cmdhist_len == 0) return;
-    if (st->cmdhist_pos >= st->cmdhist_len - 1) {
-        st->cmdhist_pos = st->cmdhist_len;
-        st->cmdline[0] = '\0';
-        st->cmdlen = 0;
+    int rc = regcomp(&spec.re, spec.pattern, spec.cflags);
+    if (rc != 0) {
+        char err[128], msg[192];
+        regerror(rc, &spec.re, err, sizeof(err));
+        snprintf(msg, sizeof(msg), "Bad pattern: %s", err);
+        set_status(st, msg);
         return;
     }
-    st->cmdhist_pos++;
-    snprintf(st->cmdline, sizeof(st->cmdline), "%s", st->cmdhist[st->cmdhist_pos]);
-    st->cmdlen = (int)strlen(st->cmdline);
-}
 
-static int any_dirty(ViewerState *st) {
-    for (int i = 0; i < st->buffer_count; i++) {
-        if (st->buffers[i].dirty) return 1;
+    long nlines = (long)hi - lo + 1;
+    int nchunks = 1;
+    if (nlines >= SUB_PARALLEL_MIN_LINES && pool_start() == 0)
+        nchunks = (int)((nlines + SUB_CHUNK_LINES - 1) / SUB_CHUNK_LINES);
+
+    SubChunk *chunks = (SubChunk*)calloc((size_t)nchunks, sizeof(SubChunk));
+    if (!chunks) { regfree(&spec.re); set_status(st, "Out of memory"); return; }
+    SubCtx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    pthread_mutex_init(&ctx.mu, NULL);
+    pthread_cond_init(&ctx.done_cv, NULL);
+    ctx.jobs_total = nchunks;
+
+    for (int i = 0; i < nchunks; i++) {
+        SubChunk *c = &chunks[i];
+        c->ctx = &ctx;
+        c->spec = &spec;
+        c->b = b;
+        c->lo = lo + i * SUB_CHUNK_LINES;
+        c->hi = (nchunks == 1 || i == nchunks - 1) ? hi : c->lo + SUB_CHUNK_LINES - 1;
+    }
+    if (nchunks == 1) {
+        sub_chunk_run(&chunks[0], &spec.re);
+    } else {
+        for (int i = 0; i < nchunks; i++) {
+            if (pool_submit(sub_chunk_job, &chunks[i]) != 0) sub_chunk_job(&chunks[i]);
+        }
+        sub_wait(st, &ctx, nlines);
     }
-    return 0;
-}
+    regfree(&spec.re);
 
-static int dirty_count(ViewerState *st) {
-    int n = 0;
-    for (int i = 0; i < st->buffer_count; i++) if (st->buffers[i].dirty) n++;
-    return n;
+    int failed = 0;
+    for (int i = 0; i < nchunks; i++) failed |= chunks[i].failed;
+    int total = 0;
+    if (!ctx.cancel && !failed) {
+        total = sub_commit(b, chunks, nchunks);
+        if (total < 0) failed = 1;
+    }
+    for (int i = 0; i < nchunks; i++) sub_chunk_free(&chunks[i]);
+    free(chunks);
+    pthread_cond_destroy(&ctx.done_cv);
+    pthread_mutex_destroy(&ctx.mu);
+    ensure_cursor_bounds(st);
+
+    char msg[128];
+    if (ctx.cancel) snprintf(msg, sizeof(msg), "Substitution cancelled");
+    else if (failed) snprintf(msg, sizeof(msg), "Out of memory (buffer unchanged)");
+    else if (total == 0) snprintf(msg, sizeof(msg), "No matches");
+    else snprintf(msg, sizeof(msg), "Replaced %d occurrence%s", total, total == 1 ? "" : "s");
+    set_status(st, msg);
 }
 
 static void exec_command(ViewerState *st, const char *cmd, int *running) {
@@ -3771,14 +6833,19 @@ static void exec_command(ViewerState *st, const char *cmd, int *running) {
 
     Buffer *b = &st->buffers[st->current_buffer];
 
-    if (isdigit((unsigned char)cmd[0])) {
-        long n = strtol(cmd, NULL, 10);
-        if (n > 0) {
-            st->cursor_line = (int)n - 1;
-            st->cursor_col = 0;
-            ensure_cursor_bounds(st);
-            ensure_cursor_visible(st);
-        }
+    int lo = 0, hi = b->line_count - 1;
+    int has_range = ex_parse_range(st, &cmd, &lo, &hi);
+    if (has_range < 0) { set_status(st, "Bad range"); return; }
+    if (cmd[0] == 's' && (cmd[1] == '\0' || !isalnum((unsigned char)cmd[1]))) {
+        cmd_substitute(st, lo, hi, cmd + 1);
+        return;
+    }
+    if (has_range) {
+        if (*cmd) { set_status(st, "Range not supported for this command"); return; }
+        st->cursor_line = hi;
+        st->cursor_col = 0;
+        ensure_cursor_bounds(st);
+        ensure_cursor_visible(st);
         return;
     }
 
@@ -3800,86 +6867,6 @@ static void exec_command(ViewerState *st, const char *cmd, int *running) {
     if (strcmp(tok, "?") == 0) { cmd_show_help(st); return; }
     if (strcmp(tok, "qa!") == 0 || strcmp(tok, "qall!") == 0) { *running = 0; return; }
 
-    /* :s/pattern/replacement/  or  :s/pattern/replacement/g */
-    if (tok[0] == 's' && tok[1] == '\0') {
-        if (!p || !*p) { set_status(st, "Usage: :s /pat/repl/ or :s /pat/repl/g"); return; }
-        char delim = p[0];
-        const char *seg1 = p + 1;
-        const char *seg2 = strchr(seg1, delim);
-        if (!seg2) { set_status(st, "Bad substitution syntax"); return; }
-        char pattern[256] = {0};
-        int plen = (int)(seg2 - seg1);
-        if (plen <= 0) { set_status(st, "Empty pattern"); return; }
-        if (plen >= (int)sizeof(pattern)) { set_status(st, "Pattern too long"); return; }
-        memcpy(pattern, seg1, (size_t)plen);
-
-        const char *seg3 = seg2 + 1;
-        const char *seg4 = strchr(seg3, delim);
-        char replacement[256] = {0};
-        int rlen = seg4 ? (int)(seg4 - seg3) : (int)strlen(seg3);
-        if (rlen >= (int)sizeof(replacement)) { set_status(st, "Replacement too long"); return; }
-        if (rlen > 0) memcpy(replacement, seg3, (size_t)rlen);
-
-        int global = 0;
-        if (seg4) {
-            const char *flags = seg4 + 1;
-            while (*flags) { if (*flags == 'g') global = 1; flags++; }
-        }
-
-        undo_push(b);
-        int total = 0;
-        int patlen = plen;
-        int replen = rlen;
-
-        for (int li = 0; li < b->line_count; li++) {
-            char *line = b->lines[li];
-            int occurrences = 0;
-            const char *scan = line;
-            while ((scan = strstr(scan, pattern))) { occurrences++; scan += patlen; }
-            if (occurrences == 0) continue;
-            if (!global) occurrences = 1;
-
-            int orig_len = (int)strlen(line);
-            int new_len = orig_len + occurrences * (replen - patlen);
-            if (new_len < 0) new_len = 0;
-            char *out = (char*)malloc((size_t)new_len + 1);
-            if (!out) { set_status(st, "Out of memory"); return; }
-
-            char *wp = out;
-            const char *rp = line;
-            int replaced = 0;
-            while (*rp) {
-                if (strncmp(rp, pattern, (size_t)patlen) == 0 && (global || replaced == 0)) {
-                    memcpy(wp, replacement, (size_t)replen);
-                    wp += replen;
-                    rp += patlen;
-                    replaced++;
-                    total++;
-                } else {
-                    *wp++ = *rp++;
-                }
-            }
-            *wp = '\0';
-
-            free(b->lines[li]);
-            b->lines[li] = out;
-            free(b->raw_lines[li]);
-            b->raw_lines[li] = safe_strdup(out);
-        }
-
-        b->raw_has_ansi = 0;
-
-        if (total == 0) {
-            set_status(st, "No matches");
-        } else {
-            char msg[128];
-            snprintf(msg, sizeof(msg), "Replaced %d occurrence%s", total, total == 1 ? "" : "s");
-            set_status(st, msg);
-        }
-        b->dirty = 1;
-        return;
-    }
-
     if (strcmp(tok, "q") == 0) {
         Buffer *cur = &st->buffers[st->current_buffer];
         if (!cur->dirty) { close_current_buffer(st); return; }
@@ -3900,6 +6887,7 @@ static void exec_command(ViewerState *st, const char *cmd, int *running) {
     }
 
     if (strcmp(tok, "ls") == 0 || strcmp(tok, "buffers") == 0) { cmd_list_buffers(st); return; }
+    if (strcmp(tok, "bsearch") == 0) { cmd_bsearch(st, p); return; }
 
     if (strcmp(tok, "b") == 0) {
         if (strncmp(p, "new", 3) == 0 && (p[3] == '\0' || isspace((unsigned char)p[3]))) {
@@ -4023,6 +7011,10 @@ static void cmd_show_help(ViewerState *st) {
     fprintf(help_file, "n               | Next search match\n");
     fprintf(help_file, "N               | Previous search match\n");
     fprintf(help_file, ":noh            | Clear search highlighting\n");
+    fprintf(help_file, ":bsearch <pat>  | Search all open buffers (popup list)\n");
+    fprintf(help_file, ":s/pat/rep/gi   | Regex replace (whole buffer; & \\1..\\9 in rep)\n");
+    fprintf(help_file, ":N,Ms/pat/rep/  | Replace in lines N..M (also %%, ., $)\n");
+    fprintf(help_file, ":'<,'>s/p/r/    | Replace in last visual selection\n");
     fprintf(help_file, "\n");
     fprintf(help_file, "=== ALL-LINES OPERATIONS ===\n");
     fprintf(help_file, "%%y              | Yank all lines to clipboard\n");
@@ -4075,9 +7067,11 @@ static void cmd_show_help(ViewerState *st) {
 
     def_prog_mode();
     endwin();
+    term_bracketed_paste(0);
     system(cmd);
     reset_prog_mode();
-    refresh();
+    term_bracketed_paste(1);
+    screen_refresh();
 
     unlink(help_template);
     temp_forget_path(help_template);
@@ -4110,26 +7104,42 @@ static void handle_command_key(ViewerState *st, int ch, int *running) {
     }
 }
 
+/* Read the pattern on the bottom row.  Echoed by redrawing it ourselves,
+ * not with echo()/getnstr(), so every frame goes through screen_refresh().
+ * Backspace erases, ^U clears, ESC cancels. */
 static void prompt_search(ViewerState *st) {
-    int max_y = getmaxy(stdscr);
-    move(max_y - 1, 0);
-    clrtoeol();
-    attron(COLOR_PAIR(COLOR_STATUS) | A_BOLD);
-    mvprintw(max_y - 1, 1, "/");
-    attroff(COLOR_PAIR(COLOR_STATUS) | A_BOLD);
-    refresh();
-
-    echo();
     char input[256] = {0};
-    getnstr(input, sizeof(input) - 1);
-    noecho();
+    int len = 0;
+    for (;;) {
+        int max_y = getmaxy(stdscr);
+        move(max_y - 1, 0);
+        clrtoeol();
+        attron(COLOR_PAIR(COLOR_STATUS) | A_BOLD);
+        mvprintw(max_y - 1, 1, "/");
+        attroff(COLOR_PAIR(COLOR_STATUS) | A_BOLD);
+        addstr(input);
+        screen_refresh();
+
+        int ch = getch();
+        if (ch == '\n' || ch == '\r' || ch == KEY_ENTER) break;
+        if (ch == 27 || ch == ERR) return;
+        if (ch == KEY_BACKSPACE || ch == 127 || ch == 8) {
+            if (len > 0) input[--len] = '\0';
+        } else if (ch == 21) {
+            len = 0;
+            input[0] = '\0';
+        } else if (ch >= 32 && ch < 256 && len < (int)sizeof(input) - 1) {
+            input[len++] = (char)ch;
+            input[len] = '\0';
+        }
+    }
 
-    int len = (int)strlen(input);
     while (len > 0 && isspace((unsigned char)input[len-1])) input[--len] = '\0';
     if (input[0] == '\0') return;
 
     snprintf(st->search_term, sizeof(st->search_term), "%s", input);
     st->search_highlight = 1;
+    st->search_gen++;
     find_all_matches(st);
     jump_to_first_match(st);
 }
@@ -4211,8 +7221,278 @@ static void show_def_popup(ViewerState *st) {
              basename_path(st->buffers[st->current_buffer].filepath));
     set_status(st, msg);
 }
-static void handle_input(ViewerState *st, int *running) {
-    int ch = getch();
+// -----------------------------
+// :bsearch — scan every open buffer on the worker pool
+// -----------------------------
+#define BSEARCH_MAX_HITS       20000
+#define BSEARCH_CANCEL_STRIDE  4096
+
+typedef struct {
+    int  buf_idx;
+    int  lineno;
+    char text[256];
+} BufHit;
+
+typedef struct {
+    pthread_mutex_t mu;
+    pthread_cond_t  done_cv;
+    BufHit *hits;
+    int count, cap;
+    int jobs_total;
+    int jobs_done;
+    int truncated;
+    volatile int cancel;
+    char pat[256];
+} BSearchCtx;
+
+typedef struct {
+    BSearchCtx *ctx;
+    int buf_idx;
+    LineSnap *snap;
+} BSearchJob;
+
+/* Worker: collect this buffer's hits locally, then publish them in one batch
+ * so the popup sees each buffer's results contiguously and in line order. */
+static void bsearch_job(void *arg) {
+    BSearchJob *job = (BSearchJob*)arg;
+    BSearchCtx *ctx = job->ctx;
+    const LineSnap *snap = job->snap;
+
+    BufHit *local = NULL;
+    int n = 0, cap = 0;
+
+    int hint = 0;
+    for (int i = 0; i < snap->count; i++) {
+        if ((i % BSEARCH_CANCEL_STRIDE) == 0 && ctx->cancel) break;
+        const char *line = snap_line(snap, i, &hint);
+        if (!strstr(line, ctx->pat)) continue;
+        if (n >= BSEARCH_MAX_HITS) break;
+        if (n >= cap) {
+            int nc = cap ? cap * 2 : 64;
+            BufHit *nl = (BufHit*)realloc(local, (size_t)nc * sizeof(BufHit));
+            if (!nl) break;
+            local = nl;
+            cap = nc;
+        }
+        BufHit *h = &local[n++];
+        h->buf_idx = job->buf_idx;
+        h->lineno = i + 1;
+        while (*line == ' ' || *line == '\t') line++;
+        snprintf(h->text, sizeof(h->text), "%s", line);
+    }
+
+    pthread_mutex_lock(&ctx->mu);
+    if (n > 0 && !ctx->cancel) {
+        int room = BSEARCH_MAX_HITS - ctx->count;
+        if (n > room) { n = room; ctx->truncated = 1; }
+        if (n > 0 && ctx->count + n > ctx->cap) {
+            int nc = ctx->cap ? ctx->cap : 256;
+            while (nc < ctx->count + n) nc *= 2;
+            BufHit *nh = (BufHit*)realloc(ctx->hits, (size_t)nc * sizeof(BufHit));
+            if (nh) { ctx->hits = nh; ctx->cap = nc; }
+            else n = 0;
+        }
+        if (n > 0) {
+            memcpy(ctx->hits + ctx->count, local, (size_t)n * sizeof(BufHit));
+            ctx->count += n;
+        }
+    }
+    ctx->jobs_done++;
+    pthread_cond_broadcast(&ctx->done_cv);
+    pthread_mutex_unlock(&ctx->mu);
+
+    free(local);
+    line_snap_release(job->snap);
+    free(job);
+}
+
+/* Popup over the (growing) hit list.  While workers are still running we poll
+ * getch with a short timeout so new results stream in without a keypress.
+ * Returns the selected index or -1. */
+static int draw_bsearch_popup(ViewerState *st, BSearchCtx *ctx) {
+    int selected = 0;
+    int top = 0;
+    int running = 1;
+
+    while (running) {
+        pthread_mutex_lock(&ctx->mu);
+        int count = ctx->count;
+        int done  = ctx->jobs_done;
+        int total = ctx->jobs_total;
+        int truncated = ctx->truncated;
+        pthread_mutex_unlock(&ctx->mu);
+
+        int start_y, start_x, popup_h, popup_w;
+        popup_geometry(count > 0 ? count : 1, &start_y, &start_x, &popup_h, &popup_w);
+        int inner_w = popup_w - 2;
+        int list_h = popup_h - 3;
+        if (list_h < 1) list_h = 1;
+
+        if (selected >= count) selected = count - 1;
+        if (selected < 0) selected = 0;
+        if (selected < top) top = selected;
+        if (selected >= top + list_h) top = selected - list_h + 1;
+
+        char title[384];
+        snprintf(title, sizeof(title), " bsearch: %s  [%d hit%s%s, %d/%d buffers] ",
+                 ctx->pat, count, count == 1 ? "" : "s", truncated ? "+" : "", done, total);
+        draw_popup_frame(start_y, start_x, popup_h, popup_w, title);
+
+        for (int row = 0; row < list_h; row++) {
+            int y = start_y + 1 + row;
+            int idx = top + row;
+            if (idx < count) {
+                /* Workers may realloc hits[] while we draw; copy under the lock. */
+                BufHit h;
+                pthread_mutex_lock(&ctx->mu);
+                h = ctx->hits[idx];
+                pthread_mutex_unlock(&ctx->mu);
+                char row_text[512];
+                snprintf(row_text, sizeof(row_text), "%s:%d  %s",
+                         basename_path(st->buffers[h.buf_idx].filepath), h.lineno, h.text);
+                draw_popup_row(y, start_x, inner_w, row_text, idx == selected);
+            } else if (idx == 0 && done == total) {
+                draw_popup_row(y, start_x, inner_w, "(no matches)", 0);
+            } else {
+                draw_popup_row(y, start_x, inner_w, NULL, 0);
+            }
+        }
+        draw_popup_hint(start_y + popup_h - 2, start_x, inner_w,
+                        done < total ? "searching...  j/k navigate  Enter jump  ESC close"
+                                     : "j/k navigate  Enter jump  ESC close");
+
+        move(start_y + 1 + (selected - top), start_x + 2);
+        screen_refresh();
+
+        timeout(done < total ? 50 : -1);
+        int ch = getch();
+        timeout(-1);
+
+        switch (ch) {
+            case ERR:       break;
+            case 27:        running = 0; selected = -1; break;
+            case 'k':
+            case KEY_UP:    if (selected > 0) selected--; break;
+            case 'j':
+            case KEY_DOWN:  if (selected < count - 1) selected++; break;
+            case 4:         selected += list_h / 2; break;   /* Ctrl+D */
+            case 21:        selected -= list_h / 2; break;   /* Ctrl+U */
+            case 'g':       selected = 0; break;
+            case 'G':       selected = count - 1; break;
+            case '\n':
+            case '\r':
+            case KEY_ENTER: if (count > 0) running = 0; break;
+            default:        break;
+        }
+        if (running && selected >= count) selected = count - 1;
+        if (running && selected < 0) selected = 0;
+    }
+
+    return selected;
+}
+
+static void cmd_bsearch(ViewerState *st, const char *pat) {
+    if (!pat || !*pat) { set_status(st, "Usage: :bsearch <pattern>"); return; }
+
+    BSearchCtx *ctx = (BSearchCtx*)calloc(1, sizeof(*ctx));
+    if (!ctx) { set_status(st, "Out of memory"); return; }
+    pthread_mutex_init(&ctx->mu, NULL);
+    pthread_cond_init(&ctx->done_cv, NULL);
+    snprintf(ctx->pat, sizeof(ctx->pat), "%s", pat);
+    ctx->jobs_total = st->buffer_count;
+
+    /* Workers scan line snapshots, never the live buffers */
+    for (int i = 0; i < st->buffer_count; i++) {
+        BSearchJob *job = (BSearchJob*)malloc(sizeof(*job));
+        if (job) {
+            job->ctx = ctx;
+            job->buf_idx = i;
+            job->snap = line_snap_take(&st->buffers[i]);
+            if (!job->snap) { free(job); job = NULL; }
+        }
+        if (!job || pool_submit(bsearch_job, job) != 0) {
+            /* No worker available: scan inline. */
+            if (job) bsearch_job(job);
+            else {
+                pthread_mutex_lock(&ctx->mu);
+                ctx->jobs_done++;
+                pthread_mutex_unlock(&ctx->mu);
+            }
+        }
+    }
+
+    draw_ui(st);
+    int sel = draw_bsearch_popup(st, ctx);
+
+    pthread_mutex_lock(&ctx->mu);
+    ctx->cancel = 1;
+    while (ctx->jobs_done < ctx->jobs_total)
+        pthread_cond_wait(&ctx->done_cv, &ctx->mu);
+    pthread_mutex_unlock(&ctx->mu);
+
+    int count = ctx->count;
+    BufHit hit = {0};
+    if (sel >= 0 && sel < count) hit = ctx->hits[sel];
+
+    free(ctx->hits);
+    pthread_cond_destroy(&ctx->done_cv);
+    pthread_mutex_destroy(&ctx->mu);
+    free(ctx);
+
+    if (sel < 0 || sel >= count) {
+        draw_ui(st);
+        return;
+    }
+
+    st->current_buffer = hit.buf_idx;
+    st->cursor_line = hit.lineno - 1;
+    st->cursor_col  = 0;
+    ensure_cursor_bounds(st);
+    ensure_cursor_visible(st);
+
+    char msg[256];
+    snprintf(msg, sizeof(msg), "%s:%d", basename_path(st->buffers[hit.buf_idx].filepath), hit.lineno);
+    set_status(st, msg);
+}
+
+/* A bracketed paste goes in verbatim: one splice and one undo step (joined
+ * with the current insert session, as typed text is), with no auto-pair or
+ * auto-indent.  On the command line only the first line is taken. */
+static void paste_bracketed(ViewerState *st) {
+    size_t len = 0;
+    char *text = read_bracketed_paste(&len);
+    if (!text) {
+        set_status(st, "Paste failed: out of memory");
+        return;
+    }
+
+    if (st->mode == MODE_COMMAND) {
+        for (size_t i = 0; i < len && text[i] != '\n'; i++) {
+            if (!isprint((unsigned char)text[i])) continue;
+            if (st->cmdlen >= (int)sizeof(st->cmdline) - 1) break;
+            st->cmdline[st->cmdlen++] = text[i];
+        }
+        st->cmdline[st->cmdlen] = '\0';
+    } else if (len > 0) {
+        Buffer *b = &st->buffers[st->current_buffer];
+        if (st->mode == MODE_INSERT) {
+            insert_undo_maybe_push(st, b);
+        } else {
+            st->mode = MODE_NORMAL;
+            undo_push(b);
+        }
+        buf_splice_text(b, st->cursor_line, st->cursor_col, text, len,
+                        &st->cursor_line, &st->cursor_col);
+    }
+    free(text);
+}
+
+static void handle_key(ViewerState *st, int ch, int *running) {
+    if (ch == KEY_PASTE_BEGIN) {
+        paste_bracketed(st);
+        return;
+    }
+    if (ch == KEY_PASTE_END) return;
 
     if (st->mode == MODE_COMMAND) {
         handle_command_key(st, ch, running);
@@ -4220,7 +7500,12 @@ static void handle_input(ViewerState *st, int *running) {
     }
 
     if (st->mode != MODE_INSERT && ch == ':') {
+        int from_visual = (st->mode == MODE_VISUAL);
         enter_command_mode(st);
+        if (from_visual) {
+            snprintf(st->cmdline, sizeof(st->cmdline), "'<,'>");
+            st->cmdlen = (int)strlen(st->cmdline);
+        }
         return;
     }
 
@@ -4263,15 +7548,9 @@ static void handle_input(ViewerState *st, int *running) {
             st->mode = MODE_NORMAL;
             st->op_pending = OP_NONE;
             if (clip) {
-                for (const char *p = clip; *p; p++) {
-                    if (*p == '\n') insert_newline(b, &st->cursor_line, &st->cursor_col);
-                    else {
-                        insert_char_at(b, st->cursor_line, st->cursor_col, *p);
-                        st->cursor_col++;
-                    }
-                }
+                buf_splice_text(b, st->cursor_line, st->cursor_col, clip, strlen(clip),
+                                &st->cursor_line, &st->cursor_col);
                 free(clip);
-                b->dirty = 1;
             }
             ensure_cursor_visible(st);
             set_status(st, "Replaced selection");
@@ -4349,26 +7628,12 @@ static void handle_input(ViewerState *st, int *running) {
         if (ch == 'd' && st->op_pending == OP_DELETE) {
             clipboard_copy_text(b->lines[st->cursor_line]);
             undo_push(b);
-            free(b->lines[st->cursor_line]);
-            free(b->raw_lines[st->cursor_line]);
-            for (int i = st->cursor_line; i < b->line_count - 1; i++) {
-                b->lines[i] = b->lines[i + 1];
-                b->raw_lines[i] = b->raw_lines[i + 1];
-            }
-            b->lines[b->line_count - 1] = NULL;
-            b->raw_lines[b->line_count - 1] = NULL;
-            b->line_count--;
-            if (b->line_count <= 0) {
-                b->line_count = 1;
-                b->lines[0] = safe_strdup("");
-                b->raw_lines[0] = safe_strdup("");
-                st->cursor_line = 0;
-            }
+            buf_remove_lines(b, st->cursor_line, 1);
+            buf_ensure_nonempty(b);
             if (st->cursor_line >= b->line_count) {
                 st->cursor_line = b->line_count - 1;
             }
             st->cursor_col = 0;
-            b->dirty = 1;
             set_status(st, "Deleted line");
             st->op_pending = OP_NONE;
             ensure_cursor_visible(st);
@@ -4421,9 +7686,11 @@ static void handle_input(ViewerState *st, int *running) {
             get_cwd(cwd, sizeof(cwd));
             def_prog_mode();
             endwin();
+            term_bracketed_paste(0);
             tmux_toggle_terminal(cwd);
             reset_prog_mode();
-            refresh();
+            term_bracketed_paste(1);
+            screen_refresh();
             return;
         }
         case 'D': {
@@ -4431,9 +7698,11 @@ static void handle_input(ViewerState *st, int *running) {
             get_cwd(cwd, sizeof(cwd));
             def_prog_mode();
             endwin();
+            term_bracketed_paste(0);
             tmux_toggle_db(cwd);
             reset_prog_mode();
-            refresh();
+            term_bracketed_paste(1);
+            screen_refresh();
             return;
         }
         case 'P': {
@@ -4441,9 +7710,11 @@ static void handle_input(ViewerState *st, int *running) {
             get_cwd(cwd, sizeof(cwd));
             def_prog_mode();
             endwin();
+            term_bracketed_paste(0);
             tmux_toggle_peek(cwd);
             reset_prog_mode();
-            refresh();
+            term_bracketed_paste(1);
+            screen_refresh();
             return;
         }
         case '!': {
@@ -4451,9 +7722,11 @@ static void handle_input(ViewerState *st, int *running) {
             get_cwd(cwd, sizeof(cwd));
             def_prog_mode();
             endwin();
+            term_bracketed_paste(0);
             tmux_toggle_lldb(cwd);
             reset_prog_mode();
-            refresh();
+            term_bracketed_paste(1);
+            screen_refresh();
             return;
         }
         case 18:  do_redo(st); ensure_cursor_visible(st); return; // Ctrl+R
@@ -4497,6 +7770,14 @@ static void handle_input(ViewerState *st, int *running) {
             return;
         case 'L': st->show_line_numbers = !st->show_line_numbers; return;
         case 'T': st->wrap_enabled = !st->wrap_enabled; ensure_cursor_visible(st); return;
+        case 4:  // Ctrl+D
+            st->free_scroll = 0;
+            half_page(st, +1);
+            return;
+        case 21: // Ctrl+U
+            st->free_scroll = 0;
+            half_page(st, -1);
+            return;
         case 5:  // Ctrl+E
             st->free_scroll = 1;
             scroll_viewport(st, +1);
@@ -4593,11 +7874,7 @@ static void handle_insert_key(ViewerState *st, int ch) {
                     memcpy(ns, line, (size_t)(col));
                     memcpy(ns + col, line + col + 1, (size_t)(len - col));
                     ns[len - 1] = '\0';
-                    free(b->lines[st->cursor_line]);
-                    b->lines[st->cursor_line] = ns;
-                    free(b->raw_lines[st->cursor_line]);
-                    b->raw_lines[st->cursor_line] = safe_strdup(ns);
-                    b->dirty = 1;
+                    buf_set_line(b, st->cursor_line, ns);
                 }
             }
         }
@@ -4624,33 +7901,27 @@ static void handle_insert_key(ViewerState *st, int ch) {
             if (before == '{' && after == '}') add_extra = 1;
         }
 
-        char indent[MAX_LINE_LEN];
-        int copy = (ws_len < (int)sizeof(indent) - 1) ? ws_len : (int)sizeof(indent) - 1;
-        memcpy(indent, cur_line, (size_t)copy);
-        indent[copy] = '\0';
-
-        insert_newline(b, &st->cursor_line, &st->cursor_col);
-
-        for (int i = 0; i < copy; i++) {
-            insert_char_at(b, st->cursor_line, st->cursor_col, indent[i]);
-            st->cursor_col++;
+        /* "\n" + indent, and between braces "    \n" + indent for the
+         * closing line, spliced in one go */
+        char ins[2 * MAX_LINE_LEN + 8];
+        int copy = (ws_len < MAX_LINE_LEN) ? ws_len : MAX_LINE_LEN;
+        int n = 0;
+        ins[n++] = '\n';
+        memcpy(ins + n, cur_line, (size_t)copy);
+        n += copy;
+        int inner_col = n - 1;
+        if (add_extra) {
+            memcpy(ins + n, "    \n", 5);
+            n += 5;
+            inner_col += 4;
+            memcpy(ins + n, cur_line, (size_t)copy);
+            n += copy;
         }
 
+        int inner_line = st->cursor_line + 1;
+        buf_splice_text(b, st->cursor_line, col, ins, (size_t)n,
+                        &st->cursor_line, &st->cursor_col);
         if (add_extra) {
-            for (int i = 0; i < 4; i++) {
-                insert_char_at(b, st->cursor_line, st->cursor_col, ' ');
-                st->cursor_col++;
-            }
-
-            int inner_line = st->cursor_line;
-            int inner_col  = st->cursor_col;
-
-            insert_newline(b, &st->cursor_line, &st->cursor_col);
-            for (int i = 0; i < copy; i++) {
-                insert_char_at(b, st->cursor_line, st->cursor_col, indent[i]);
-                st->cursor_col++;
-            }
-
             st->cursor_line = inner_line;
             st->cursor_col  = inner_col;
         }
@@ -4661,10 +7932,8 @@ static void handle_insert_key(ViewerState *st, int ch) {
 
     if (ch == '\t') {
         insert_undo_maybe_push(st, b);
-        for (int i = 0; i < 4; i++) {
-            insert_char_at(b, st->cursor_line, st->cursor_col, ' ');
-            st->cursor_col++;
-        }
+        buf_splice_text(b, st->cursor_line, st->cursor_col, "    ", 4,
+                        &st->cursor_line, &st->cursor_col);
         return;
     }
 
@@ -4711,14 +7980,116 @@ static void handle_insert_key(ViewerState *st, int ch) {
 static void usage(const char *prog) {
     fprintf(stderr,
         "Usage:\n"
-        "  %s [--no-wrap] <file1> [file2 ...]\n"
+        "  %s [--no-wrap] [--vt] <file1> [file2 ...]\n"
         "  %s -           (read from stdin)\n",
         prog, prog
     );
 }
 
+/* Keys already queued when one arrives are applied before the next redraw,
+ * so a held key or a burst over a slow link costs one frame, not one per
+ * key.  The burst is capped to keep the screen moving under endless input. */
+#define INPUT_BURST_MAX 512
+
+static void handle_input(ViewerState *st, int *running) {
+    int ch = getch();
+    for (int n = 1; ; n++) {
+        handle_key(st, ch, running);
+        if (!*running || g_exit_signal || n >= INPUT_BURST_MAX) break;
+
+        ensure_cursor_bounds(st);
+        if (!st->free_scroll) ensure_cursor_visible(st);
+
+        timeout(0);
+        ch = getch();
+        timeout(-1);
+        if (ch == ERR) break;
+    }
+}
+
+#ifdef VIC_BENCH
+// -----------------------------
+// Scanning benchmark (make bench)
+// Times the byte-scanning kernels against their one-byte-at-a-time
+// equivalents on generated log lines, then exits.
+// -----------------------------
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Cell width by the per-cluster walk alone, as before the kernels. */
+static int bench_width_scalar(const char *s) {
+    int i = 0, cells = 0;
+    while (s[i]) cell_step(s, &i, &cells);
+    return cells;
+}
+
+static int bench_width_kernel(const char *s) {
+    return cells_to_byte(s, strlen(s), 0, 0, INT_MAX);
+}
+
+static int scan_bench(void) {
+    enum { BENCH_LINES = 4096, BENCH_ROUNDS = 64 };
+    static const char *const kinds[] = { "plain", "ansi", "tabs", "utf-8" };
+    char **lines = (char**)malloc(BENCH_LINES * sizeof(char*));
+    if (!lines) return 1;
+    unsigned seed = 1;
+    for (int k = 0; k < BENCH_LINES; k++) {
+        char buf[512];
+        seed = seed * 1103515245u + 12345u;
+        int n = snprintf(buf, sizeof(buf),
+                         "2024-05-%02d 12:%02d:%02d.%03u INFO  [worker-%u] request id=%08x path=/api/v1/items/%u status=200 bytes=%u",
+                         k % 28 + 1, k % 60, (k * 7) % 60, k % 1000, k % 16,
+                         seed, k, seed % 65536);
+        switch (k % 4) {
+        case 1: snprintf(buf + n, sizeof(buf) - (size_t)n, " \x1b[32mok\x1b[0m"); break;
+        case 2: snprintf(buf + n, sizeof(buf) - (size_t)n, "\tlatency=\t%ums", k % 500); break;
+        case 3: snprintf(buf + n, sizeof(buf) - (size_t)n, " user=J\xc3\xbcrgen \xe6\x97\xa5\xe6\x9c\xac"); break;
+        }
+        lines[k] = strdup(buf);
+    }
+
+    for (int kind = 0; kind < 4; kind++) {
+        double t_ws = 0, t_wk = 0, t_ss = 0, t_sk = 0;
+        long long sum_s = 0, sum_k = 0;
+        for (int r = 0; r < BENCH_ROUNDS; r++) {
+            double t0 = bench_now();
+            for (int k = kind; k < BENCH_LINES; k += 4) sum_s += bench_width_scalar(lines[k]);
+            double t1 = bench_now();
+            for (int k = kind; k < BENCH_LINES; k += 4) sum_k += bench_width_kernel(lines[k]);
+            double t2 = bench_now();
+            for (int k = kind; k < BENCH_LINES; k += 4) {
+                size_t n = strlen(lines[k]);
+                sum_s += (long long)scan_until_scalar(lines[k], n, SCAN_ESC | SCAN_BS);
+            }
+            double t3 = bench_now();
+            for (int k = kind; k < BENCH_LINES; k += 4) {
+                size_t n = strlen(lines[k]);
+                sum_k += (long long)scan_until(lines[k], n, SCAN_ESC | SCAN_BS);
+            }
+            double t4 = bench_now();
+            t_ws += t1 - t0; t_wk += t2 - t1; t_ss += t3 - t2; t_sk += t4 - t3;
+        }
+        double per = 1e9 / ((double)BENCH_ROUNDS * BENCH_LINES / 4);
+        printf("%-6s  width %7.1f -> %7.1f ns/line   esc/bs %6.1f -> %6.1f ns/line%s\n",
+               kinds[kind], t_ws * per, t_wk * per, t_ss * per, t_sk * per,
+               sum_s == sum_k ? "" : "   MISMATCH");
+    }
+
+    for (int k = 0; k < BENCH_LINES; k++) free(lines[k]);
+    free(lines);
+    return 0;
+}
+#endif
+
 int main(int argc, char *argv[]) {
     setlocale(LC_ALL, "");
+#ifdef VIC_BENCH
+    (void)argc; (void)argv;
+    return scan_bench();
+#endif
 
     ViewerState *st = (ViewerState*)calloc(1, sizeof(ViewerState));
     if (!st) {
@@ -4727,6 +8098,7 @@ int main(int argc, char *argv[]) {
     }
 
     atexit(temp_cleanup_all);
+    ev_init();
     install_exit_signal_handlers();
 
     st->show_line_numbers = 1;
@@ -4745,6 +8117,9 @@ int main(int argc, char *argv[]) {
         if (strcmp(argv[i], "--no-wrap") == 0) {
             st->wrap_enabled = 0;
             arg_start = i + 1;
+        } else if (strcmp(argv[i], "--vt") == 0) {
+            g_vt.on = 1;
+            arg_start = i + 1;
         } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
             usage(argv[0]);
             free(st);
@@ -4763,35 +8138,34 @@ int main(int argc, char *argv[]) {
             return 1;
         }
 
-        if (load_stdin(&st->buffers[st->buffer_count]) == 0) {
+        int rc = load_stdin(&st->buffers[st->buffer_count]);
+        if (rc == 0) {
             st->buffer_count++;
             loaded_anything = 1;
         } else {
-            fprintf(stderr, "No data on stdin\n");
+            fprintf(stderr, rc == -1 ? "No data on stdin\n" : "Failed to read stdin\n");
             free(st);
             return 1;
         }
     } else {
-        for (int i = arg_start; i < argc && st->buffer_count < MAX_BUFFERS; i++) {
+        LoadBatch *lb = load_batch_new();
+        if (!lb) {
+            fprintf(stderr, "alloc failed\n");
+            free(st);
+            return 1;
+        }
+        for (int i = arg_start; i < argc && lb->n < MAX_BUFFERS; i++) {
             if (strcmp(argv[i], "-") == 0) {
-                if (load_stdin(&st->buffers[st->buffer_count]) == 0) {
-                    st->buffer_count++;
-                    loaded_anything = 1;
-                } else {
-                    fprintf(stderr, "Failed to load stdin\n");
-                }
+                Buffer tmp;
+                if (load_stdin(&tmp) == 0) load_batch_add(lb, argv[i], &tmp);
+                else fprintf(stderr, "Failed to load stdin\n");
                 continue;
             }
 
             if (is_dir_path(argv[i])) {
                 char *picked = pick_file_from_dir_raw(argv[i]);
                 if (picked) {
-                    if (load_file(&st->buffers[st->buffer_count], picked) == 0) {
-                        st->buffer_count++;
-                        loaded_anything = 1;
-                    } else {
-                        fprintf(stderr, "Failed to load %s\n", picked);
-                    }
+                    load_batch_add_path(lb, picked);
                     free(picked);
                 } else {
                     fprintf(stderr, "No file selected in dir %s\n", argv[i]);
@@ -4799,13 +8173,11 @@ int main(int argc, char *argv[]) {
                 continue;
             }
 
-            if (load_file(&st->buffers[st->buffer_count], argv[i]) == 0) {
-                st->buffer_count++;
-                loaded_anything = 1;
-            } else {
-                fprintf(stderr, "Failed to load %s\n", argv[i]);
-            }
+            load_batch_add_path(lb, argv[i]);
         }
+        load_batch_start(lb);
+        if (load_batch_wait_first(st, lb)) load_batch_free(lb);
+        loaded_anything = st->buffer_count > 0;
     }
 
     if (!loaded_anything || st->buffer_count == 0) {
@@ -4846,6 +8218,13 @@ int main(int argc, char *argv[]) {
     noecho();
     keypad(stdscr, TRUE);
     curs_set(1);
+    idlok(stdscr, TRUE);  /* let doupdate() use hardware scrolling */
+    if (g_vt.on) vt_init();
+#ifdef NCURSES_EXT_FUNCS
+    define_key("\033[200~", KEY_PASTE_BEGIN);
+    define_key("\033[201~", KEY_PASTE_END);
+    term_bracketed_paste(1);
+#endif
 
     if (has_colors()) {
         start_color();
@@ -4873,6 +8252,7 @@ int main(int argc, char *argv[]) {
     ensure_cursor_bounds(st);
     ensure_cursor_visible(st);
 
+    int tty_fd = tty_in ? fileno(tty_in) : STDIN_FILENO;
     int running = 1;
     while (running) {
         if (g_exit_signal) {
@@ -4882,6 +8262,7 @@ int main(int argc, char *argv[]) {
 
         ensure_cursor_bounds(st);
         draw_ui(st);
+        if (!ev_wait(st, tty_fd)) continue;
         handle_input(st, &running);
         ensure_cursor_bounds(st);
         if (!st->free_scroll) ensure_cursor_visible(st);
@@ -4889,11 +8270,15 @@ int main(int argc, char *argv[]) {
 
     if (curses_started) {
         endwin();
+        term_bracketed_paste(0);
         if (screen) { delscreen(screen); screen = NULL; }
+        vt_free();
         if (tty_in) { fclose(tty_in); tty_in = NULL; }
     }
 
     temp_cleanup_all();
+    pool_shutdown();
+    ev_run_posted(st);
 
     for (int i = 0; i < st->buffer_count; i++) free_buffer(&st->buffers[i]);
     for (int i = 0; i < st->cmdhist_len; i++) free(st->cmdhist[i]);